@@ -0,0 +1,21 @@
+// Arduino.h (host-test fake)
+// what sketch/lora-work.cpp needs from the Arduino core and FreeRTOS:
+// millis() on the fake LMIC's virtual clock (fake/lmic.cpp), and portMUX
+// critical sections, which are no-ops as the simulation is single threaded
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void) (mux))
+#define portEXIT_CRITICAL(mux)  ((void) (mux))
+
+uint32_t millis();
+
+#endif
@@ -0,0 +1,376 @@
+// lmic.cpp (host-test fake)
+// the fake LMIC's job scheduler, MAC and radio model and gateway (see
+// lmic.h); the MAC follows MCCI LMIC's lmic.c closely enough that the
+// uplink pipeline sees the same opmode, duty cycle and event sequence
+
+#include <string.h>
+#include <math.h>
+#include "Arduino.h"
+#include "lmic.h"
+
+struct lmic_t LMIC;
+int64_t fakeNow = 0;
+fake_gateway_t fakeGateway;
+
+uint32_t millis() { return (uint32_t) (fakeNow * 1000 / OSTICKS_PER_SEC); }
+ostime_t os_getTime() { return (ostime_t) fakeNow; }
+
+// the scheduler (oslmic.c): jobs to run now, and timed jobs by deadline
+static osjob_t *runnable = NULL, *scheduled = NULL;
+
+static void unlinkJob(osjob_t **list, osjob_t *job) {
+  for(; *list != NULL; list = &(*list)->next)
+    if(*list == job) { *list = job->next; return; }
+}
+
+void os_clearCallback(osjob_t *job) {
+  unlinkJob(&runnable, job);
+  unlinkJob(&scheduled, job);
+}
+
+void os_setCallback(osjob_t *job, osjobcb_t cb) {
+  os_clearCallback(job);
+  job->func = cb;
+  job->next = NULL;
+  osjob_t **p = &runnable;
+  while(*p != NULL) p = &(*p)->next;
+  *p = job;
+}
+
+void os_setTimedCallback(osjob_t *job, ostime_t time, osjobcb_t cb) {
+  os_clearCallback(job);
+  job->func = cb;
+  job->deadline = time;
+  osjob_t **p = &scheduled;
+  while(*p != NULL && (*p)->deadline - time <= 0) p = &(*p)->next;
+  job->next = *p;
+  *p = job;
+}
+
+bit_t os_queryTimeCriticalJobs(ostime_t time) {
+  return scheduled != NULL && scheduled->deadline - os_getTime() < time;
+}
+
+// the MAC and radio //////////////////////////////////////////////////////
+static const int64_t NEVER = INT64_MAX;
+static const u1_t JOIN_LEN = 10;        // (23 bytes with the framing)
+static const u1_t ACCEPT_LEN = 4;       // (17)
+static struct {
+  void (*cb)(void *, ev_t);
+  void *userData;
+  u1_t port, len, data[MAX_LEN_PAYLOAD];
+  bool replied, ack;                    // what the gateway made of this TX
+  u1_t rxPort, rxLen, rx[16];
+  int16_t rxSnrTenths;
+  int64_t irqAt;                        // the next DIO edge, and what it is
+  void (*irq)(ostime_t at);
+  uint32_t seed;
+} mac;
+
+static uint32_t rnd() {
+  mac.seed = mac.seed * 1103515245 + 12345;
+  return mac.seed >> 16;
+}
+static bool chance(uint8_t percent) { return rnd() % 100 < percent; }
+
+static void report(ev_t ev) { if(mac.cb != NULL) mac.cb(mac.userData, ev); }
+
+static uint8_t sfOf(dr_t dr) { return dr <= DR_SF7 ? 12 - dr : 7; }
+
+// demodulation floor (dB x 10) for SF7 to SF12 (SX127x datasheet)
+static int16_t floorFor(uint8_t sf) {
+  static const int16_t floors[] = { -75, -100, -125, -150, -175, -200 };
+  return floors[sf - 7];
+}
+
+// LoRa time on air (SX127x datasheet) at 125 kHz, CR 4/5, 8 preamble
+// symbols, explicit header and CRC; len is the application payload, plus
+// 13 bytes of LoRaWAN framing
+uint32_t fake_airtime_ms(uint8_t sf, uint8_t len) {
+  double symbolMs = (1 << sf) / 125.0;
+  int lowRate = sf >= 11 ? 1 : 0;
+  double n = ceil(
+    (8.0 * (len + 13) - 4 * sf + 28 + 16) / (4.0 * (sf - 2 * lowRate))
+  );
+  return (uint32_t) ceil((8 + 4.25 + 8 + (n > 0 ? n * 5 : 0)) * symbolMs);
+}
+
+static ostime_t rxTimeout(uint8_t sf) {  // 8 symbols, as LMIC listens
+  return ms2osticks(8 * (1 << sf) / 125);
+}
+
+static bool usable(u1_t ch, dr_t dr) {
+  return (LMIC.channelMap & (1 << ch)) && LMIC.channelFreq[ch] != 0 &&
+    (LMIC.channelDrMap[ch] & (1 << dr));
+}
+
+static void txStart(osjob_t *job);
+
+// run the TX (if any is wanted) as soon as a usable channel's band and
+// the global duty cycle allow
+static void engineUpdate() {
+  if(LMIC.opmode & OP_TXRXPEND) return;
+  if(!(LMIC.opmode & (OP_TXDATA | OP_JOINING))) return;
+  ostime_t now = os_getTime(), txbeg = 0;
+  bool found = false;
+  for(u1_t ch = 0; ch < MAX_CHANNELS; ch++) {
+    if(!usable(ch, LMIC.datarate)) continue;
+    ostime_t a = LMIC.bands[LMIC.channelFreq[ch] & 0x3].avail;
+    if(!found || a - txbeg < 0) txbeg = a;
+    found = true;
+  }
+  if(!found) return;
+  if(LMIC.globalDutyAvail - txbeg > 0) txbeg = LMIC.globalDutyAvail;
+  if(txbeg - now < 0) txbeg = now;
+  os_setTimedCallback(&LMIC.osjob, txbeg, txStart);
+}
+
+static void rx1Open(osjob_t *job);
+static void rx2Open(osjob_t *job);
+static void txComplete();
+
+static void irqAt(int64_t at, void (*irq)(ostime_t)) {
+  mac.irqAt = at;
+  mac.irq = irq;
+}
+
+static void txDone(ostime_t at) {        // (DIO0: TxDone)
+  LMIC.txend = at;
+  os_setTimedCallback(
+    &LMIC.osjob, LMIC.txend + sec2osticks(LMIC.rxDelay), rx1Open
+  );
+}
+
+static void rxDone(ostime_t) {           // (DIO0: RxDone, in RX1)
+  bool port = mac.rxLen > 0;
+  LMIC.txrxFlags = TXRX_DNW1 | (mac.ack ? TXRX_ACK : 0) |
+    (port ? TXRX_PORT : TXRX_NOPORT);
+  LMIC.dataBeg = LMIC.dataLen = 0;
+  if(port) {
+    LMIC.frame[8] = mac.rxPort;          // (after MHDR, FHDR)
+    memcpy(LMIC.frame + 9, mac.rx, mac.rxLen);
+    LMIC.dataBeg = 9;
+    LMIC.dataLen = mac.rxLen;
+  }
+  LMIC.snr = mac.rxSnrTenths * 4 / 10;
+  LMIC.rssi = -110 + mac.rxSnrTenths / 10 + 64;
+  LMIC.seqnoDn++;
+  if(!(LMIC.opmode & OP_JOINING)) { txComplete(); return; }
+
+  LMIC.devaddr = 0x260B0001;             // join accept
+  LMIC.seqnoUp = LMIC.seqnoDn = 0;
+  LMIC.txrxFlags = LMIC.dataBeg = LMIC.dataLen = 0;
+  LMIC.opmode &= ~(OP_JOINING | OP_TXRXPEND);
+  report(EV_JOINED);
+  engineUpdate();                        // (an uplink may be waiting)
+}
+
+static void rx1Timeout(ostime_t) {       // (DIO1: RxTimeout)
+  os_setTimedCallback(
+    &LMIC.osjob, LMIC.txend + sec2osticks(LMIC.rxDelay + 1), rx2Open
+  );
+}
+
+static void rx2Timeout(ostime_t) {
+  if(!(LMIC.opmode & OP_JOINING)) { txComplete(); return; }
+  LMIC.opmode &= ~OP_TXRXPEND;           // no join accept: try again later
+  report(EV_JOIN_TXCOMPLETE);
+  ostime_t later = os_getTime() + sec2osticks(10);
+  if(LMIC.globalDutyAvail - later < 0) LMIC.globalDutyAvail = later;
+  engineUpdate();
+}
+
+static void rx1Open(osjob_t *) {
+  uint8_t sf = sfOf(LMIC.datarate);
+  uint8_t len = LMIC.opmode & OP_JOINING ? ACCEPT_LEN : mac.rxLen;
+  if(mac.replied)
+    irqAt(fakeNow + ms2osticks(fake_airtime_ms(sf, len)), rxDone);
+  else
+    irqAt(fakeNow + rxTimeout(sf), rx1Timeout);
+}
+
+static void rx2Open(osjob_t *) {         // (TTN's RX2 is at SF9)
+  irqAt(fakeNow + rxTimeout(9), rx2Timeout);
+}
+
+// every other retransmission of a confirmed uplink goes a step slower
+static const u1_t DRADJUST[2 + TXCONF_ATTEMPTS] = { 0, 0, 1, 0, 1, 0, 1 };
+
+static void txComplete() {
+  if(LMIC.pendTxConf && !(LMIC.txrxFlags & TXRX_ACK)) {
+    if(LMIC.txCnt < TXCONF_ATTEMPTS) {   // retransmit, after 0 to 3 s
+      LMIC.txCnt++;
+      if(DRADJUST[LMIC.txCnt] && LMIC.datarate > DR_SF12) LMIC.datarate--;
+      LMIC.opmode &= ~OP_TXRXPEND;
+      ostime_t at = os_getTime() + rnd() % sec2osticks(3);
+      if(LMIC.globalDutyAvail - at < 0) LMIC.globalDutyAvail = at;
+      engineUpdate();
+      return;
+    }
+    LMIC.txrxFlags |= TXRX_NACK;
+  }
+  LMIC.opmode &= ~(OP_TXDATA | OP_TXRXPEND);
+  report(EV_TXCOMPLETE);
+}
+
+// the frame goes out on a free channel (picked at random, as LMIC does);
+// its band closes for airtime x txcap, and the gateway decides its fate
+static void txStart(osjob_t *) {
+  ostime_t now = os_getTime();
+  u1_t options[MAX_CHANNELS], n = 0;
+  for(u1_t ch = 0; ch < MAX_CHANNELS; ch++)
+    if(usable(ch, LMIC.datarate) &&
+      LMIC.bands[LMIC.channelFreq[ch] & 0x3].avail - now <= 0)
+      options[n++] = ch;
+  if(n == 0 || LMIC.globalDutyAvail - now > 0) { engineUpdate(); return; }
+  u1_t ch = options[rnd() % n];
+  bool joining = LMIC.opmode & OP_JOINING;
+
+  LMIC.opmode |= OP_TXRXPEND;
+  LMIC.txrxFlags = LMIC.dataBeg = LMIC.dataLen = 0;
+  if(!joining && LMIC.txCnt == 0) LMIC.seqnoUp++; // (a new frame counter)
+  LMIC.freq = LMIC.channelFreq[ch] & ~(u4_t) 0x3;
+  uint8_t sf = sfOf(LMIC.datarate);
+  uint32_t air = fake_airtime_ms(sf, joining ? JOIN_LEN : mac.len);
+  band_t &band = LMIC.bands[LMIC.channelFreq[ch] & 0x3];
+  band.avail = now + ms2osticks(air) * band.txcap;
+  LMIC.globalDutyAvail = now + ms2osticks(air);
+  fakeGateway.transmissions++;
+  fakeGateway.airtimeMs += air;
+  report(EV_TXSTART);
+
+  // the gateway: heard? then an ACK, join accept or downlink in RX1
+  int16_t snr = fakeGateway.snrTenths - (14 - LMIC.adrTxPow) * 10;
+  mac.replied = mac.ack = false;
+  mac.rxLen = 0;
+  if(snr < floorFor(sf) || chance(fakeGateway.lossPercent)) {
+    irqAt(fakeNow + ms2osticks(air), txDone);
+    return;
+  }
+  fakeGateway.heard++;
+  bool reply = joining || LMIC.pendTxConf || fakeGateway.dnLen > 0;
+  if(joining) {
+    fakeGateway.joins++;
+  } else {
+    fakeGateway.lastPort = mac.port;
+    fakeGateway.lastLen = mac.len;
+    memcpy(fakeGateway.last, mac.data, mac.len);
+  }
+  if(reply && !chance(fakeGateway.lossPercent)) {
+    mac.replied = true;
+    mac.rxSnrTenths = snr + (int16_t) (rnd() % 21) - 10;
+    if(!joining) {
+      mac.ack = LMIC.pendTxConf;
+      if(mac.ack) fakeGateway.acks++;
+      mac.rxPort = fakeGateway.dnPort;
+      mac.rxLen = fakeGateway.dnLen;
+      memcpy(mac.rx, fakeGateway.dnData, fakeGateway.dnLen);
+      fakeGateway.dnLen = 0;
+    }
+  }
+  irqAt(fakeNow + ms2osticks(air), txDone);
+}
+
+// the run loop: a pending DIO interrupt first, then one job
+void os_runloop_once() {
+  if(mac.irqAt <= fakeNow) {
+    ostime_t at = (ostime_t) mac.irqAt;
+    mac.irqAt = NEVER;
+    mac.irq(at);
+  }
+  osjob_t *j = NULL;
+  if(runnable != NULL) {
+    j = runnable;
+    runnable = j->next;
+  } else if(scheduled != NULL && scheduled->deadline - os_getTime() <= 0) {
+    j = scheduled;
+    scheduled = j->next;
+  }
+  if(j != NULL) j->func(j);
+}
+
+// the API ////////////////////////////////////////////////////////////////
+static u1_t maxPayload(dr_t dr) {         // EU868, by data rate
+  return dr <= DR_SF10 ? 51 : dr == DR_SF9 ? 115 : 222;
+}
+
+lmic_tx_error_t LMIC_setTxData2(
+  u1_t port, u1_t *data, u1_t dlen, u1_t confirmed
+) {
+  if(dlen > MAX_LEN_PAYLOAD) return LMIC_ERROR_TX_TOO_LARGE;
+  if(LMIC.opmode & OP_TXDATA) return LMIC_ERROR_TX_BUSY;
+  if(dlen > maxPayload(LMIC.datarate)) return LMIC_ERROR_TX_NOT_FEASIBLE;
+  mac.port = port;
+  mac.len = dlen;
+  memcpy(mac.data, data, dlen);
+  LMIC.pendTxConf = confirmed;
+  LMIC.opmode |= OP_TXDATA;
+  if(!(LMIC.opmode & OP_JOINING)) LMIC.txCnt = 0;
+  engineUpdate();
+  return LMIC_ERROR_SUCCESS;
+}
+
+void LMIC_clrTxData() {
+  if(!(LMIC.opmode & OP_TXDATA)) return;
+  LMIC.opmode &= ~OP_TXDATA;
+  if(!(LMIC.opmode & OP_JOINING)) LMIC.opmode &= ~OP_TXRXPEND;
+  report(EV_TXCANCELED);
+  if(LMIC.opmode & OP_JOINING) return;
+  os_clearCallback(&LMIC.osjob);
+  mac.irqAt = NEVER;                     // (the radio is reset)
+  engineUpdate();
+}
+
+void LMIC_setDrTxpow(dr_t dr, s1_t txpow) {
+  if(txpow != KEEP_TXPOW) LMIC.adrTxPow = txpow;
+  LMIC.datarate = dr;
+}
+
+void LMIC_startJoining() {
+  if(LMIC.devaddr != 0 || (LMIC.opmode & OP_JOINING)) return;
+  LMIC.opmode |= OP_JOINING;
+  report(EV_JOINING);
+  engineUpdate();
+}
+
+void LMIC_registerEventCb(void (*cb)(void *, ev_t), void *userData) {
+  mac.cb = cb;
+  mac.userData = userData;
+}
+
+void fake_lmic_begin(uint8_t sf, bool joined, uint32_t seed) {
+  fakeNow = 0;
+  runnable = scheduled = NULL;
+  memset(&mac, 0, sizeof(mac));
+  mac.irqAt = NEVER;
+  mac.seed = seed;
+  memset(&fakeGateway, 0, sizeof(fakeGateway));
+  fakeGateway.snrTenths = 100;           // (a good link)
+
+  // as setupTtnChannels() leaves them: every LoRa channel in the 1% band
+  memset(&LMIC, 0, sizeof(LMIC));
+  static const u4_t freqs[] = {
+    868100000, 868300000, 868500000, 867100000, 867300000, 867500000,
+    867700000, 867900000,
+  };
+  for(u1_t ch = 0; ch < 8; ch++) {
+    LMIC.channelFreq[ch] = freqs[ch] | BAND_CENTI;
+    LMIC.channelDrMap[ch] =
+      DR_RANGE_MAP(DR_SF12, ch == 1 ? DR_SF7B : DR_SF7);
+  }
+  LMIC.channelFreq[8] = 868800000 | BAND_MILLI;
+  LMIC.channelDrMap[8] = DR_RANGE_MAP(DR_FSK, DR_FSK);
+  LMIC.channelMap = 0x1FF;
+  LMIC.bands[BAND_MILLI].txcap = 1000;
+  LMIC.bands[BAND_CENTI].txcap = 100;
+  LMIC.bands[BAND_DECI].txcap = 10;
+  LMIC.bands[BAND_AUX].txcap = 100;
+
+  LMIC.datarate = DR_SF7 - (sf - 7);
+  LMIC.adrTxPow = 14;
+  LMIC.adrEnabled = 1;
+  LMIC.rxDelay = 5;                      // TTN's RX1 delay (and join's)
+  LMIC.devaddr = joined ? 0x260B0001 : 0;
+}
+
+int64_t fake_lmic_irq_at() { return mac.irqAt; }
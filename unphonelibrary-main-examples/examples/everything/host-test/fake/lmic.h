@@ -0,0 +1,151 @@
+// lmic.h (host-test fake)
+// just enough of MCCI LMIC (EU868) for sketch/lora-work.cpp, over a virtual
+// clock: the os_* job scheduler as LMIC's oslmic.c runs it, and a MAC and
+// radio model (fake/lmic.cpp) with the channels and duty cycle bands that
+// ttn-lora.cpp's setupTtnChannels() configures (all eight LoRa channels in
+// the 1% band), airtime, RX1 and RX2 windows that end in DIO interrupts,
+// LMIC's retransmission of unacknowledged confirmed uplinks (stepping the
+// data rate down as it goes), OTAA joins, and a gateway that loses frames,
+// acknowledges and sends downlinks. names and values follow MCCI LMIC 4.1
+
+#ifndef FAKE_LMIC_H
+#define FAKE_LMIC_H
+
+#include <stdint.h>
+
+#define _LMIC_CONFIG_PRECONDITIONS_H_   // (so it's taken for MCCI LMIC)
+#ifndef CFG_eu868
+#  define CFG_eu868 1
+#endif
+#define CFG_LMIC_EU_like 1
+
+typedef uint8_t bit_t;
+typedef uint8_t u1_t;
+typedef int8_t s1_t;
+typedef uint16_t u2_t;
+typedef uint32_t u4_t;
+typedef int32_t s4_t;
+typedef int16_t s2_t;
+typedef int64_t s8_t;
+typedef u1_t dr_t;
+typedef u4_t devaddr_t;
+typedef s4_t ostime_t;
+typedef int lmic_tx_error_t;
+
+#define OSTICKS_PER_SEC 62500
+#define ms2osticks(ms)  ((ostime_t)( ((s8_t)(ms) * OSTICKS_PER_SEC) / 1000))
+#define sec2osticks(s)  ((ostime_t)( (s8_t)(s) * OSTICKS_PER_SEC))
+#define osticks2ms(os)  ((s4_t)(((os) * (s8_t)1000) / OSTICKS_PER_SEC))
+
+struct osjob_t;
+typedef void (*osjobcb_t)(struct osjob_t *);
+struct osjob_t {
+  struct osjob_t *next;
+  ostime_t deadline;
+  osjobcb_t func;
+};
+
+enum _ev_t {
+  EV_SCAN_TIMEOUT = 1, EV_BEACON_FOUND, EV_BEACON_MISSED, EV_BEACON_TRACKED,
+  EV_JOINING, EV_JOINED, EV_RFU1, EV_JOIN_FAILED, EV_REJOIN_FAILED,
+  EV_TXCOMPLETE, EV_LOST_TSYNC, EV_RESET, EV_RXCOMPLETE, EV_LINK_DEAD,
+  EV_LINK_ALIVE, EV_SCAN_FOUND, EV_TXSTART, EV_TXCANCELED, EV_RXSTART,
+  EV_JOIN_TXCOMPLETE,
+};
+typedef enum _ev_t ev_t;
+
+enum {                                  // LMIC.opmode
+  OP_NONE = 0x0000, OP_JOINING = 0x0004, OP_TXDATA = 0x0008,
+  OP_TXRXPEND = 0x0080,
+};
+enum {                                  // LMIC.txrxFlags
+  TXRX_ACK = 0x80, TXRX_NACK = 0x40, TXRX_NOPORT = 0x20, TXRX_PORT = 0x10,
+  TXRX_DNW2 = 0x02, TXRX_DNW1 = 0x01,
+};
+enum { DR_SF12, DR_SF11, DR_SF10, DR_SF9, DR_SF8, DR_SF7, DR_SF7B, DR_FSK };
+enum { BAND_MILLI, BAND_CENTI, BAND_DECI, BAND_AUX };
+#define DR_RANGE_MAP(lo, hi) ((u2_t) ((0xFFFF << (lo)) & (0xFFFF >> (15 - (hi)))))
+#define KEEP_TXPOW -128
+
+#define LMIC_ERROR_SUCCESS          0
+#define LMIC_ERROR_TX_BUSY         -1
+#define LMIC_ERROR_TX_TOO_LARGE    -2
+#define LMIC_ERROR_TX_NOT_FEASIBLE -3
+
+#define MAX_CHANNELS 16
+#define MAX_BANDS 4
+#define MAX_LEN_PAYLOAD 222
+#define MAX_LEN_FRAME (MAX_LEN_PAYLOAD + 13)
+#define TXCONF_ATTEMPTS 8               // tries for a confirmed uplink
+
+typedef struct {
+  u2_t txcap;                           // duty cycle: 1 / txcap
+  ostime_t avail;                       // the band is free from then
+} band_t;
+
+struct lmic_t {
+  osjob_t osjob;                        // the MAC's own job
+  u2_t opmode;
+  devaddr_t devaddr;
+  u4_t seqnoUp, seqnoDn;
+  dr_t datarate;
+  s1_t adrTxPow;
+  bit_t adrEnabled;
+  bit_t pendTxConf;                     // the TX data is confirmed
+  u1_t txCnt;                           // retransmissions so far
+  u1_t rxDelay;                         // RX1 delay, seconds
+  ostime_t txend, globalDutyAvail;
+  band_t bands[MAX_BANDS];
+  u4_t channelFreq[MAX_CHANNELS];       // frequency | band
+  u2_t channelDrMap[MAX_CHANNELS];
+  u2_t channelMap;
+  u4_t freq;                            // of the last TX
+  u1_t txrxFlags, dataBeg, dataLen;     // the last RX: payload at
+  u1_t frame[MAX_LEN_FRAME];            // frame + dataBeg
+  s1_t snr;                             // (SNR x 4)
+  s2_t rssi;                            // (dBm + 64)
+};
+extern struct lmic_t LMIC;
+
+// the LMIC API (the part lora-work.cpp and the simulation use)
+ostime_t os_getTime();
+void os_setCallback(osjob_t *job, osjobcb_t cb);
+void os_setTimedCallback(osjob_t *job, ostime_t time, osjobcb_t cb);
+void os_clearCallback(osjob_t *job);
+void os_runloop_once();
+bit_t os_queryTimeCriticalJobs(ostime_t time);
+lmic_tx_error_t LMIC_setTxData2(
+  u1_t port, u1_t *data, u1_t dlen, u1_t confirmed
+);
+void LMIC_clrTxData();
+void LMIC_setDrTxpow(dr_t dr, s1_t txpow);
+void LMIC_startJoining();
+void LMIC_registerEventCb(void (*cb)(void *, ev_t), void *userData);
+
+// the fake's own controls ///////////////////////////////////////////////////
+
+extern int64_t fakeNow;                 // the virtual clock, ticks (os_getTime
+                                        // wraps it to 32 bits, as LMIC does)
+
+// the gateway (and network server): it hears an uplink unless it's lost
+// (lossPercent of the time, and always when the link's SNR is below the
+// SF's demodulation floor), acknowledges confirmed uplinks and sends the
+// queued downlink in RX1 of the next uplink it hears; replies are lost as
+// often as uplinks. snrTenths is the link's SNR at full power
+typedef struct {
+  uint8_t lossPercent;
+  int16_t snrTenths;
+  uint8_t dnPort, dnLen, dnData[16];    // queued downlink (dnLen 0: none)
+  uint32_t transmissions, airtimeMs;    // every TX (retransmissions too)
+  uint32_t heard, acks, joins;
+  uint8_t lastPort, lastLen, last[MAX_LEN_PAYLOAD]; // the last frame heard
+} fake_gateway_t;
+extern fake_gateway_t fakeGateway;
+
+// power up: the clock at 0, no jobs, the TTN channels at SF sf, joined (a
+// restored or ABP session) or not; seed makes the losses repeatable
+void fake_lmic_begin(uint8_t sf, bool joined, uint32_t seed);
+int64_t fake_lmic_irq_at();             // the next DIO edge (INT64_MAX: none)
+uint32_t fake_airtime_ms(uint8_t sf, uint8_t len); // len: LoRaWAN payload
+
+#endif
@@ -0,0 +1,91 @@
+// lora-batch-test.cpp
+// LoraBatch / LoraBatchReader round trips, the frame size limit, int32
+// extremes (deltas that would overflow) and malformed frames
+
+#include "test.h"
+#include "lora-batch.h"
+
+static void roundTrip() {
+  LoraBatch b(15 * 60 * 1000UL);
+  uint8_t frame[LORA_BATCH_MAX];
+  CHECK(b.add(0, 4100, 1000, false));
+  CHECK(b.add(1, -215, 1000, false));
+  CHECK(b.add(0, 4095, 61000, false));     // a minute later
+  CHECK(!b.due(61000) && b.size() == 3);
+  CHECK(b.dueIn(61000) == 15 * 60 * 1000UL - 60000);  // (age from the first)
+  CHECK(b.dueIn(15 * 60 * 1000UL + 1000) == 0);
+  uint8_t len = b.flush(frame, 121000);
+  CHECK(len > 0 && b.empty() && b.dueIn(121000) == UINT32_MAX);
+
+  LoraBatchReader r(frame, len);
+  lora_reading_t got;
+  CHECK(r.next(&got) && got.channel == 0 && got.value == 4100);
+  CHECK(got.secsAgo == 120);
+  CHECK(r.next(&got) && got.channel == 1 && got.value == -215);
+  CHECK(r.next(&got) && got.channel == 0 && got.value == 4095);
+  CHECK(got.secsAgo == 60);
+  CHECK(!r.next(&got) && !r.malformed());
+
+  CHECK(b.add(2, 1, 0, true) && b.due(0));  // priority: due at once
+  CHECK(b.dueIn(0) == 0);
+  CHECK(!b.add(LORA_BATCH_CHANNELS, 1, 0, false));
+}
+
+static void sizeLimit() {
+  LoraBatch b(0);
+  uint8_t frame[LORA_BATCH_MAX];
+  uint16_t added = 0;
+  while(b.add(added % 4, 1000000 * (added % 2), 0, false)) added++;
+  CHECK(b.full() && b.due(0) && added > 3);
+  uint8_t len = b.flush(frame, 0);
+  CHECK(len <= LORA_BATCH_MAX && len <= 51); // (fits SF12)
+
+  LoraBatchReader r(frame, len);
+  lora_reading_t got;
+  uint16_t read = 0;
+  while(r.next(&got)) read++;
+  CHECK(read == added && !r.malformed());
+}
+
+static void extremes() {
+  LoraBatch b(0);
+  uint8_t frame[LORA_BATCH_MAX];
+  const int32_t values[] = { INT32_MAX, INT32_MIN, INT32_MAX, -1, INT32_MIN };
+  for(int32_t v : values)
+    CHECK(b.add(3, v, 0, false));
+  uint8_t len = b.flush(frame, 0);
+
+  LoraBatchReader r(frame, len);
+  lora_reading_t got;
+  for(int32_t v : values)
+    CHECK(r.next(&got) && got.value == v);
+  CHECK(!r.next(&got) && !r.malformed());
+}
+
+static void malformed() {
+  lora_reading_t got;
+  LoraBatchReader empty(NULL, 0);
+  CHECK(!empty.next(&got) && empty.malformed());
+
+  const uint8_t version[] = { 9, 0 };
+  LoraBatchReader v(version, sizeof(version));
+  CHECK(!v.next(&got) && v.malformed());
+
+  const uint8_t channel[] = {
+    LORA_BATCH_VERSION, 0, LORA_BATCH_CHANNELS, 0, 0
+  };
+  LoraBatchReader c(channel, sizeof(channel));
+  CHECK(!c.next(&got) && c.malformed());
+
+  const uint8_t cut[] = { LORA_BATCH_VERSION, 0, 1, 0x80 }; // varint cut off
+  LoraBatchReader t(cut, sizeof(cut));
+  CHECK(!t.next(&got) && t.malformed());
+}
+
+int main() {
+  roundTrip();
+  sizeLimit();
+  extremes();
+  malformed();
+  return testsDone("lora-batch");
+}
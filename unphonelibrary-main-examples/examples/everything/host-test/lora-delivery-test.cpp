@@ -0,0 +1,157 @@
+// lora-delivery-test.cpp
+// LoraDelivery: QUEUED -> SENT / ACKED / FAILED, retry backoff and slots,
+// latency percentiles, and confirmed uplinks through a lossy gateway
+
+#include "test.h"
+#include "lora-delivery.h"
+
+static lora_msg_t message(uint32_t id, bool confirmed, uint32_t atMs,
+  uint8_t priority = 0) {
+  lora_msg_t m;
+  memset(&m, 0, sizeof(m));
+  m.id = id;
+  m.port = 2;
+  m.confirmed = confirmed;
+  m.priority = priority;
+  m.enqueuedMs = atMs;
+  m.len = 1;
+  return m;
+}
+
+static void states() {
+  LoraDelivery d;
+  uint32_t id = 0;
+  CHECK(d.stats().successRate == -1 && d.stats().samples == 0);
+  CHECK(d.completed(true, false, 0, &id) == LORA_FAILED && id == 0); // idle
+
+  d.sent(message(1, false, 0), 0);
+  CHECK(d.completed(false, false, 700, &id) == LORA_SENT && id == 1);
+  d.sent(message(2, true, 1000), 0);
+  CHECK(d.completed(true, false, 6000, &id) == LORA_ACKED && id == 2);
+  CHECK(d.refused() == LORA_FAILED);
+
+  lora_delivery_stats_t s = d.stats();
+  CHECK(s.sent == 1 && s.acked == 1 && s.failed == 1 && s.retries == 0);
+  CHECK(s.successRate == 0.5f && s.samples == 2);
+  CHECK(s.p50Ms == 5000 && s.p99Ms == 5000);
+
+  // a cancelled TX is retried, confirmed or not
+  d.sent(message(3, false, 0), 0);
+  CHECK(d.completed(false, true, 100, &id) == LORA_QUEUED && id == 3);
+  CHECK(d.nextRetryIn(100) == 30000);
+}
+
+// an unacknowledged message comes back after 30, 60 and 120 s, then fails
+static void backoff() {
+  LoraDelivery d;
+  uint32_t id = 0, now = 0;
+  lora_msg_t m;
+  uint8_t attempts = 0;
+  CHECK(d.nextRetryIn(now) == UINT32_MAX && !d.takeRetry(now, &m, &attempts));
+
+  d.sent(message(7, true, 0), 0);
+  uint32_t wait = 30000;
+  for(uint8_t retry = 1; retry <= 3; retry++, wait *= 2) {
+    now += 6000;
+    CHECK(d.completed(false, false, now, &id) == LORA_QUEUED && id == 7);
+    CHECK(d.nextRetryIn(now) == wait && d.retriesDue(now) == 0);
+    CHECK(!d.takeRetry(now + wait - 1, &m, &attempts)); // not yet
+    now += wait;
+    CHECK(d.retriesDue(now) == 1 && d.nextRetryIn(now) == 0);
+    CHECK(d.takeRetry(now, &m, &attempts));
+    CHECK(m.id == 7 && attempts == retry);
+    d.sent(m, attempts);
+  }
+  now += 6000;
+  CHECK(d.completed(false, false, now, &id) == LORA_FAILED && id == 7);
+  CHECK(d.nextRetryIn(now) == UINT32_MAX);
+  lora_delivery_stats_t s = d.stats();
+  CHECK(s.retries == 3 && s.failed == 1 && s.successRate == 0);
+  CHECK(s.samples == 0);                    // (failures have no latency)
+}
+
+// four retries wait at once; due ones are taken highest priority first
+static void slots() {
+  LoraDelivery d;
+  uint32_t id = 0;
+  for(uint32_t i = 1; i <= 5; i++) {
+    d.sent(message(i, true, 0, i == 2 ? 9 : 0), 0);
+    lora_delivery_state_t st = d.completed(false, false, 1000, &id);
+    CHECK(st == (i <= 4 ? LORA_QUEUED : LORA_FAILED));
+  }
+  CHECK(d.retriesDue(31000) == 4);
+  lora_msg_t m;
+  uint8_t attempts;
+  CHECK(d.takeRetry(31000, &m, &attempts) && m.id == 2); // priority 9
+  CHECK(d.takeRetry(31000, &m, &attempts) && m.id != 2);
+  CHECK(d.retriesDue(31000) == 2);
+}
+
+// the last 32 latencies: nearest rank percentiles
+static void percentiles() {
+  LoraDelivery d;
+  uint32_t id;
+  for(uint32_t i = 1; i <= 64; i++) {       // (the first 32 roll off)
+    uint32_t took = i <= 32 ? 999999 : 100 * (65 - i); // 3200 down to 100
+    d.sent(message(i, false, 0), 0);
+    d.completed(false, false, took, &id);
+  }
+  lora_delivery_stats_t s = d.stats();
+  CHECK(s.samples == 32 && s.sent == 64);
+  CHECK(s.p50Ms == 1700 && s.p90Ms == 2900 && s.p99Ms == 3200);
+}
+
+// confirmed messages through a gateway losing lossPercent of uplinks and
+// of ACKs, with LMIC sending each once: every message ends ACKED or FAILED
+// exactly once, and the stats agree
+static void lossyGateway(uint8_t lossPercent) {
+  static const uint32_t MESSAGES = 200;
+  LoraDelivery d;
+  uint32_t seed = 7, now = 0, next = 1, finals = 0, acked = 0;
+  uint8_t outcome[MESSAGES + 1];
+  memset(outcome, 0, sizeof(outcome));
+  while(next <= MESSAGES || d.nextRetryIn(now) != UINT32_MAX) {
+    lora_msg_t m;
+    uint8_t attempts = 0;
+    if(!d.takeRetry(now, &m, &attempts)) {
+      if(next > MESSAGES) { now += d.nextRetryIn(now); continue; }
+      m = message(next++, true, now);
+    }
+    d.sent(m, attempts);
+    now += 6000;                            // TX and RX windows
+    seed = seed * 1103515245 + 12345;
+    bool heard = (seed >> 16) % 100 >= lossPercent;
+    seed = seed * 1103515245 + 12345;
+    bool ack = heard && (seed >> 16) % 100 >= lossPercent;
+    uint32_t id = 0;
+    lora_delivery_state_t st = d.completed(ack, false, now, &id);
+    CHECK(id == m.id && st != LORA_SENT);
+    if(st == LORA_QUEUED) continue;
+    CHECK(outcome[id] == 0);                // (only one final state)
+    outcome[id] = st;
+    finals++;
+    if(st == LORA_ACKED) acked++;
+    now += 1000;
+  }
+  lora_delivery_stats_t s = d.stats();
+  printf(
+    "lora-delivery: %u%% loss: %u acked, %u failed, %u retries, "
+    "latency p50 %u ms, p90 %u ms, p99 %u ms\n", lossPercent, s.acked,
+    s.failed, s.retries, s.p50Ms, s.p90Ms, s.p99Ms
+  );
+  CHECK(finals == MESSAGES && s.acked == acked);
+  CHECK(s.acked + s.failed == MESSAGES);
+  CHECK_NEAR(s.successRate, (float) acked / MESSAGES, 0.0001);
+  if(lossPercent == 0) CHECK(s.retries == 0 && s.p99Ms == 6000);
+  else CHECK(s.retries > 0 && s.p90Ms > s.p50Ms);
+}
+
+int main() {
+  states();
+  backoff();
+  slots();
+  percentiles();
+  lossyGateway(0);
+  lossyGateway(30);
+  return testsDone("lora-delivery");
+}
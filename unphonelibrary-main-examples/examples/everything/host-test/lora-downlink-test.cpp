@@ -0,0 +1,126 @@
+// lora-downlink-test.cpp
+// LoraDownlinkRouter with injected frames: port and opcode matching,
+// LORA_ANY_OPCODE, short payloads, a full table, and the C0 / C1 commands
+// as lora-work.cpp and ttn-lora.cpp register them (against a real LoraScheduler)
+
+#include <string.h>
+#include "test.h"
+#include "lora-downlink.h"
+#include "lora-sched.h"
+
+// what the last handler call saw
+static struct {
+  int calls;
+  int16_t handler;              // which one (its ctx)
+  uint8_t len, args[8];
+} seen;
+
+static void record(const uint8_t *args, uint8_t len, void *ctx) {
+  seen.calls++;
+  seen.handler = (int16_t) (intptr_t) ctx;
+  seen.len = len;
+  memcpy(seen.args, args, len < sizeof(seen.args) ? len : sizeof(seen.args));
+}
+
+static uint8_t inject(
+  LoraDownlinkRouter &r, uint8_t port, const uint8_t *frame, uint8_t len
+) {
+  memset(&seen, 0, sizeof(seen));
+  return r.dispatch(port, frame, len);
+}
+
+static void matching() {
+  LoraDownlinkRouter r;
+  CHECK(r.on(10, 0xA1, record, 0, (void *) 1));
+  CHECK(r.on(10, 0xA2, record, 2, (void *) 2));
+  CHECK(r.on(11, LORA_ANY_OPCODE, record, 0, (void *) 3));
+
+  const uint8_t a1[] = { 0xA1, 7, 8 };
+  CHECK(inject(r, 10, a1, sizeof(a1)) == 1);
+  CHECK(seen.handler == 1 && seen.len == 2 && seen.args[0] == 7);
+
+  CHECK(inject(r, 12, a1, sizeof(a1)) == 0);  // wrong port
+  CHECK(r.unhandledCount() == 1);
+  const uint8_t a3[] = { 0xA3 };
+  CHECK(inject(r, 10, a3, sizeof(a3)) == 0);  // no such opcode
+  CHECK(inject(r, 10, NULL, 0) == 0);         // no opcode at all
+  CHECK(r.unhandledCount() == 3 && seen.calls == 0);
+
+  // LORA_ANY_OPCODE gets the whole payload, even an empty one
+  CHECK(inject(r, 11, a1, sizeof(a1)) == 1);
+  CHECK(seen.handler == 3 && seen.len == 3 && seen.args[0] == 0xA1);
+  CHECK(inject(r, 11, NULL, 0) == 1 && seen.len == 0);
+
+  // too short for minArgs: rejected (counted apart from unhandled)
+  const uint8_t a2short[] = { 0xA2, 1 };
+  CHECK(inject(r, 10, a2short, sizeof(a2short)) == 0 && seen.calls == 0);
+  CHECK(r.rejectedCount() == 1 && r.unhandledCount() == 3);
+  const uint8_t a2[] = { 0xA2, 1, 2 };
+  CHECK(inject(r, 10, a2, sizeof(a2)) == 1 && seen.handler == 2);
+}
+
+static void severalAndFull() {
+  LoraDownlinkRouter r;
+  CHECK(r.on(5, 0x01, record, 0, (void *) 1));
+  CHECK(r.on(5, LORA_ANY_OPCODE, record, 0, (void *) 2));
+  const uint8_t f[] = { 0x01 };
+  CHECK(inject(r, 5, f, sizeof(f)) == 2);     // every match runs, in order
+  CHECK(seen.calls == 2 && seen.handler == 2);
+
+  for(int i = 2; i < LORA_DOWNLINK_ROUTES; i++)
+    CHECK(r.on(6, i, record));
+  CHECK(!r.on(6, 0x7F, record));              // table full
+  const uint8_t last[] = { LORA_DOWNLINK_ROUTES - 1 };
+  CHECK(inject(r, 6, last, sizeof(last)) == 1 && seen.handler == 0);
+}
+
+// the built-in commands, registered as lora_setup does on the command port
+static const uint8_t CMD_PORT = 100;          // unPhone::LORA_CMD_PORT
+static LoraScheduler sched(60000);
+static uint16_t counter = 5;
+static void onResetCmd(const uint8_t *, uint8_t, void *) { counter = 0; }
+static void onIntervalCmd(const uint8_t *args, uint8_t, void *) {
+  uint16_t secs = args[0] << 8 | args[1];
+  sched.interval(secs * 1000UL);              // (false: rejected)
+}
+
+static void builtIns() {
+  LoraDownlinkRouter r;
+  CHECK(r.on(CMD_PORT, 0xC0, onResetCmd, 0, NULL));
+  CHECK(r.on(CMD_PORT, 0xC1, onIntervalCmd, 2, NULL));
+
+  const uint8_t reset[] = { 0xC0 };
+  CHECK(inject(r, CMD_PORT, reset, sizeof(reset)) == 1 && counter == 0);
+
+  const uint8_t interval[] = { 0xC1, 0x01, 0x2C }; // 300 s
+  CHECK(inject(r, CMD_PORT, interval, sizeof(interval)) == 1);
+  CHECK(sched.interval() == 300000);
+  const uint8_t zero[] = { 0xC1, 0, 0 };          // ignored
+  CHECK(inject(r, CMD_PORT, zero, sizeof(zero)) == 1);
+  CHECK(sched.interval() == 300000);
+  const uint8_t cut[] = { 0xC1, 0x01 };           // (would read past it)
+  CHECK(inject(r, CMD_PORT, cut, sizeof(cut)) == 0 && r.rejectedCount() == 1);
+  CHECK(sched.interval() == 300000);
+
+  // over an hour is rejected; backed off to 8 hours, runs stay under
+  // MAX_RUN_MS (LMIC's ms2osticks() would overflow past ~9.5 hours)
+  const uint8_t huge[] = { 0xC1, 0xFF, 0xFF };
+  CHECK(inject(r, CMD_PORT, huge, sizeof(huge)) == 1);
+  CHECK(sched.interval() == 300000);
+  const uint8_t hour[] = { 0xC1, 0x0E, 0x10 };    // 3600 s
+  CHECK(inject(r, CMD_PORT, hour, sizeof(hour)) == 1);
+  CHECK(sched.interval() == 3600000);
+  lora_state_t idle = { true, false, 0, 0, UINT32_MAX };
+  for(int i = 0; i < 5; i++) sched.decide(idle);
+  CHECK(sched.nextRunIn(idle) == 8 * 3600000UL);
+  CHECK(8 * 3600000UL <= LoraScheduler::MAX_RUN_MS);
+  LoraScheduler longer(100000000UL);              // (from platformio.ini)
+  CHECK(longer.nextRunIn(idle) == LoraScheduler::MAX_RUN_MS);
+}
+
+int main() {
+  matching();
+  severalAndFull();
+  builtIns();
+  return testsDone("lora-downlink");
+}
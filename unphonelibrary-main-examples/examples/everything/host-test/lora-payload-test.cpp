@@ -0,0 +1,135 @@
+// lora-payload-test.cpp
+// LoraPayload / LoraPayloadReader round trips for every LPP type, the
+// 51 byte limit, and truncated or malformed payloads
+
+#include "test.h"
+#include "lora-payload.h"
+
+// read the single field of a payload
+static bool readOne(const LoraPayload &p, lpp_field_t *f) {
+  LoraPayloadReader r(p.data(), p.size());
+  bool got = r.next(f);
+  lpp_field_t extra;
+  return got && !r.next(&extra) && !r.malformed();
+}
+
+static void roundTrips() {
+  LoraPayload p;
+  lpp_field_t f;
+
+  CHECK(p.addDigital(1, 200));
+  CHECK(p.size() == 3);
+  CHECK(readOne(p, &f));
+  CHECK(f.channel == 1 && f.type == LPP_DIGITAL_IN && f.count == 1);
+  CHECK(f.values[0] == 200);
+
+  p.reset();
+  CHECK(p.addAnalog(2, -12.34));
+  CHECK(p.size() == 4);
+  CHECK(readOne(p, &f));
+  CHECK(f.channel == 2 && f.type == LPP_ANALOG_IN);
+  CHECK_NEAR(f.values[0], -12.34, 0.005);
+
+  p.reset();
+  CHECK(p.addU16(3, 65535));
+  CHECK(readOne(p, &f));
+  CHECK(f.type == LPP_U16 && f.values[0] == 65535);
+
+  p.reset();
+  CHECK(p.addTemp(4, -5.25));             // (rounds away from zero)
+  CHECK(readOne(p, &f));
+  CHECK(f.type == LPP_TEMPERATURE);
+  CHECK_NEAR(f.values[0], -5.3, 0.001);
+
+  p.reset();
+  CHECK(p.addHumidity(5, 47.5));
+  CHECK(p.size() == 3);
+  CHECK(readOne(p, &f));
+  CHECK(f.type == LPP_HUMIDITY && f.values[0] == 47.5);
+
+  p.reset();
+  CHECK(p.addAccel(6, 0.012, -1.0, 9.81));
+  CHECK(p.size() == 8);
+  CHECK(readOne(p, &f));
+  CHECK(f.type == LPP_ACCEL && f.count == 3);
+  CHECK_NEAR(f.values[0], 0.012, 0.0005);
+  CHECK_NEAR(f.values[1], -1.0, 0.0005);
+  CHECK_NEAR(f.values[2], 9.81, 0.0005);
+
+  p.reset();
+  CHECK(p.addVoltage(7, 4.13));
+  CHECK(readOne(p, &f));
+  CHECK(f.type == LPP_VOLTAGE);
+  CHECK_NEAR(f.values[0], 4.13, 0.005);
+
+  // several fields in one payload, in order
+  p.reset();
+  CHECK(p.addVoltage(1, 3.7) && p.addTemp(2, 21.5) && p.addDigital(3, 1));
+  LoraPayloadReader r(p.data(), p.size());
+  uint8_t channels = 0;
+  while(r.next(&f)) channels = channels * 10 + f.channel;
+  CHECK(channels == 123 && !r.malformed());
+}
+
+static void clamping() {
+  LoraPayload p;
+  lpp_field_t f;
+  CHECK(p.addTemp(1, 5000.0));            // beyond int16 at 0.1
+  CHECK(readOne(p, &f));
+  CHECK_NEAR(f.values[0], 3276.7, 0.01);
+  p.reset();
+  CHECK(p.addVoltage(1, -1.0));           // unsigned
+  CHECK(readOne(p, &f));
+  CHECK(f.values[0] == 0);
+  p.reset();
+  CHECK(p.addHumidity(1, 150.0));         // max 127.5 %
+  CHECK(readOne(p, &f));
+  CHECK(f.values[0] == 127.5);
+}
+
+static void sizeLimit() {
+  LoraPayload p;
+  for(int i = 0; i < 12; i++)             // 12 x 4 = 48 bytes
+    CHECK(p.addVoltage(i, 3.3));
+  CHECK(p.size() == 48 && !p.overflow());
+  CHECK(!p.addVoltage(12, 3.3));          // 52 > 51: refused...
+  CHECK(p.overflow() && p.size() == 48);  // ...and nothing written
+  CHECK(p.addDigital(12, 1));             // 51 fits exactly
+  CHECK(p.size() == LORA_PAYLOAD_MAX);
+  CHECK(!p.addDigital(13, 1));
+  p.reset();
+  CHECK(p.size() == 0 && !p.overflow());
+}
+
+static void malformed() {
+  lpp_field_t f;
+
+  LoraPayloadReader empty(NULL, 0);       // nothing is a clean end
+  CHECK(!empty.next(&f) && !empty.malformed());
+
+  const uint8_t unknown[] = { 1, 99, 0, 0 };
+  LoraPayloadReader u(unknown, sizeof(unknown));
+  CHECK(!u.next(&f) && u.malformed());
+
+  const uint8_t truncated[] = { 1, LPP_VOLTAGE, 0x01 };
+  LoraPayloadReader t(truncated, sizeof(truncated));
+  CHECK(!t.next(&f) && t.malformed());
+
+  const uint8_t trailing[] = { 1, LPP_DIGITAL_IN, 7, 2 }; // a lone byte
+  LoraPayloadReader b(trailing, sizeof(trailing));
+  CHECK(b.next(&f) && f.values[0] == 7);
+  CHECK(!b.next(&f) && b.malformed());
+  CHECK(!b.next(&f));                     // (and stays stopped)
+
+  const uint8_t accel[] = { 1, LPP_ACCEL, 0, 1, 0, 2, 0 }; // 5 of 6
+  LoraPayloadReader a(accel, sizeof(accel));
+  CHECK(!a.next(&f) && a.malformed());
+}
+
+int main() {
+  roundTrips();
+  clamping();
+  sizeLimit();
+  malformed();
+  return testsDone("lora-payload");
+}
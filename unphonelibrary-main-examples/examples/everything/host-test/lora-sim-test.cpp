@@ -0,0 +1,356 @@
+// lora-sim-test.cpp
+// the uplink pipeline in virtual time: the real sketch/lora-work.cpp (doWork,
+// processWork, scheduleUplink, the event handling, link policy, batching
+// and the lora_* API) built against a fake LMIC (fake/lmic.h: EU868 as
+// setupTtnChannels() leaves it, airtime, RX windows, retransmission of
+// confirmed uplinks, joins) and a gateway that loses frames, acknowledges
+// and sends downlinks, with unphone.cpp's loraTask loop turning it. each
+// scenario boots a fresh node (in a child process, as lora-work.cpp's state
+// is static); prints messages per hour against the duty cycle bound
+
+#include "test.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "Arduino.h"
+#include "lora-work.h"
+#include "lora-batch.h"
+
+static const int64_t NEVER = INT64_MAX;
+static const uint32_t HOUR_MS = 3600000UL;
+static const uint32_t INTERVAL_MS = DO_WORK_INTERVAL_SECONDS * 1000UL;
+static const uint32_t RX_END_MS = 6000 + 33; // RX1 5 s on, RX2 timeout (SF9)
+static const uint32_t LORA_MAX_BLOCK_MS = 600000; // as unphone.cpp's loraTask
+
+static int64_t ticks(uint32_t ms) {
+  return (int64_t) ms * OSTICKS_PER_SEC / 1000;
+}
+
+// the LMIC side's hooks (ttn-lora.cpp's, minus the display) //////////////
+static bool notified = false;            // the LoRa task's notification
+static uint16_t counter = 0;             // LMIC-node's simulated sensor
+void lora_work_wake() { notified = true; }
+void lora_work_show(ostime_t, const char *) { }
+void lora_work_sending(uint32_t) { counter++; }
+static void onResetCmd(const uint8_t *, uint8_t, void *) { counter = 0; }
+static void onLmicEvent(void *, ev_t ev) { lora_work_event(ev); }
+
+static uint32_t outcomes[4];             // by lora_delivery_state_t
+static void onDelivery(uint32_t, lora_delivery_state_t state) {
+  outcomes[state]++;
+}
+
+// what the log ring says (the log task's view)
+static struct {
+  uint32_t doWorkRuns, unhandled, linkChanges, rejected;
+  int32_t interval, linkSf, linkPow;     // the last set
+} logged;
+static void drainLog() {
+  lora_log_t r;
+  while(loraLog.get(&r)) {
+    if(r.id == LOG_TEXT && !strcmp(r.text, "TTN LoRa doWork job started"))
+      logged.doWorkRuns++;
+    else if(r.id == LOG_TEXT && !strcmp(r.text, "Downlink not handled"))
+      logged.unhandled++;
+    else if(r.id == LOG_VALUE && !strncmp(r.text, "Interval set", 12))
+      logged.interval = r.args[0];
+    else if(r.id == LOG_VALUE && !strncmp(r.text, "Interval rej", 12))
+      logged.rejected++;
+    else if(r.id == LOG_LINK) {
+      logged.linkChanges++;
+      logged.linkSf = r.args[0];
+      logged.linkPow = r.args[1];
+    }
+  }
+}
+
+// power up as lora_setup does: a restored (or ABP) session, or an OTAA join
+static void boot(uint8_t sf, bool joined) {
+  fake_lmic_begin(sf, joined, 1);
+  LMIC_registerEventCb(onLmicEvent, NULL);
+  if(!joined) LMIC_startJoining();
+  lora_on_downlink(LORA_CMD_PORT, 0xC0, onResetCmd, 0, NULL);
+  lora_on_delivery(onDelivery);
+  lora_work_start();
+}
+
+// the LoRa task (unphone.cpp's loraTask): turn LMIC's run loop, then block
+// for lora_idle_ms() or until notified (by lora_enqueue, or a DIO edge from
+// the radio); meanwhile the app (another task) calls app every everyMs
+// until stopMs
+static uint32_t wakeups = 0;
+static void run(
+  uint32_t untilMs, void (*app)() = NULL, uint32_t everyMs = 0,
+  uint32_t stopMs = 0
+) {
+  int64_t until = ticks(untilMs);
+  int64_t appAt = app == NULL ? NEVER : fakeNow;
+  while(fakeNow < until) {
+    lora_loop();
+    wakeups++;
+    drainLog();
+    uint32_t idleMs = lora_idle_ms(LORA_MAX_BLOCK_MS);
+    int64_t wakeAt = fakeNow + ticks(idleMs > 1 ? idleMs : 1);
+    if(fake_lmic_irq_at() < wakeAt)      // (ttn-lora.cpp's onRadioDio)
+      wakeAt = fake_lmic_irq_at() > fakeNow ? fake_lmic_irq_at() : fakeNow;
+    while(!notified && appAt < wakeAt) {
+      if(appAt > fakeNow) fakeNow = appAt;
+      app();
+      appAt += ticks(everyMs);
+      if(appAt >= ticks(stopMs)) appAt = NEVER;
+    }
+    if(notified) wakeAt = fakeNow;       // (ulTaskNotifyTake returns)
+    notified = false;
+    if(wakeAt > until) wakeAt = until;   // (the scenario steps in)
+    if(wakeAt > fakeNow) fakeNow = wakeAt;
+  }
+}
+
+// run a scenario on a freshly booted node, in a child process; its check
+// counts come back through a pipe
+static void scenario(void (*fn)()) {
+  int fds[2];
+  fflush(stdout);
+  if(pipe(fds) != 0) { CHECK(false); return; }
+  pid_t pid = fork();
+  if(pid == 0) {
+    close(fds[0]);
+    testChecks = testFailures = 0;
+    fn();
+    int counts[2] = { testChecks, testFailures };
+    fflush(stdout);
+    _exit(write(fds[1], counts, sizeof(counts)) == sizeof(counts) ? 0 : 1);
+  }
+  close(fds[1]);
+  int counts[2] = { 0, 0 };
+  bool ok = read(fds[0], counts, sizeof(counts)) == sizeof(counts);
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+  testChecks += counts[0];
+  testFailures += counts[1];
+  CHECK(ok);                             // (the scenario didn't crash)
+}
+
+// the app ////////////////////////////////////////////////////////////////
+static uint8_t appLen = 10;
+static bool appConfirmed = false;
+static void appSend() {
+  uint8_t payload[LORA_MSG_MAX];
+  memset(payload, 0xA5, appLen);
+  lora_enqueue(LORA_LPP_PORT, payload, appLen, appConfirmed, 0);
+}
+static void appTopUp() {                 // keep the queue full
+  lora_queue_stats_t q;
+  lora_queue_stats(&q);
+  if(q.depth < LORA_QUEUE_SLOTS) appSend();
+}
+
+// the most uplinks an hour the radio allows: all eight channels share the
+// 1% band, which closes for airtime x 100 after each TX, and each uplink
+// needs its airtime and RX windows
+static double boundPerHour(uint8_t sf, uint8_t len) {
+  uint32_t air = fake_airtime_ms(sf, len);
+  double byCycle = ceil((double) HOUR_MS / (air + RX_END_MS));
+  double byDuty = ceil((double) HOUR_MS / (air * 100));
+  return byCycle < byDuty ? byCycle : byDuty;
+}
+
+// a full queue for an hour: throughput should be at the bound, not below
+static uint8_t satSf;
+static void saturated() {
+  boot(satSf, true);
+  run(HOUR_MS, appTopUp, 1000, HOUR_MS);
+  double bound = boundPerHour(satSf, appLen);
+  uint32_t sent = outcomes[LORA_SENT];
+  lora_queue_stats_t q;
+  lora_queue_stats(&q);
+  printf(
+    "lora-sim: SF%u %u byte uplinks, queue full: %u/hour (bound %.0f, "
+    "airtime %u ms), %u doWork runs, %u task wakeups\n", satSf, appLen,
+    sent, bound, fake_airtime_ms(satSf, appLen), logged.doWorkRuns, wakeups
+  );
+  CHECK(sent >= 0.9 * bound && sent <= bound);
+  CHECK(q.maxDepth == LORA_QUEUE_SLOTS);   // (it really was saturated)
+  CHECK(outcomes[LORA_FAILED] == 0);
+  CHECK(fakeGateway.transmissions - sent <= 1); // (one may be in flight)
+}
+static void saturatedSf7() { satSf = 7; saturated(); }
+static void saturatedSf9() { satSf = 9; saturated(); }
+static void saturatedSf12() { satSf = 12; saturated(); }
+
+// one a minute at SF7 all go straight out
+static void periodic() {
+  boot(7, true);
+  run(HOUR_MS, appSend, 60000, HOUR_MS);
+  lora_delivery_stats_t s;
+  lora_delivery_stats(&s);
+  printf(
+    "lora-sim: SF7 one a minute: %u/hour, latency p50 %u ms, p99 %u ms\n",
+    outcomes[LORA_SENT], s.p50Ms, s.p99Ms
+  );
+  CHECK(outcomes[LORA_SENT] == 60);
+  CHECK(s.p99Ms <= fake_airtime_ms(7, appLen) + RX_END_MS + 20);
+}
+
+// nothing to send: doWork backs off, and the LoRa task sleeps between its
+// runs
+static void idle() {
+  boot(7, true);
+  run(HOUR_MS);
+  printf(
+    "lora-sim: idle: %u doWork runs/hour, %u task wakeups/hour\n",
+    logged.doWorkRuns, wakeups
+  );
+  CHECK(logged.doWorkRuns <= HOUR_MS / (8 * INTERVAL_MS) + 4);
+  CHECK(wakeups <= 3 * logged.doWorkRuns);  // (no polling between jobs)
+  CHECK(fakeGateway.transmissions == 0);
+}
+
+// confirmed uplinks through a lossy gateway: each ends ACKED or FAILED,
+// after LMIC's retransmissions and then LoraDelivery's backed-off retries
+static uint8_t lossPercent;
+static void confirmedLossy() {
+  boot(7, true);
+  fakeGateway.lossPercent = lossPercent;
+  appConfirmed = true;
+  run(8 * HOUR_MS, appSend, 30 * 60000, 4 * HOUR_MS); // (4 hours to drain)
+  lora_delivery_stats_t s;
+  lora_delivery_stats(&s);
+  lora_queue_stats_t q;
+  lora_queue_stats(&q);
+  printf(
+    "lora-sim: confirmed, %u%% loss: %u acked, %u failed, %u retries, "
+    "%.1f TXs each, latency p50 %u ms, p90 %u ms\n", lossPercent, s.acked,
+    s.failed, s.retries, (double) fakeGateway.transmissions / q.enqueued,
+    s.p50Ms, s.p90Ms
+  );
+  CHECK(s.acked + s.failed == q.enqueued - q.dropped);
+  CHECK(fakeGateway.transmissions <=       // (lora-delivery.h's worst case)
+    q.enqueued * 4 * LORA_LMIC_CONF_TRIES);
+  CHECK(s.acked + s.failed == outcomes[LORA_ACKED] + outcomes[LORA_FAILED]);
+  CHECK(!(LMIC.opmode & (OP_TXDATA | OP_TXRXPEND)) && q.depth == 0);
+  if(lossPercent == 0) CHECK(s.successRate == 1 && s.retries == 0);
+  else CHECK(s.retries > 0 && s.acked > 0);
+}
+static void confirmedLossless() { lossPercent = 0; confirmedLossy(); }
+static void confirmedLossy70() { lossPercent = 70; confirmedLossy(); }
+
+// downlinks ride on the reply to an uplink and reach their handlers
+static void downlinks() {
+  boot(7, true);
+  const uint8_t interval[] = { 0xC1, 0x01, 0x2C };  // 300 s
+  fakeGateway.dnPort = LORA_CMD_PORT;
+  fakeGateway.dnLen = sizeof(interval);
+  memcpy(fakeGateway.dnData, interval, sizeof(interval));
+  appSend();
+  run(60000);
+  CHECK(fakeGateway.dnLen == 0 && logged.interval == 300);
+  CHECK(counter == 1);
+
+  fakeGateway.dnData[0] = 0xC0;          // reset counter
+  fakeGateway.dnLen = 1;
+  appSend();
+  run(120000);
+  CHECK(fakeGateway.dnLen == 0 && counter == 0);
+
+  const uint8_t tooLong[] = { 0xC1, 0xFF, 0xFF };   // over an hour: refused
+  fakeGateway.dnLen = sizeof(tooLong);
+  memcpy(fakeGateway.dnData, tooLong, sizeof(tooLong));
+  appSend();
+  run(180000);
+  CHECK(fakeGateway.dnLen == 0 && logged.rejected == 1);
+  CHECK(logged.interval == 300);
+  CHECK(logged.unhandled == 0);
+}
+
+// readings are batched into one frame, sent when the oldest is
+// LORA_BATCH_AGE_SECONDS old, or at once for a priority reading
+static void batching() {
+  boot(7, true);
+  for(int32_t v = 0; v < 3; v++) CHECK(lora_batch_add(1, 100 + v, false));
+  run(LORA_BATCH_AGE_SECONDS * 1000UL - 60000);
+  CHECK(fakeGateway.heard == 0);
+  run(LORA_BATCH_AGE_SECONDS * 1000UL + 60000);
+  CHECK(fakeGateway.heard == 1 && fakeGateway.lastPort == LORA_BATCH_PORT);
+  LoraBatchReader reader(fakeGateway.last, fakeGateway.lastLen);
+  lora_reading_t r;
+  uint8_t n = 0;
+  while(reader.next(&r)) CHECK(r.channel == 1 && r.value == 100 + n++);
+  CHECK(n == 3 && !reader.malformed());
+
+  uint32_t at = millis();
+  CHECK(lora_batch_add(2, -5, true));
+  run(at + 1000);
+  CHECK(fakeGateway.heard == 2 && fakeGateway.lastPort == LORA_BATCH_PORT);
+}
+
+// a weak link: confirmed uplinks at SF7 go unheard until LMIC's
+// retransmissions step the data rate down, and the link policy keeps it
+// there; a strong one (ADR off, starting at SF12) moves to SF7 and spends
+// the surplus on lower TX power
+static void weakLink() {
+  boot(7, true);
+  fakeGateway.snrTenths = -130;          // (SF10 at the least)
+  appConfirmed = true;
+  run(2 * HOUR_MS, appSend, 10 * 60000, 2 * HOUR_MS);
+  lora_link_stats_t l;
+  lora_link_stats(&l);
+  lora_queue_stats_t q;
+  lora_queue_stats(&q);
+  printf(
+    "lora-sim: weak link: SF%u, %u acked of %u, link SNR %d.%d dB\n",
+    12 - LMIC.datarate, outcomes[LORA_ACKED], q.enqueued, l.snrTenths / 10,
+    abs(l.snrTenths % 10)
+  );
+  CHECK(12 - LMIC.datarate >= 10 && l.sf >= 10);
+  CHECK(outcomes[LORA_ACKED] >= 10);
+}
+static void strongLink() {
+  boot(12, true);
+  LMIC.adrEnabled = 0;
+  appConfirmed = true;
+  run(2 * HOUR_MS, appSend, 10 * 60000, 2 * HOUR_MS);
+  CHECK(logged.linkChanges > 0 && 12 - LMIC.datarate == 7);
+  CHECK(logged.linkSf == 7 && logged.linkPow < DefaultABPTxPower);
+  CHECK(outcomes[LORA_ACKED] == 12);
+}
+
+// OTAA: an uplink queued while joining goes once EV_JOINED arrives
+static void joining() {
+  boot(7, false);
+  appSend();
+  run(60000);
+  CHECK(fakeGateway.joins == 1 && LMIC.devaddr != 0);
+  CHECK(outcomes[LORA_SENT] == 1 && fakeGateway.lastPort == LORA_LPP_PORT);
+}
+
+// an uplink LMIC cancels (EV_TXCANCELED, e.g. for a rejoin) is retried
+static void canceled() {
+  boot(7, true);
+  appConfirmed = true;
+  appSend();
+  run(1000);                             // (out, waiting for RX1)
+  CHECK(LMIC.opmode & OP_TXRXPEND);
+  LMIC_clrTxData();
+  CHECK(outcomes[LORA_QUEUED] == 1);
+  run(120000);
+  CHECK(outcomes[LORA_ACKED] == 1 && fakeGateway.transmissions == 2);
+}
+
+int main() {
+  CHECK(fake_airtime_ms(7, 10) == 62 && fake_airtime_ms(12, 10) == 1483);
+  scenario(saturatedSf7);
+  scenario(saturatedSf9);
+  scenario(saturatedSf12);
+  scenario(periodic);
+  scenario(idle);
+  scenario(confirmedLossless);
+  scenario(confirmedLossy70);
+  scenario(downlinks);
+  scenario(batching);
+  scenario(weakLink);
+  scenario(strongLink);
+  scenario(joining);
+  scenario(canceled);
+  return testsDone("lora-sim");
+}
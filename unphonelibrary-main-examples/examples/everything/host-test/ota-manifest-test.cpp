@@ -0,0 +1,262 @@
+// ota-manifest-test.cpp
+// ota_manifest_parse on manifests as ota-tool.py writes them (the signed
+// length, patch lines) and malformed ones, ota_resume_skip's reading of
+// 200 and 206 responses, and the ota_resume_t bookkeeping over downloads
+// that drop, resend what we have or are refused
+
+#include "test.h"
+#include <string>
+#include "ota-manifest.h"
+
+static const char *HASH =
+  "00112233445566778899aabbccddeeff00112233445566778899AABBCCDDEEFF";
+static const char *PATCH_HASH =
+  "ffeeddccbbaa99887766554433221100ffeeddccbbaa99887766554433221100";
+static const char *SIG = "3045022100ab02207f";
+
+// a manifest body (everything ota-tool.py signs) with extra lines after the
+// hash, and its signature line
+static std::string body(const std::string &extra = "") {
+  return std::string("version 3\nsize 1234567\nsha256 ") + HASH + "\n" +
+    extra;
+}
+static bool parse(const std::string &text, ota_manifest_t *m) {
+  return ota_manifest_parse(text.c_str(), text.size(), m);
+}
+
+static void wellFormed() {
+  ota_manifest_t m;
+  std::string signedPart = body(
+    std::string("patch 2 4321 ") + PATCH_HASH + "\n" +
+    "patch 1 9876 " + HASH + "\n"
+  );
+  CHECK(parse(signedPart + "sig " + SIG + "\n", &m));
+  CHECK(m.version == 3 && m.size == 1234567);
+  CHECK(m.sha256[0] == 0x00 && m.sha256[1] == 0x11 && m.sha256[31] == 0xff);
+  CHECK(m.sigLen == 9 && m.sig[0] == 0x30 && m.sig[8] == 0x7f);
+  CHECK(m.signedLen == signedPart.size()); // (up to and with the newline)
+  CHECK(m.patchCount == 2);
+  const ota_patch_ref_t *p = ota_manifest_patch(&m, 2);
+  CHECK(p != NULL && p->size == 4321 && p->sha256[0] == 0xff);
+  p = ota_manifest_patch(&m, 1);
+  CHECK(p != NULL && p->size == 9876 && p->sha256[31] == 0xff);
+  CHECK(ota_manifest_patch(&m, 3) == NULL);
+
+  // CRLF line ends; no newline after the signature; trailing junk ignored
+  std::string crlf = "version 3\r\nsize 10\r\nsha256 " + std::string(HASH) +
+    "\r\n";
+  CHECK(parse(crlf + "sig " + SIG + "\r\n", &m));
+  CHECK(m.signedLen == crlf.size() && m.sigLen == 9);
+  CHECK(parse(body() + "sig " + SIG, &m));
+  CHECK(m.signedLen == body().size());
+  CHECK(parse(body() + "sig " + SIG + "\nversion 9\n", &m) && m.version == 3);
+
+  // unknown lines are skipped (and signed); extra patches are dropped
+  std::string more = body("comment hello\n");
+  for(int v = 1; v <= OTA_PATCHES_MAX + 2; v++)
+    more += "patch " + std::to_string(v) + " 100 " + PATCH_HASH + "\n";
+  CHECK(parse(more + "sig " + SIG + "\n", &m));
+  CHECK(m.patchCount == OTA_PATCHES_MAX && m.signedLen == more.size());
+  CHECK(ota_manifest_patch(&m, OTA_PATCHES_MAX + 1) == NULL);
+}
+
+static void malformed() {
+  ota_manifest_t m;
+  std::string sig = std::string("sig ") + SIG + "\n";
+
+  CHECK(!parse("", &m));
+  CHECK(!parse(body(), &m));                            // no signature
+  CHECK(!parse(sig + body(), &m));                      // signature first
+  CHECK(!parse(
+    "size 10\nsha256 " + std::string(HASH) + "\n" + sig, &m
+  ));                                                   // no version
+  CHECK(!parse("version 3\nsize 10\n" + sig, &m));      // no hash
+  CHECK(!parse("version 0\nsize 10\nsha256 " + std::string(HASH) + "\n" +
+    sig, &m));
+  CHECK(!parse("version 3\nsize 10\nsha256 abcd\n" + sig, &m)); // short
+  CHECK(!parse(std::string(OTA_MANIFEST_MAX + 1, '\n') + body() + sig, &m));
+
+  // bad signatures
+  CHECK(!parse(body("sig\n"), &m));                     // (no value)
+  CHECK(!parse(body("sig \n"), &m));
+  CHECK(!parse(body("sig 304\n"), &m));                 // odd digits
+  CHECK(!parse(body("sig 30zz\n"), &m));
+  CHECK(!parse(body("sig " + std::string(2 * OTA_SIG_MAX + 2, 'a') + "\n"),
+    &m));
+  CHECK(parse(body("sig " + std::string(2 * OTA_SIG_MAX, 'a') + "\n"), &m));
+
+  // bad patch lines (each spoils the manifest, rather than being skipped)
+  const char *badPatches[] = {
+    "patch 2\n",                                        // no size or hash
+    "patch 2 4321\n",                                   // no hash
+    "patch 2 4321 \n",
+    "patch 2 4321 abcd\n",                              // short hash
+    "patch 0 4321 %s\n",                                // from 0
+    "patch -1 4321 %s\n",
+    "patch 2 0 %s\n",                                   // empty
+    "patch x 4321 %s\n",
+    "patch 2 x %s\n",
+    "patch 2,4321 %s\n",
+  };
+  for(const char *fmt : badPatches) {
+    char line[160];
+    snprintf(line, sizeof(line), fmt, PATCH_HASH);
+    CHECK(!parse(body(line) + sig, &m));
+  }
+  // (a size with no hash doesn't borrow from the next line)
+  CHECK(!parse(body("patch 2 \n4321 " + std::string(PATCH_HASH) + "\n") +
+    sig, &m));
+}
+
+static void resumeSkip() {
+  const uint32_t size = 1000;
+  // 200: the whole image, so skip what we have
+  CHECK(ota_resume_skip(200, NULL, 0, size) == 0);
+  CHECK(ota_resume_skip(200, "", 400, size) == 400);
+
+  // 206: from where we asked, or from earlier (the overlap is skipped)
+  CHECK(ota_resume_skip(206, "bytes 400-999/1000", 400, size) == 0);
+  CHECK(ota_resume_skip(206, "bytes 300-999/1000", 400, size) == 100);
+  CHECK(ota_resume_skip(206, "bytes 0-999/1000", 400, size) == 400);
+  CHECK(ota_resume_skip(206, "bytes 400-999/*", 400, size) == 0);
+
+  // a gap, a different total or an unreadable range is no use
+  CHECK(ota_resume_skip(206, "bytes 401-999/1000", 400, size) == -1);
+  CHECK(ota_resume_skip(206, "bytes 400-999/1001", 400, size) == -1);
+  CHECK(ota_resume_skip(206, "bytes 400-999/999", 400, size) == -1);
+  CHECK(ota_resume_skip(206, "bytes 400-999", 400, size) == -1);
+  CHECK(ota_resume_skip(206, "bytes 400/1000", 400, size) == -1);
+  CHECK(ota_resume_skip(206, "items 400-999/1000", 400, size) == -1);
+  CHECK(ota_resume_skip(206, NULL, 400, size) == -1);
+
+  // anything else is refused
+  CHECK(ota_resume_skip(416, "bytes */1000", 400, size) == -1);
+  CHECK(ota_resume_skip(404, NULL, 0, size) == -1);
+  CHECK(ota_resume_skip(-1, NULL, 0, size) == -1); // (no connection)
+}
+
+// a download as otaFetch does it: each request gets a response (code and
+// Content-Range) and a body, of which only the first `sent` bytes arrive
+// (in reads of `chunk`); the bytes kept are appended to out
+typedef struct {
+  int code;
+  const char *range;
+  uint32_t first;                 // of the body, in the image
+  uint32_t sent;                  // bytes of body delivered
+} response_t;
+
+static uint8_t imageByte(uint32_t i) { return (uint8_t) (i * 7 + i / 256); }
+
+static int fetch(
+  ota_resume_t *dl, const response_t *rs, int count, size_t chunk,
+  std::string *out
+) {
+  int requests = 0;
+  for(int i = 0; i < count && dl->done < dl->size; i++) {
+    requests++;
+    const response_t *r = &rs[i];
+    if(ota_resume_response(dl, r->code, r->range)) {
+      uint32_t at = r->first, end = r->first + r->sent;
+      while(dl->done < dl->size && at < end) {
+        uint8_t buf[64];
+        size_t avail = end - at;
+        size_t want = ota_resume_want(dl, avail, chunk);
+        CHECK(want > 0 && want <= sizeof(buf));
+        for(size_t j = 0; j < want; j++) buf[j] = imageByte(at + j);
+        at += want;
+        const uint8_t *p = buf;
+        size_t n = ota_resume_take(dl, &p, want);
+        out->append((const char *) p, n);
+      }
+    }
+    if(dl->done < dl->size && ota_resume_ended(dl, 2) < 0) return -requests;
+  }
+  return requests;
+}
+
+static bool isImage(const std::string &s, uint32_t size) {
+  if(s.size() != size) return false;
+  for(uint32_t i = 0; i < size; i++)
+    if((uint8_t) s[i] != imageByte(i)) return false;
+  return true;
+}
+
+static void resumes() {
+  ota_resume_t dl;
+  std::string out;
+
+  // in one go
+  ota_resume_begin(&dl, 1000);
+  response_t whole[] = { { 200, NULL, 0, 1000 } };
+  CHECK(fetch(&dl, whole, 1, 64, &out) == 1);
+  CHECK(isImage(out, 1000) && dl.resumes == 0 && dl.retries == 0);
+
+  // dropped twice, resumed with 206s (one from a little early)
+  ota_resume_begin(&dl, 1000);
+  out.clear();
+  response_t dropped[] = {
+    { 200, NULL, 0, 300 },
+    { 206, "bytes 300-999/1000", 300, 333 },
+    { 206, "bytes 600-999/1000", 600, 400 },
+  };
+  CHECK(fetch(&dl, dropped, 3, 50, &out) == 3);
+  CHECK(isImage(out, 1000) && dl.resumes == 2);
+
+  // a server that ignores Range resends it all: the start is skipped, even
+  // across several reads and a further drop
+  ota_resume_begin(&dl, 1000);
+  out.clear();
+  response_t noRange[] = {
+    { 200, NULL, 0, 250 },
+    { 200, NULL, 0, 200 },                // (nothing new)
+    { 200, NULL, 0, 1000 },
+  };
+  CHECK(fetch(&dl, noRange, 3, 64, &out) == 3);
+  CHECK(isImage(out, 1000) && dl.resumes == 1);
+
+  // more body than the image: nothing past the end is kept
+  ota_resume_begin(&dl, 100);
+  out.clear();
+  response_t tooLong[] = { { 200, NULL, 0, 300 } };
+  CHECK(fetch(&dl, tooLong, 1, 64, &out) == 1);
+  CHECK(isImage(out, 100) && dl.done == 100);
+
+  // refusals, gaps and the wrong total make no progress: retried with
+  // growing waits, then given up on after the limit...
+  ota_resume_begin(&dl, 1000);
+  out.clear();
+  response_t useless[] = {
+    { 200, NULL, 0, 500 },
+    { 206, "bytes 600-999/1000", 600, 400 }, // (a gap)
+    { 206, "bytes 500-999/2000", 500, 500 }, // (another image)
+    { 503, NULL, 0, 0 },
+  };
+  CHECK(fetch(&dl, useless, 4, 64, &out) == -4);
+  CHECK(dl.done == 500 && out.size() == 500 && dl.retries == 3);
+
+  // ...but progress resets the count
+  ota_resume_begin(&dl, 1000);
+  out.clear();
+  response_t flaky[] = {
+    { 503, NULL, 0, 0 }, { 503, NULL, 0, 0 },
+    { 200, NULL, 0, 10 },
+    { 503, NULL, 0, 0 }, { 503, NULL, 0, 0 },
+    { 206, "bytes 10-999/1000", 10, 990 },
+  };
+  CHECK(fetch(&dl, flaky, 6, 64, &out) == 6);
+  CHECK(isImage(out, 1000) && dl.resumes == 1);
+
+  ota_resume_begin(&dl, 1000);
+  dl.before = dl.done = 10;
+  CHECK(ota_resume_ended(&dl, 2) == 1);   // (seconds: 1, 2, then give up)
+  CHECK(ota_resume_ended(&dl, 2) == 2);
+  CHECK(ota_resume_ended(&dl, 2) == -1);
+}
+
+int main() {
+  wellFormed();
+  malformed();
+  resumeSkip();
+  resumes();
+  return testsDone("ota-manifest");
+}
@@ -0,0 +1,56 @@
+# ota-patch-fixture.py
+# writes ota-patch-fixture.h for ota-patch-test: a patch made by ota-tool.py's
+# diff (inflated, as joinme.cpp feeds it to OtaPatch) between two images
+# that the test makes the same way (fixtureImages there), e.g.:
+#
+#   make fixtures     # (after changing ota-tool.py's diff)
+
+import importlib.util, os, sys, zlib
+
+here = os.path.dirname(os.path.abspath(__file__))
+spec = importlib.util.spec_from_file_location(
+    "ota_tool", os.path.join(here, "..", "ota-tool.py"))
+ota_tool = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(ota_tool)
+
+class Random:
+    """the test's fixtureRandom: a 32 bit LCG, a byte at a time"""
+    def __init__(self, seed):
+        self.x = seed
+    def byte(self):
+        self.x = (self.x * 1103515245 + 12345) & 0xffffffff
+        return (self.x >> 16) & 0xff
+
+def images():
+    """old: 4096 random bytes; new: old with bytes inserted, a run of
+    "addresses" shifted, a run deleted, and an early run copied at the end
+    (so the patch has diff and extra bytes, and seeks both ways)"""
+    r = Random(1)
+    old = bytes(r.byte() for _ in range(4096))
+    shifted = bytearray(old[1000:2500])
+    for k in range(0, len(shifted), 64):
+        shifted[k] = (shifted[k] + 1) & 0xff
+    new = old[:1000] + bytes(r.byte() for _ in range(200)) + \
+        bytes(shifted) + old[2800:] + old[100:400]
+    return old, new
+
+def main():
+    old, new = images()
+    patch = zlib.decompress(ota_tool.diff(old, new))
+    out = sys.argv[1] if len(sys.argv) > 1 else \
+        os.path.join(here, "ota-patch-fixture.h")
+    with open(out, "w") as f:
+        f.write("// ota-patch-fixture.h\n")
+        f.write("// (made by ota-patch-fixture.py: don't edit) ota-tool.py's"
+            " patch from\n// fixtureImages' old image (%d bytes) to its new"
+            " one (%d bytes)\n\n" % (len(old), len(new)))
+        f.write("static const uint32_t FIXTURE_OLD_SIZE = %d;\n" % len(old))
+        f.write("static const uint32_t FIXTURE_NEW_SIZE = %d;\n" % len(new))
+        f.write("static const uint8_t FIXTURE_PATCH[%d] = {\n" % len(patch))
+        for i in range(0, len(patch), 12):
+            f.write("  " + ", ".join(
+                "0x%02x" % b for b in patch[i:i + 12]) + ",\n")
+        f.write("};\n")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,218 @@
+// ota-patch-test.cpp
+// OtaPatch applying a patch made by ota-tool.py's diff (ota-patch-fixture.h)
+// fed in uneven pieces, and failing cleanly on bad headers, records that
+// run past either image, seeks out of the old image, trailing data and
+// read or write errors
+
+#include "test.h"
+#include <string.h>
+#include <vector>
+#include "ota-patch.h"
+#include "ota-patch-fixture.h"
+
+// ota-patch-fixture.py's Random and images(): keep them in step
+static uint32_t fixtureSeed;
+static uint8_t fixtureRandom() {
+  fixtureSeed = fixtureSeed * 1103515245u + 12345u;
+  return (fixtureSeed >> 16) & 0xff;
+}
+static void fixtureImages(std::vector<uint8_t> *old, std::vector<uint8_t> *nu) {
+  fixtureSeed = 1;
+  old->clear();
+  for(int i = 0; i < 4096; i++) old->push_back(fixtureRandom());
+  nu->assign(old->begin(), old->begin() + 1000);
+  for(int i = 0; i < 200; i++) nu->push_back(fixtureRandom());
+  for(int k = 1000; k < 2500; k++)
+    nu->push_back((*old)[k] + ((k - 1000) % 64 == 0 ? 1 : 0));
+  nu->insert(nu->end(), old->begin() + 2800, old->end());
+  nu->insert(nu->end(), old->begin() + 100, old->begin() + 400);
+}
+
+// the old image (read from) and the new one (built up), with faults
+typedef struct {
+  const std::vector<uint8_t> *old;
+  std::vector<uint8_t> built;
+  size_t failReadsAfter = SIZE_MAX, failWritesAfter = SIZE_MAX;
+  size_t reads = 0, writes = 0;
+} images_t;
+
+static bool readOld(uint32_t offset, uint8_t *p, size_t n, void *ctx) {
+  images_t *im = (images_t *) ctx;
+  if(im->reads++ >= im->failReadsAfter) return false;
+  CHECK(offset + n <= im->old->size());   // (OtaPatch checks, we don't)
+  if(offset + n > im->old->size()) return false;
+  memcpy(p, im->old->data() + offset, n);
+  return true;
+}
+static bool writeNew(const uint8_t *p, size_t n, void *ctx) {
+  images_t *im = (images_t *) ctx;
+  if(im->writes++ >= im->failWritesAfter) return false;
+  im->built.insert(im->built.end(), p, p + n);
+  return true;
+}
+
+// feed a patch in pieces of the given sizes (cycled); false on error
+static bool apply(
+  OtaPatch *patch, const uint8_t *p, size_t len, const size_t *pieces,
+  int numPieces
+) {
+  for(size_t at = 0, i = 0; at < len; i++) {
+    size_t n = pieces[i % numPieces];
+    if(n > len - at) n = len - at;
+    if(!patch->feed(p + at, n)) return false;
+    at += n;
+  }
+  return true;
+}
+
+static void fixture() {
+  std::vector<uint8_t> old, nu;
+  fixtureImages(&old, &nu);
+  CHECK(old.size() == FIXTURE_OLD_SIZE && nu.size() == FIXTURE_NEW_SIZE);
+
+  const size_t whole[] = { sizeof(FIXTURE_PATCH) };
+  const size_t bytes[] = { 1 };
+  const size_t uneven[] = { 5, 1, 13, 700, 2, 11, 300, 7, 3, 12, 257 };
+  const size_t inflated[] = { 4096, 3, 4093 }; // (as tinfl's window wraps)
+  const size_t *feeds[] = { whole, bytes, uneven, inflated };
+  const int counts[] = { 1, 1, 11, 3 };
+  for(int f = 0; f < 4; f++) {
+    images_t im;
+    im.old = &old;
+    OtaPatch patch(readOld, writeNew, &im, old.size());
+    CHECK(apply(&patch, FIXTURE_PATCH, sizeof(FIXTURE_PATCH), feeds[f],
+      counts[f]));
+    CHECK(patch.done() && patch.error() == NULL);
+    CHECK(patch.oldImageSize() == old.size());
+    CHECK(patch.written() == nu.size() && im.built == nu);
+
+    CHECK(!patch.feed((const uint8_t *) "x", 1)); // trailing data
+    CHECK(strcmp(patch.error(), "data after the end of the patch") == 0);
+  }
+
+  // the old image in a partition too small for it
+  images_t im;
+  im.old = &old;
+  OtaPatch small(readOld, writeNew, &im, old.size() - 1);
+  CHECK(!small.feed(FIXTURE_PATCH, sizeof(FIXTURE_PATCH)));
+  CHECK(strcmp(small.error(), "patch is for a bigger image") == 0);
+
+  // flash read and write failures part way through stop it for good
+  images_t bad;
+  bad.old = &old;
+  bad.failReadsAfter = 3;
+  OtaPatch unreadable(readOld, writeNew, &bad, old.size());
+  CHECK(!unreadable.feed(FIXTURE_PATCH, sizeof(FIXTURE_PATCH)));
+  CHECK(strcmp(unreadable.error(), "can't read old image") == 0);
+  CHECK(!unreadable.feed(FIXTURE_PATCH, 1) && !unreadable.done());
+
+  images_t full;
+  full.old = &old;
+  full.failWritesAfter = 5;
+  OtaPatch unwritable(readOld, writeNew, &full, old.size());
+  CHECK(!unwritable.feed(FIXTURE_PATCH, sizeof(FIXTURE_PATCH)));
+  CHECK(strcmp(unwritable.error(), "can't write new image") == 0);
+}
+
+// hand-made patches: header, then records of (diff, extra, seek, bytes)
+static void put32(std::vector<uint8_t> *p, uint32_t v) {
+  for(int i = 0; i < 4; i++) p->push_back(v >> (8 * i));
+}
+static std::vector<uint8_t> header(uint32_t oldSize, uint32_t newSize) {
+  std::vector<uint8_t> p = { 'O', 'T', 'P', '1' };
+  put32(&p, oldSize);
+  put32(&p, newSize);
+  return p;
+}
+static void record(
+  std::vector<uint8_t> *p, uint32_t diff, uint32_t extra, int32_t seek
+) {
+  put32(p, diff);
+  put32(p, extra);
+  put32(p, (uint32_t) seek);
+  p->insert(p->end(), diff + extra, 0); // (zero diff bytes: a copy)
+}
+
+// feed p a byte at a time; the error, or NULL if it applied
+static const char *applyBytes(
+  const std::vector<uint8_t> &p, const std::vector<uint8_t> &old,
+  std::vector<uint8_t> *built = NULL
+) {
+  images_t im;
+  im.old = &old;
+  OtaPatch patch(readOld, writeNew, &im, 64);
+  for(uint8_t b : p)
+    if(!patch.feed(&b, 1)) return patch.error();
+  if(built != NULL) *built = im.built;
+  return patch.done() ? NULL : "unfinished";
+}
+
+static void malformed() {
+  std::vector<uint8_t> old;
+  for(int i = 0; i < 16; i++) old.push_back(i);
+  std::vector<uint8_t> built, p;
+
+  // a good one first: copy 4 from 8, 2 extra, back to 0, copy 4
+  p = header(16, 10);
+  record(&p, 0, 0, 8);
+  record(&p, 4, 2, -12);
+  record(&p, 4, 0, 0);
+  CHECK(applyBytes(p, old, &built) == NULL);
+  const uint8_t want[] = { 8, 9, 10, 11, 0, 0, 0, 1, 2, 3 };
+  CHECK(built.size() == 10 && memcmp(built.data(), want, 10) == 0);
+
+  p = header(16, 0);                      // (an empty image is done at once)
+  CHECK(applyBytes(p, old) == NULL);
+
+  p = header(16, 4);
+  p[3] = '2';
+  CHECK(strcmp(applyBytes(p, old), "not a patch") == 0);
+  p = header(65, 4);                      // (the partition is 64)
+  CHECK(strcmp(applyBytes(p, old), "patch is for a bigger image") == 0);
+
+  // records that run past the new image, or the old one
+  p = header(16, 4);
+  record(&p, 3, 2, 0);
+  CHECK(strcmp(applyBytes(p, old), "patch record out of range") == 0);
+  p = header(16, 20);
+  record(&p, 0, 0, 10);
+  record(&p, 7, 0, 0);
+  CHECK(strcmp(applyBytes(p, old), "patch record out of range") == 0);
+  p = header(16, 4);
+  put32(&p, 0xffffffff);                  // (no wrapping round)
+  put32(&p, 5);
+  put32(&p, 0);
+  CHECK(strcmp(applyBytes(p, old), "patch record out of range") == 0);
+
+  // seeks before the start or past the end of the old image
+  p = header(16, 8);
+  record(&p, 4, 0, -5);
+  CHECK(strcmp(applyBytes(p, old), "patch seeks out of range") == 0);
+  p = header(16, 8);
+  record(&p, 4, 0, 13);
+  CHECK(strcmp(applyBytes(p, old), "patch seeks out of range") == 0);
+  p = header(16, 8);
+  record(&p, 4, 0, 12);                   // (to the very end is fine...)
+  record(&p, 0, 4, 0);
+  CHECK(applyBytes(p, old) == NULL);
+  p = header(16, 8);
+  record(&p, 4, 0, 12);
+  record(&p, 1, 3, 0);                    // (...but there's nothing there)
+  CHECK(strcmp(applyBytes(p, old), "patch record out of range") == 0);
+
+  // trailing data after the last record; a patch cut short
+  p = header(16, 4);
+  record(&p, 4, 0, 0);
+  p.push_back(0);
+  CHECK(strcmp(applyBytes(p, old), "data after the end of the patch") == 0);
+  p = header(16, 4);
+  record(&p, 4, 0, 0);
+  p.pop_back();
+  CHECK(strcmp(applyBytes(p, old), "unfinished") == 0);
+}
+
+int main() {
+  fixture();
+  malformed();
+  return testsDone("ota-patch");
+}
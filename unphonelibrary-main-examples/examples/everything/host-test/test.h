@@ -0,0 +1,29 @@
+// test.h
+// a minimal check harness for the host tests of the sketch's hardware-free
+// headers: each test file is a program whose main() runs CHECKs and returns
+// testsDone(), non-zero if any failed
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <math.h>
+
+static int testChecks = 0, testFailures = 0;
+
+#define CHECK(cond) do { \
+  testChecks++; \
+  if(!(cond)) { \
+    testFailures++; \
+    printf("%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond); \
+  } \
+} while(0)
+
+#define CHECK_NEAR(a, b, tolerance) CHECK(fabs((a) - (b)) <= (tolerance))
+
+static inline int testsDone(const char *name) {
+  printf("%s: %d checks, %d failed\n", name, testChecks, testFailures);
+  return testFailures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,182 @@
+# ota-tool.py
+# firmware releases for joinmeOTAUpdate (joinme.cpp): make a signing key,
+# sign an image (writing N.bin, N.manifest and the version file into a
+# firmware directory, along with patches from the previous few versions
+# there), and serve a firmware directory locally, optionally dropping
+# connections part way through to exercise resumed downloads, e.g.:
+#
+#   python3 ota-tool.py keygen ota-key.pem      # then add the printed
+#                                               # _OTA_PUBLIC_KEY to private.h
+#   python3 ota-tool.py sign ota-key.pem .pio/build/unphone9/firmware.bin 2
+#   python3 ota-tool.py serve firmware --drop-every 100000
+#
+# (a device pointed at http://<this machine>:8000/ rather than the gitlab
+# project then updates from here.) needs the openssl command line tool
+
+import argparse, hashlib, http.server, os, re, shutil, struct, subprocess
+import zlib
+
+BLOCK = 16      # bytes of exact match needed to start a patch diff
+STEP = 4        # old image positions indexed
+MISSES = 32     # net mismatches tolerated before a diff ends
+
+def diff(old, new):
+    """a bsdiff-style patch turning old into new, in ota-patch.h's format:
+    approximate matches (same code, shifted addresses) become diff bytes,
+    which are mostly zero and so compress well; the rest is extra bytes"""
+    index = {}
+    for j in range(0, len(old) - BLOCK + 1, STEP):
+        index.setdefault(old[j:j + BLOCK], j)
+
+    matches = []                        # (new pos, old pos, length)
+    i, done, delta = 0, 0, None
+    while i <= len(new) - BLOCK:
+        j = None
+        if delta is not None and i + delta >= 0 and \
+                old[i + delta:i + delta + BLOCK] == new[i:i + BLOCK]:
+            j = i + delta               # (carry on where the last one was)
+        else:
+            j = index.get(new[i:i + BLOCK])
+        if j is None:
+            i += 1
+            continue
+        while i > done and j > 0 and new[i - 1] == old[j - 1]:
+            i, j = i - 1, j - 1
+
+        n, score, best, bestScore = 0, 0, 0, 0
+        while i + n < len(new) and j + n < len(old):
+            score += 1 if new[i + n] == old[j + n] else -1
+            n += 1
+            if score > bestScore:
+                best, bestScore = n, score
+            elif score < bestScore - MISSES:
+                break
+        matches.append((i, j, best))
+        i, done, delta = i + best, i + best, j - i
+
+    # each record: the diff of a match, then the extra bytes up to the next
+    # match, then a seek to where that one starts in old (the first record
+    # has no diff, the last no seek)
+    out = [b"OTP1", struct.pack("<II", len(old), len(new))]
+    matches.append((len(new), 0, 0))
+    prev = (0, 0, 0)
+    for match in matches if new else []:
+        i, j, n = prev
+        extra = new[i + n:match[0]]
+        diffBytes = bytes((new[i + k] - old[j + k]) & 0xff for k in range(n))
+        nextOld = match[1] if match[2] > 0 else j + n
+        out.append(struct.pack("<IIi", n, len(extra), nextOld - (j + n)))
+        out += [diffBytes, extra]
+        prev = match
+    return zlib.compress(b"".join(out), 9)
+
+def keygen(args):
+    subprocess.run(
+        ["openssl", "ecparam", "-name", "prime256v1", "-genkey", "-noout",
+         "-out", args.key], check=True)
+    pem = subprocess.run(
+        ["openssl", "ec", "-in", args.key, "-pubout"],
+        check=True, capture_output=True, text=True).stdout
+    print("keep %s secret; put this in private.h:\n" % args.key)
+    print("#define _OTA_PUBLIC_KEY \\")
+    print(" \\\n".join('  "%s\\n"' % line for line in pem.splitlines()))
+
+def sign(args):
+    image = open(args.image, "rb").read()
+    body = "version %d\nsize %d\nsha256 %s\n" % (
+        args.version, len(image), hashlib.sha256(image).hexdigest())
+    os.makedirs(args.dir, exist_ok=True)
+    older = sorted((
+        int(m.group(1)) for m in
+        (re.match(r"(\d+)\.bin$", n) for n in os.listdir(args.dir))
+        if m and int(m.group(1)) < args.version
+    ), reverse=True)[:args.patches]
+    for v in older:
+        patch = diff(open(os.path.join(args.dir, "%d.bin" % v), "rb").read(),
+            image)
+        with open(os.path.join(args.dir, "%d-%d.patch" % (args.version, v)),
+                "wb") as f:
+            f.write(patch)
+        body += "patch %d %d %s\n" % (
+            v, len(patch), hashlib.sha256(patch).hexdigest())
+        print("patch from %d: %d bytes (%.0f%%)" %
+            (v, len(patch), 100 * len(patch) / len(image)))
+    sig = subprocess.run(
+        ["openssl", "dgst", "-sha256", "-sign", args.key],
+        input=body.encode(), check=True, capture_output=True).stdout
+
+    shutil.copyfile(args.image, os.path.join(args.dir, "%d.bin" % args.version))
+    with open(os.path.join(args.dir, "%d.manifest" % args.version), "w") as f:
+        f.write(body + "sig %s\n" % sig.hex())
+    with open(os.path.join(args.dir, "version"), "w") as f:
+        f.write("%d\n" % args.version)
+    print("version %d: %d bytes, in %s/" % (args.version, len(image), args.dir))
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    dropEvery = 0          # bytes of a response before hanging up (0: never)
+    noRange = False        # ignore Range headers (like some servers)
+
+    def do_GET(self):
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            return self.send_error(404)
+        data = open(path, "rb").read()
+        etag = '"%s"' % hashlib.sha256(data).hexdigest()[:16]
+        if self.headers.get("If-None-Match") == etag:
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            return self.end_headers()
+        first = 0
+        m = re.match(r"bytes=(\d+)-$", self.headers.get("Range", ""))
+        if m and not self.noRange and int(m.group(1)) < len(data):
+            first = int(m.group(1))
+            self.send_response(206)
+            self.send_header("Content-Range",
+                "bytes %d-%d/%d" % (first, len(data) - 1, len(data)))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Length", str(len(data) - first))
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", etag)
+        self.end_headers()
+
+        body = data[first:]
+        if self.dropEvery and len(body) > self.dropEvery:
+            body = body[:self.dropEvery]
+            self.close_connection = True
+            self.log_message("dropping after %d bytes", len(body))
+        self.wfile.write(body)
+
+def serve(args):
+    Handler.dropEvery, Handler.noRange = args.drop_every, args.no_range
+    os.chdir(args.dir)
+    print("serving %s/ on port %d" % (args.dir, args.port))
+    http.server.ThreadingHTTPServer(("", args.port), Handler).serve_forever()
+
+def main():
+    parser = argparse.ArgumentParser(description="joinme OTA releases")
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("keygen", help="make an ECDSA P-256 signing key")
+    p.add_argument("key")
+    p.set_defaults(run=keygen)
+    p = sub.add_parser("sign", help="sign an image as a new version")
+    p.add_argument("key")
+    p.add_argument("image")
+    p.add_argument("version", type=int)
+    p.add_argument("--dir", default="firmware")
+    p.add_argument("--patches", type=int, default=2,
+        help="make patches from this many earlier versions in the directory")
+    p.set_defaults(run=sign)
+    p = sub.add_parser("serve", help="serve a firmware directory")
+    p.add_argument("dir", nargs="?", default="firmware")
+    p.add_argument("--port", type=int, default=8000)
+    p.add_argument("--drop-every", type=int, default=0,
+        help="hang up after this many bytes of each response")
+    p.add_argument("--no-range", action="store_true",
+        help="ignore Range requests (always send the whole file)")
+    p.set_defaults(run=serve)
+    args = parser.parse_args()
+    args.run(args)
+
+if __name__ == "__main__":
+    main()
@@ -24,6 +24,13 @@ class MenuUIElement: public UIElement { /////////////////////////////////////
 class ConfigUIElement: public UIElement { ///////////////////////////////////
   private:
     long m_timer;
+    uint32_t m_otaSeq = 0;      // last OTA event shown
+    uint16_t m_otaY = 0;        // where the firmware line is
+    void drawOTAStatus();
+    uint32_t m_wifiSeq = 0;     // last wifi state shown
+    uint16_t m_wifiY = 0;       // where the connection lines are...
+    uint16_t m_ipY = 0;         // ...and the IP address
+    void drawWiFiStatus();
   public:
     ConfigUIElement (Adafruit_HX8357* tft, XPT2046_Touchscreen* ts, SdFat* sd)
      : UIElement(tft, ts, sd) { m_timer = millis(); };
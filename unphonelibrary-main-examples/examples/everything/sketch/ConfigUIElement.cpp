@@ -2,6 +2,7 @@
 
 #include "AllUIElement.h"
 #include <WiFi.h>
+#include "wifi-state.h"
 
 static unPhone &u = unPhone::me();
 extern int firmwareVersion;
@@ -16,6 +17,13 @@ extern char BUILD_TIME[];
  * @returns bool - true if the touch is on the switcher
  */
 bool ConfigUIElement::handleTouch(long x, long y) {
+  // a tap on the firmware line installs an available update
+  TaskHandle_t ota = unPhone::tasks[unPhone::TASK_OTA].handle;
+  if(
+    y >= m_otaY && y < m_otaY + 20 && ota != NULL &&
+    joinmeOTAStatus().phase == JOINME_OTA_AVAILABLE
+  )
+    xTaskNotify(ota, JOINME_OTA_WAKE_INSTALL, eSetBits);
   return y < BOXSIZE && x > (BOXSIZE * SWITCHER);
 }
 
@@ -41,31 +49,22 @@ void ConfigUIElement::draw() {
 
   // are we connected?
   yCursor += 40;
-  m_tft->setCursor(0, yCursor);
-  if (WiFi.status() == WL_CONNECTED) {
-    yCursor += 20;
-    m_tft->print("Connected to: ");
-    m_tft->setTextColor(GREEN);
-    m_tft->print(WiFi.SSID());
-    m_tft->setTextColor(BLUE);
-  } else {
-    m_tft->setTextColor(RED);
-    m_tft->print("Not connected to WiFi:");
-    yCursor += 20;
-    m_tft->setCursor(0, yCursor);
-    m_tft->print("  trying to connect...");
-    m_tft->setTextColor(BLUE);
-  }
+  m_wifiY = yCursor;
+  yCursor += 20;
 
   // display the mac address
   char mac_buf[13];
+  char buf[256];
   yCursor += 40;
   m_tft->setCursor(0, yCursor);
   m_tft->print("MAC addr: ");
   m_tft->print(u.getMAC());
 
-  // firmware version
+  // firmware version (and updates)
   showLine("Firmware:", &yCursor);
+  m_otaY = yCursor;
+  m_otaSeq = 0;
+  drawOTAStatus();
   showLine("  ", &yCursor);
   m_tft->print(BUILD_TIME);
 
@@ -76,18 +75,26 @@ void ConfigUIElement::draw() {
 
   // IP address
   showLine("IP: ", &yCursor);
-  m_tft->print(WiFi.localIP());
+  m_ipY = yCursor;
+  m_wifiSeq = 0;
+  drawWiFiStatus();
 
-  // battery voltage
+  // battery voltage (and time to empty, when discharging)
   showLine("VBAT: ", &yCursor);
-  m_tft->print(u.batteryVoltage());
+  float vbat = u.batteryVoltageSmoothed();
+  m_tft->print((vbat > 0.0) ? vbat : u.batteryVoltage());
+  int32_t secsToEmpty = u.batterySecsToEmpty();
+  if(secsToEmpty >= 0) {
+    sprintf(buf, " (~%dh%02dm left)",
+      (int) (secsToEmpty / 3600), (int) ((secsToEmpty % 3600) / 60));
+    m_tft->print(buf);
+  }
 
   // battery voltage
   showLine("Hardware version: ", &yCursor);
   m_tft->print(UNPHONE_SPIN);
 
   // display the on-board temperature
-  char buf[256];
   float onBoardTemp = temperatureRead();
   sprintf(buf, "MCU temp: %.2f C", onBoardTemp);
   showLine(buf, &yCursor);
@@ -107,7 +114,79 @@ void ConfigUIElement::draw() {
   showLine("              unphone.net", &yCursor);
 }
 
+// version and OTA progress, after "Firmware:" //////////////////////////
+void ConfigUIElement::drawOTAStatus() {
+  joinme_ota_event_t e = joinmeOTAStatus();
+  m_otaSeq = e.seq;
+  char buf[32];
+  switch(e.phase) {
+    case JOINME_OTA_CHECKING:   sprintf(buf, "v%d checking", firmwareVersion);
+                                break;
+    case JOINME_OTA_UP_TO_DATE: sprintf(buf, "v%d latest", firmwareVersion);
+                                break;
+    case JOINME_OTA_AVAILABLE:  sprintf(buf, "v%d (tap for v%d)",
+                                  firmwareVersion, e.version);
+                                break;
+    case JOINME_OTA_DOWNLOADING:
+      sprintf(buf, "v%d get v%d %d%%", firmwareVersion, e.version,
+        e.total == 0 ? 0 : (int) ((uint64_t) e.done * 100 / e.total));
+      break;
+    case JOINME_OTA_VERIFYING:  sprintf(buf, "v%d verify v%d",
+                                  firmwareVersion, e.version);
+                                break;
+    case JOINME_OTA_RESTARTING: sprintf(buf, "v%d restarting", e.version);
+                                break;
+    case JOINME_OTA_FAILED:     sprintf(buf, "v%d update fail", firmwareVersion);
+                                break;
+    default:                    sprintf(buf, "v%d", firmwareVersion);
+  }
+  m_tft->fillRect(120, m_otaY, 200, 16, BLACK);
+  m_tft->setCursor(120, m_otaY);
+  m_tft->setTextColor(
+    e.phase == JOINME_OTA_FAILED ? RED :
+    e.phase == JOINME_OTA_AVAILABLE ? GREEN : BLUE
+  );
+  m_tft->print(buf);
+  m_tft->setTextColor(BLUE);
+}
+
+// the connection lines and IP address (wifi-state.h) ////////////////////
+void ConfigUIElement::drawWiFiStatus() {
+  wifi_event_t e = wifiStatus();
+  m_wifiSeq = e.seq;
+  m_tft->fillRect(0, m_wifiY, 320, 36, BLACK);
+  m_tft->setCursor(0, m_wifiY);
+  if(e.state == WIFI_CONNECTED) {
+    m_tft->print("Connected to: ");
+    m_tft->setTextColor(GREEN);
+    m_tft->print(WiFi.SSID());
+  } else {
+    char buf[32];
+    switch(e.state) {
+      case WIFI_SCANNING:    sprintf(buf, "  scanning...");           break;
+      case WIFI_ASSOCIATING: sprintf(buf, "  joining...");            break;
+      case WIFI_BACKOFF:     sprintf(buf, "  retrying in %lus",
+                               (unsigned long) (e.retryMs + 999) / 1000);
+                             break;
+      default:               sprintf(buf, "  trying to connect...");
+    }
+    m_tft->setTextColor(RED);
+    m_tft->print("Not connected to WiFi:");
+    m_tft->setCursor(0, m_wifiY + 20);
+    m_tft->print(buf);
+  }
+  m_tft->setTextColor(BLUE);
+
+  m_tft->fillRect(48, m_ipY, 272, 16, BLACK);
+  m_tft->setCursor(48, m_ipY);
+  m_tft->print(WiFi.localIP());
+}
+
 //////////////////////////////////////////////////////////////////////////
 void ConfigUIElement::runEachTurn() {
-  
+  // OTA and wifi events: redraw just the firmware or connection lines
+  if(joinmeOTAStatus().seq != m_otaSeq)
+    drawOTAStatus();
+  if(wifiStatus().seq != m_wifiSeq)
+    drawWiFiStatus();
 }
@@ -54,7 +54,7 @@ void EtchASketchUIElement::runEachTurn(){
   */
 
   // delay before the next sample
-  delay(20);
+  WAIT_MS(20)
 }
 
 /**
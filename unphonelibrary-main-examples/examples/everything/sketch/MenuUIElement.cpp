@@ -41,6 +41,7 @@ void MenuUIElement::draw(){
   yCursor += 16;
 
   for(int i = 1; i < NUM_UI_ELEMENTS; i++) {
+    unPhone::me().spiCheckpoint(); // (let LMIC in during long menus)
     m_tft->setCursor(0, yCursor);
     m_tft->print(ui_mode_names[i]);
     drawSwitcher(288, yCursor - 12);
@@ -16,7 +16,7 @@ bool TestRigUIElement::handleTouch(long x, long y) {
     m_tft->setTextColor(RED);
     m_tft->setCursor(15, 300); m_tft->print("restart in 3...");
 
-    delay(3000);
+    WAIT_MS(3000) // (releasing the SPI bus, so LMIC carries on meanwhile)
     ESP.restart();
   }
   return y < BOXSIZE && x > (BOXSIZE * SWITCHER);
@@ -6,6 +6,7 @@ static unPhone &u = unPhone::me();
 
 // initialisation flag, not complete until parent has finished config
 bool UIController::provisioned = false;
+touch_stats_t UIController::touchStats = { 0, 0, 0 };
 
 // the UI elements types (screens) /////////////////////////////////////////
 const char *ui_mode_names[] = {
@@ -43,7 +44,7 @@ bool UIController::begin(boolean doDraw) { //////////////////////////////////
 
   u.tftp->fillScreen(HX8357_GREEN);
   WAIT_MS(50)
-  u.tftp->fillScreen(HX8357_BLACK);
+  u.fillScreen(HX8357_BLACK);
   
   // define the menu element and the first m_element here 
   //Serial.println("UIController.begin 3");
@@ -148,6 +149,7 @@ bool UIController::gotTouch() {
   if(!u.tsp->touched()) {
     return false; // no touches
   }
+  u.activity(); // (keeps the idle governor at bay)
     
   // set up timings
   now = millis();
@@ -173,6 +175,7 @@ bool UIController::gotTouch() {
   if(p == firstTouch && firstTimeThrough) {
     dbgTouch();
     if(touchDBG) D(", rejecting (0)\n\n")
+    touchStats.rejected++;
     return false;
   }
   firstTimeThrough = false;
@@ -199,15 +202,18 @@ bool UIController::gotTouch() {
     prevSigMillis = now;
     if(false) // delete this line to debug touch debounce
       D("decided this is a new touch: p(x:%04d,y:%04d,z:%03d)\n", p.x, p.y, p.z)
+    touchStats.accepted++;
+    touchStats.lastMillis = now;
     return true;
   }
+  touchStats.rejected++;
   return false;
 }
 
 /////////////////////////////////////////////////////////////////////////////
 void UIController::changeMode() {
   D("changing mode from %d (%s) to...", m_mode, modeName(m_mode))
-  u.tftp->fillScreen(HX8357_BLACK);
+  u.fillScreen(HX8357_BLACK);
   setTimeSensitivity();         // set TIME_SENS to the default
   nextMode = (ui_modes_t) ((MenuUIElement *)m_menu)->getMenuItemSelected();
   if(nextMode == -1) nextMode = ui_menu;
@@ -245,14 +251,36 @@ void UIController::handleTouch() {
 
 /////////////////////////////////////////////////////////////////////////////
 void UIController::run() {
+  int8_t requested = requestedMode;
+  if(requested != -1) {         // switch screens for another task
+    requestedMode = -1;
+    D("switching to mode %d (%s) on request\n",
+      requested, modeName((ui_modes_t) requested))
+    setTimeSensitivity(
+      requested == ui_touchpaint ? 25 : DEFAULT_TIME_SENSITIVITY
+    );
+    m_mode = (ui_modes_t) requested;
+    allocateUIElement(m_mode);
+    redraw();
+  }
+
   if(gotTouch())
     handleTouch();
   m_element->runEachTurn();
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// ask the UI task to change screens at its next turn (this may be called
+// from other tasks, e.g. a LoRa downlink handler)
+void UIController::requestMode(ui_modes_t mode) {
+  if(mode < 0 || mode >= NUM_UI_ELEMENTS) return;
+  requestedMode = mode;
+}
+
 ////////////////////////////////////////////////////////////////////////////
 void UIController::redraw() {
-  u.tftp->fillScreen(HX8357_BLACK);
+  u.fillScreen(HX8357_BLACK);
+  u.spiCheckpoint();            // (elements checkpoint as they draw too)
   m_element->draw();
 }
 
@@ -282,6 +310,7 @@ void UIElement::drawSwitcher(uint16_t xOrigin, uint16_t yOrigin) {
 
 ////////////////////////////////////////////////////////////////////////////
 void UIElement::showLine(const char *buf, uint16_t *yCursor) {
+  u.spiCheckpoint();            // (pages of these can take a while)
   *yCursor += 20;
   m_tft->setCursor(0, *yCursor);
   m_tft->print(buf);
@@ -6,11 +6,6 @@
 #include "unphone.h"            // specifics of the unPhone
 #include "foodflows.h"          // predictive text input
 
-// delay/yield/timing and time-slicing macros
-#define WAIT_A_SEC   vTaskDelay(    1000/portTICK_PERIOD_MS); // 1 second
-#define WAIT_SECS(n) vTaskDelay((n*1000)/portTICK_PERIOD_MS); // n seconds
-#define WAIT_MS(n)   vTaskDelay(       n/portTICK_PERIOD_MS); // n millis
-
 class UIElement { ///////////////////////////////////////////////////////////
   protected:
     Adafruit_HX8357* m_tft;
@@ -59,6 +54,12 @@ enum ui_modes_t {
 extern const char *ui_mode_names[];
 extern uint8_t NUM_UI_ELEMENTS;  // number of UI elements (screens)
 
+typedef struct {        // touch signal counts (see gotTouch)
+  uint32_t accepted;    // new touches passed to the UI
+  uint32_t rejected;    // debounced, too close, or ghost touches
+  uint32_t lastMillis;  // when the last touch was accepted
+} touch_stats_t;
+
 class UIController { ////////////////////////////////////////////////////////
   private:
     UIElement* m_element = 0;
@@ -68,6 +69,7 @@ class UIController { ////////////////////////////////////////////////////////
     void changeMode();
     ui_modes_t m_mode;
     ui_modes_t nextMode = ui_configure; // starting mode
+    volatile int8_t requestedMode = -1; // set by requestMode
   public:
     UIController(ui_modes_t);
     bool begin();
@@ -75,8 +77,10 @@ class UIController { ////////////////////////////////////////////////////////
     UIElement* allocateUIElement(ui_modes_t);
     void run();
     void redraw();
+    void requestMode(ui_modes_t); // switch screens (safe from any task)
     void message(char *s);
     static bool provisioned;
+    static touch_stats_t touchStats;
     const char *modeName(ui_modes_t);
 };
 
@@ -0,0 +1,98 @@
+// battery.cpp
+// battery telemetry: voltage, USB presence and BM status history
+
+#include "unphone.h"
+
+static unPhone &u = unPhone::me();
+
+// VBAT is read via the touch controller's ADC, which lives on the SPI bus
+// with the LCD, SD card and LoRa radio; to avoid contending with touch reads
+// batterySample() is called from the UI task (see unLoopTask), takes the
+// bus lock and is cheap when no sample is due. other tasks only read the
+// ring, under ringMux
+static unPhone::batterySample_t ring[unPhone::BATT_RING_SIZE];
+static uint8_t ringNext = 0;           // next insertion point
+static uint8_t ringCount = 0;          // number of valid samples
+static uint32_t lastSampleMillis = 0;  // when we last sampled
+static float smoothedVolts = 0.0;      // exponentially weighted moving avg
+static portMUX_TYPE ringMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const float SMOOTHING = 0.25;   // EWMA weight of the newest sample
+static const float EMPTY_VOLTS = 3.4;  // where we call the battery empty
+static const uint8_t MIN_FIT_SAMPLES = 6; // need this many to fit a slope
+
+void unPhone::batterySample() { // sample if due /////////////////////////////
+  uint32_t now = millis();
+  if(ringCount > 0 && now - lastSampleMillis < BATT_SAMPLE_MS) return;
+  lastSampleMillis = now;
+
+  batterySample_t s;
+  s.millis = now;
+  spiLock(); // the touch controller's ADC is on SPI
+  s.millivolts = (uint16_t) (batteryVoltage() * 1000.0);
+  spiUnlock();
+  s.bmStatus = getRegister(BM_I2CADD, BM_STATUS);
+  s.usb = (bool) bitRead(s.bmStatus, 2); // as in usbPowerConnected()
+
+  portENTER_CRITICAL(&ringMux);
+  ring[ringNext] = s;
+  if(++ringNext == BATT_RING_SIZE) ringNext = 0;
+  if(ringCount < BATT_RING_SIZE) ringCount++;
+  float volts = s.millivolts / 1000.0;
+  if(ringCount == 1)
+    smoothedVolts = volts;
+  else
+    smoothedVolts += SMOOTHING * (volts - smoothedVolts);
+  portEXIT_CRITICAL(&ringMux);
+}
+
+float unPhone::batteryVoltageSmoothed() { ////////////////////////////////////
+  portENTER_CRITICAL(&ringMux);
+  float v = smoothedVolts;
+  portEXIT_CRITICAL(&ringMux);
+  return v;
+}
+
+// copy up to max samples into buf, oldest first; returns the number copied
+uint8_t unPhone::batteryHistory(batterySample_t *buf, uint8_t max) { /////////
+  portENTER_CRITICAL(&ringMux);
+  uint8_t n = (ringCount < max) ? ringCount : max;
+  uint8_t i = (ringNext + BATT_RING_SIZE - n) % BATT_RING_SIZE; // newest n
+  for(uint8_t j = 0; j < n; j++) {
+    buf[j] = ring[i];
+    if(++i == BATT_RING_SIZE) i = 0;
+  }
+  portEXIT_CRITICAL(&ringMux);
+  return n;
+}
+
+// least squares fit of voltage against time over the most recent unbroken
+// run of on-battery samples; the discharge rate and the smoothed voltage
+// give us a (linear, so rough) time to EMPTY_VOLTS. called from the UI task,
+// loop() and the LoRa task, so each works on its own copy of the ring
+int32_t unPhone::batterySecsToEmpty() { //////////////////////////////////////
+  batterySample_t hist[BATT_RING_SIZE];   // (512 bytes of stack)
+  uint8_t n = batteryHistory(hist, BATT_RING_SIZE); // (copied under ringMux)
+
+  uint8_t first = n;
+  while(first > 0 && !hist[first - 1].usb) first--; // back to last USB
+  uint8_t runLen = n - first;
+  if(runLen < MIN_FIT_SAMPLES) return -1; // charging, or too little data
+
+  // times relative to the first sample of the run, in seconds
+  float sumT = 0.0, sumV = 0.0, sumTT = 0.0, sumTV = 0.0;
+  uint32_t t0 = hist[first].millis;
+  for(uint8_t i = first; i < n; i++) {
+    float t = (hist[i].millis - t0) / 1000.0;
+    float v = hist[i].millivolts / 1000.0;
+    sumT += t; sumV += v; sumTT += t * t; sumTV += t * v;
+  }
+  float denom = runLen * sumTT - sumT * sumT;
+  if(denom <= 0.0) return -1;
+  float slope = (runLen * sumTV - sumT * sumV) / denom; // volts per second
+  if(slope >= 0.0) return -1;                           // not discharging
+
+  float remaining = batteryVoltageSmoothed() - EMPTY_VOLTS;
+  if(remaining <= 0.0) return 0;
+  return (int32_t) (remaining / -slope);
+}
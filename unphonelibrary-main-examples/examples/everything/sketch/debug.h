@@ -0,0 +1,18 @@
+// debug.h
+// macros for debug (and error) calls to printf (unphone.h includes this;
+// code that must build without the unPhone class, e.g. lora-work.cpp, can
+// include it alone)
+
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdio.h>
+
+#ifdef UNPHONE_PRODUCTION_BUILD
+# define D(args...) (void)0;
+#else
+# define D(args...) printf(args);
+#endif
+#define  E(args...) printf("ERROR: " args);
+
+#endif
@@ -4,6 +4,13 @@
 #include <freertos/FreeRTOS.h>
 #include "AsyncTCP.h"
 #include "ESPAsyncWebServer.h"
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include "web-assets.h"
+#include "UIController.h"
+#include <freertos/timers.h>
+#include <esp_timer.h>
 
 // debug macros
 #define dbg(b, s) if(b) Serial.print(s)
@@ -16,108 +23,361 @@
 #define analogDBG       true
 #define otaDBG          true
 
-// mega-simple templating
+// mega-simple templating: a page is an array of boilerplate strings (in
+// flash), some of which are replaced per request; the page is streamed out in
+// chunks as the server asks for them, so no page-sized String is built
 typedef struct { int position; const char *replacement; } replacement_t;
-void getHtml(String& html, const char *[], int, replacement_t [], int);
+void sendHtml(
+  AsyncWebServerRequest *, const char *const [], int, replacement_t [], int
+);
 #define ALEN(a) ((int) (sizeof(a) / sizeof(a[0]))) // only in definition scope!
-#define GET_HTML(strout, boiler, repls) \
-  getHtml(strout, boiler, ALEN(boiler), repls, ALEN(repls));
+#define SEND_HTML(request, boiler, repls) \
+  sendHtml(request, boiler, ALEN(boiler), repls, ALEN(repls));
 
-// templating: turn array of strings & set of replacements into a String
-void getHtml(
-  String& html, const char *boiler[], int boilerLen,
+// the state of one page being streamed: the boilerplate, copies of the
+// replacements (the request's own may be gone before the last chunk), and
+// where the previous chunk ended
+class HtmlStream {
+  const char *const *boiler;
+  int boilerLen;
+  std::vector<std::pair<int, String>> repls; // in position order
+  int part = 0;          // next part to send...
+  size_t offset = 0;     // ...from this byte of it
+  size_t sent = 0;       // bytes sent so far
+
+  const char *partText(int i, size_t *len) {
+    for(auto &r : repls)
+      if(r.first == i) { *len = r.second.length(); return r.second.c_str(); }
+    *len = strlen(boiler[i]);
+    return boiler[i];
+  }
+
+public:
+  HtmlStream(
+    const char *const b[], int bLen, replacement_t rs[], int rsLen
+  ) : boiler(b), boilerLen(bLen) {
+    for(int i = 0; i < rsLen; i++)
+      repls.push_back(std::make_pair(rs[i].position, String(rs[i].replacement)));
+  }
+
+  // copy up to maxLen bytes from index on into buf; 0 when done
+  size_t fill(uint8_t *buf, size_t maxLen, size_t index) {
+    if(index != sent) { part = 0; offset = 0; sent = 0; } // (rewound: seek)
+    size_t n = 0;
+    while(part < boilerLen && (n < maxLen || sent < index)) {
+      size_t len;
+      const char *text = partText(part, &len);
+      size_t avail = len - offset;
+      if(sent < index) { // skip to index
+        size_t skip = std::min(avail, index - sent);
+        offset += skip; sent += skip; avail -= skip;
+      }
+      size_t take = std::min(avail, maxLen - n);
+      if(sent >= index) {
+        memcpy(buf + n, text + offset, take);
+        offset += take; sent += take; n += take;
+      }
+      if(offset == len) { part++; offset = 0; }
+    }
+    return n;
+  }
+};
+
+// templating: stream array of strings & set of replacements as the response
+void sendHtml(
+  AsyncWebServerRequest *request, const char *const boiler[], int boilerLen,
   replacement_t repls[], int replsLen
 ) {
-  for(int i = 0, j = 0; i < boilerLen; i++) {
-    if(j < replsLen && repls[j].position == i)
-      html.concat(repls[j++].replacement);
-    else
-      html.concat(boiler[i]);
-  }
+  std::shared_ptr<HtmlStream> page =
+    std::make_shared<HtmlStream>(boiler, boilerLen, repls, replsLen);
+  request->send(request->beginChunkedResponse("text/html",
+    [page](uint8_t *buf, size_t maxLen, size_t index) -> size_t {
+      return page->fill(buf, maxLen, index);
+    }
+  ));
 }
 
-// a page boilerplate: constants & pattern parts of template
-const char *boiler[] = {
-  "<html><head><title>                                                \n", // 00
-  "christmas colours                                                  \n", // 01
-  "</title>                                                           \n", // 02
-  "<meta charset='utf-8'>                                             \n", // 03
-  "<meta name='viewport'                                              \n", // 04
-  "  content='width=device-width, initial-scale=1.0'>                 \n", // 05
-  "<style>                                                            \n", // 06
-  "body, p, label, input { font: 1rem 'Fira Sans', sans-serif;        \n", // 07
-  "  background:#FFF; color: #000; font-size: 150%; }                 \n", // 08
-  "input { margin: .4rem; }                                           \n", // 09
-  "form.form-example { display: table; }                              \n", // 10
-  "div.form-example { display: table-row; }                           \n", // 11
-  "div.submit-form { display: center; }                               \n", // 12
-  "label, input { display: table-cell; }                              \n", // 13
-  "</style>                                                           \n", // 14
-  "</head><body>                                                      \n", // 15
-  "<form action='' method='get' class='form-example'>                 \n", // 16
-  "<!--                                                               \n", // 17
-  "  <p>style:</p>                                                    \n", // 18
-  "  <div class='form-example'>                                       \n", // 19
-  "    <label for='xmas'>xmas</label>                                 \n", // 20
-  "    <input type='radio' id='xmas' name='runner' value='xmas'       \n", // 21
-  "      checked>                                                     \n", // 22
-  "  </div>                                                           \n", // 23
-  "  <div class='form-example'>                                       \n", // 24
-  "    <label for='off'>off</label>                                   \n", // 25
-  "    <input type='radio' id='off' name='runner' value='off'>        \n", // 26
-  "  </div>                                                           \n", // 27
-  "  <br/>                                                            \n", // 28
-  "  <p>colours:</p>                                                  \n", // 29
-  "-->                                                                \n", // 30
-  "  <div class='form-example'>                                       \n", // 31
-  "    <label for='red'>red</label>                                   \n", // 32
-  "    <input type='range' id='red' name='red' min='0' max='255'      \n", // 33
-  "      value='127'>                                                 \n", // 34
-  "  </div> <div class='form-example'>                                \n", // 35
-  "    <label for='green'>green</label>                               \n", // 36
-  "    <input type='range' id='green' name='green' min='0' max='255'  \n", // 37
-  "      value='127'>                                                 \n", // 38
-  "  </div> <div class='form-example'>                                \n", // 39
-  "    <label for='blue'>blue</label>                                 \n", // 40
-  "    <input type='range' id='blue' name='blue' min='0' max='255'    \n", // 41
-  "      value='127'>                                                 \n", // 42
-  "  </div>                                                           \n", // 43
-  "  <br/><br/>                                                       \n", // 44
-  "  </div> <div class='form-example'>                                \n", // 45
-  "    <label for='bright'>brightness</label>                         \n", // 46
-  "    <input type='range' id='bright' name='bright' min='0' max='100'\n", // 47
-  "      value='10'>                                                  \n", // 48
-  "  </div>                                                           \n", // 49
-  "  <br/><br/>                                                       \n", // 50
-  "  <div class='form-example'>                                       \n", // 51
-  "    <label for='submit-button'>   </label>                         \n", // 52
-  "    <input type='submit' value='update' id='submit-button'>        \n", // 53
-  "  </div>                                                           \n", // 54
-  "</form><pre>                                                       \n", // 55
-  "<!-- req params -->                                                \n", // 56
-  "</pre>&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;               ", // 57
-  "&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;(<a href='/'>reset</a>)        \n", // 58
-  "</body></html>                                                     \n", // 59
-  "                                                                   \n", // 60
+// a page boilerplate: constants & pattern parts of template (the comments
+// give each string's position, for replacement_t)
+const char *const boiler[] = {
+  "<html><head><title>\n",                                             // 00
+  "christmas colours\n",                                               // 01
+  "</title>\n",                                                        // 02
+  "<meta charset='utf-8'>\n",                                          // 03
+  "<meta name='viewport'\n",                                           // 04
+  "  content='width=device-width, initial-scale=1.0'>\n",              // 05
+  "<link rel='stylesheet' href='/style.css'>\n",                       // 06
+  "</head><body>\n",                                                   // 07
+  "<form action='' method='get' class='form-example'>\n",              // 08
+  "<!--\n",                                                            // 09
+  "  <p>style:</p>\n",                                                 // 10
+  "  <div class='form-example'>\n",                                    // 11
+  "    <label for='xmas'>xmas</label>\n",                              // 12
+  "    <input type='radio' id='xmas' name='runner' value='xmas'\n",    // 13
+  "      checked>\n",                                                  // 14
+  "  </div>\n",                                                        // 15
+  "  <div class='form-example'>\n",                                    // 16
+  "    <label for='off'>off</label>\n",                                // 17
+  "    <input type='radio' id='off' name='runner' value='off'>\n",     // 18
+  "  </div>\n",                                                        // 19
+  "  <br/>\n",                                                         // 20
+  "  <p>colours:</p>\n",                                               // 21
+  "-->\n",                                                             // 22
+  "  <div class='form-example'>\n",                                    // 23
+  "    <label for='red'>red</label>\n",                                // 24
+  "    <input type='range' id='red' name='red' min='0' max='255'\n",   // 25
+  "      value='127'>\n",                                              // 26
+  "  </div> <div class='form-example'>\n",                             // 27
+  "    <label for='green'>green</label>\n",                            // 28
+  "    <input type='range' id='green' name='green' min='0' max='255'\n", // 29
+  "      value='127'>\n",                                              // 30
+  "  </div> <div class='form-example'>\n",                             // 31
+  "    <label for='blue'>blue</label>\n",                              // 32
+  "    <input type='range' id='blue' name='blue' min='0' max='255'\n", // 33
+  "      value='127'>\n",                                              // 34
+  "  </div>\n",                                                        // 35
+  "  <br/><br/>\n",                                                    // 36
+  "  </div> <div class='form-example'>\n",                             // 37
+  "    <label for='bright'>brightness</label>\n",                      // 38
+  "    <input type='range' id='bright' name='bright' min='0' max='100'\n", // 39
+  "      value='10'>\n",                                               // 40
+  "  </div>\n",                                                        // 41
+  "  <br/><br/>\n",                                                    // 42
+  "  <div class='form-example'>\n",                                    // 43
+  "    <label for='submit-button'>   </label>\n",                      // 44
+  "    <input type='submit' value='update' id='submit-button'>\n",     // 45
+  "  </div>\n",                                                        // 46
+  "</form><pre>\n",                                                    // 47
+  "<!-- req params -->\n",                                             // 48
+  "</pre>&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp; ",           // 49
+  "&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;(<a href='/'>reset</a>)\n",     // 50
+  "</body></html>\n",                                                  // 51
+  "\n",                                                                // 52
 };
 
 /*
   for(int i = 0; i < ALEN(boiler); i++) // print the boilerplate for reference
     dbg(miscDBG, boiler[i]);
 
-  getHtml(htmlPage, boiler, ALEN(boiler), repls, ALEN(repls)); // instantiate
-
-  dbg(miscDBG, htmlPage.c_str()); // print the result
+  SEND_HTML(request, boiler, repls); // instantiate & stream
 */
 
 AsyncWebServer server(80);
 const char* PARAM_MESSAGE = "message";
 
+// telemetry for dashboards: loop() calls webSnapshot() on the sketch's
+// snapshot timer, reading the hardware once into a JSON snapshot; GET
+// /api/status returns it and /events (server-sent events) streams it to every
+// client, so however many clients there are the hardware is read at one rate
+static const size_t SNAPSHOT_MAX = 1536;
+static const uint32_t SNAPSHOT_MIN_MS = 250;   // fastest rate allowed...
+static const uint32_t SNAPSHOT_MAX_MS = 60000; // ...and slowest
+static const uint8_t EVENT_CLIENTS_MAX = 4;    // /events streams at once
+static char snapshot[SNAPSHOT_MAX] = "{}";
+static uint32_t snapshotId = 0;                // bumped for each snapshot
+static SemaphoreHandle_t snapshotLock = NULL;  // guards snapshot and id
+static TimerHandle_t snapshotTimer = NULL;     // (period: the rate)
+static uint8_t eventClients = 0;               // (AsyncTCP task only)
+
+// an /events stream: a chunked response whose filler runs in the AsyncTCP
+// task (when the connection can take more, and when polled, about every
+// 500 ms) and copies out each new snapshot under snapshotLock. loop() never
+// touches the connections, so unlike AsyncEventSource::send (whose client
+// list and queues the AsyncTCP task changes unlocked) nothing races
+struct event_stream_t {
+  bool first = true;                           // send the current state
+  uint32_t lastId = 0;                         // snapshot last copied
+  size_t len = 0, sent = 0;                    // the frame being sent
+  char frame[SNAPSHOT_MAX + 40];               // (with the SSE fields)
+  event_stream_t() { eventClients++; }
+  ~event_stream_t() { eventClients--; }        // (when the response goes)
+};
+
+static size_t fillEvents(event_stream_t *s, uint8_t *buf, size_t max) {
+  if(s->sent == s->len) { // frame done: is there a newer snapshot?
+    xSemaphoreTake(snapshotLock, portMAX_DELAY);
+    if(s->first || snapshotId != s->lastId) {
+      int n = snprintf(s->frame, sizeof(s->frame),
+        "id: %u\nevent: status\ndata: %s\n\n", snapshotId, snapshot);
+      s->len = n < 0 ? 0 : min((size_t) n, sizeof(s->frame) - 1);
+      s->sent = 0;
+      s->lastId = snapshotId;
+      s->first = false;
+    }
+    xSemaphoreGive(snapshotLock);
+    if(s->sent == s->len) return RESPONSE_TRY_AGAIN;
+  }
+  size_t n = min(max, s->len - s->sent);
+  memcpy(buf, s->frame + s->sent, n);
+  s->sent += n;
+  return n;
+}
+
+// append printf style to a JSON buffer, stopping (not overflowing) when full
+static void jput(char *buf, size_t *n, const char *fmt, ...) {
+  if(*n >= SNAPSHOT_MAX) return;
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf + *n, SNAPSHOT_MAX - *n, fmt, args);
+  va_end(args);
+  if(len > 0) *n += len;
+}
+
+// read battery, accelerometer, touch, LoRa and task stats into the snapshot
+// (the /events streams pick it up); runs in loop() (as the hardware reads
+// must)
+void webSnapshot() {
+  static char json[SNAPSHOT_MAX];
+  size_t n = 0;
+  unPhone &u = unPhone::me();
+
+  jput(json, &n, "{\"uptimeMs\":%lu,\"freeHeap\":%u,",
+    millis(), ESP.getFreeHeap());
+  jput(json, &n,
+    "\"battery\":{\"volts\":%.3f,\"usb\":%s,\"secsToEmpty\":%d},",
+    u.batteryVoltageSmoothed(), u.usbPowerConnected() ? "true" : "false",
+    u.batterySecsToEmpty());
+  sensors_event_t e;
+  u.getAccelEvent(&e);
+  jput(json, &n, "\"accel\":{\"x\":%.2f,\"y\":%.2f,\"z\":%.2f},",
+    e.acceleration.x, e.acceleration.y, e.acceleration.z);
+  touch_stats_t t = UIController::touchStats;
+  jput(json, &n,
+    "\"touch\":{\"accepted\":%u,\"rejected\":%u,\"lastMs\":%u},",
+    t.accepted, t.rejected, t.lastMillis);
+
+  lora_queue_stats_t q;
+  lora_queue_stats(&q);
+  jput(json, &n, "\"lora\":{\"queue\":{\"depth\":%u,\"maxDepth\":%u,"
+    "\"enqueued\":%u,\"dequeued\":%u,\"dropped\":%u},",
+    q.depth, q.maxDepth, q.enqueued, q.dequeued, q.dropped);
+  lora_delivery_stats_t d;
+  lora_delivery_stats(&d);
+  jput(json, &n, "\"delivery\":{\"sent\":%u,\"acked\":%u,\"failed\":%u,"
+    "\"retries\":%u,\"p50Ms\":%u,\"p90Ms\":%u,\"p99Ms\":%u,",
+    d.sent, d.acked, d.failed, d.retries, d.p50Ms, d.p90Ms, d.p99Ms);
+  if(d.successRate < 0) jput(json, &n, "\"successRate\":null},");
+  else jput(json, &n, "\"successRate\":%.3f},", d.successRate);
+  lora_link_stats_t l;
+  lora_link_stats(&l);
+  jput(json, &n, "\"link\":{\"samples\":%u,\"snr\":%.1f,\"rssi\":%d,"
+    "\"sf\":%u,\"txPow\":%d,\"deliveryPercent\":%d}},",
+    l.samples, l.snrTenths / 10.0, l.rssi, l.sf, l.txPow, l.deliveryPercent);
+
+  jput(json, &n, "\"tasks\":[");
+  for(int i = 0; i < unPhone::NUM_TASKS; i++) {
+    TaskHandle_t h = unPhone::tasks[i].handle;
+    jput(json, &n, "%s{\"name\":\"%s\",\"running\":%s,\"stackFree\":%u}",
+      i == 0 ? "" : ",", unPhone::tasks[i].name, h ? "true" : "false",
+      h ? uxTaskGetStackHighWaterMark(h) : 0);
+  }
+  jput(json, &n, "]}");
+  if(n >= SNAPSHOT_MAX) { E("web snapshot truncated\n") return; }
+
+  xSemaphoreTake(snapshotLock, portMAX_DELAY);
+  memcpy(snapshot, json, n + 1);
+  snapshotId++;
+  xSemaphoreGive(snapshotLock);
+}
+
+// per-route stats: every route is registered through serveOn, which times
+// its handler and notes the heap it leaves allocated (for chunked and
+// streamed responses that's the setup; the rest is sent later, from the
+// same AsyncTCP task). GET /api/routes returns them, e.g. to read alongside
+// web-load.py. handlers all run in the AsyncTCP task, so no locking. the
+// heap figure is approximate: ESP.getFreeHeap() is the whole heap, and the
+// WiFi, lwIP and LoRa tasks (on both cores) allocate and free meanwhile
+static const uint8_t ROUTES_MAX = 16;
+static const uint8_t ROUTE_SAMPLES = 64;      // latencies kept per route
+typedef struct {
+  const char *path;
+  WebRequestMethod method;
+  uint32_t count;
+  uint64_t totalUs;
+  uint32_t maxUs;
+  int32_t maxHeapDelta;                       // bytes still allocated (~)
+  uint32_t samples[ROUTE_SAMPLES];            // ring of recent latencies
+} route_stats_t;
+static route_stats_t routeStats[ROUTES_MAX];
+static uint8_t numRoutes = 0;
+
+void serveOn(
+  const char *path, WebRequestMethod method, ArRequestHandlerFunction handler
+) {
+  if(numRoutes == ROUTES_MAX) { // (serve it, just without stats)
+    E("route stats full, %s not instrumented\n", path)
+    server.on(path, method, handler);
+    return;
+  }
+  route_stats_t *stats = &routeStats[numRoutes++];
+  memset(stats, 0, sizeof(route_stats_t));
+  stats->path = path;
+  stats->method = method;
+  server.on(path, method,
+    [stats, handler](AsyncWebServerRequest *request) {
+      uint32_t heapBefore = ESP.getFreeHeap();
+      int64_t start = esp_timer_get_time();
+      handler(request);
+      uint32_t us = esp_timer_get_time() - start;
+      int32_t heapDelta = (int32_t) heapBefore - (int32_t) ESP.getFreeHeap();
+      stats->samples[stats->count % ROUTE_SAMPLES] = us;
+      stats->count++;
+      stats->totalUs += us;
+      if(us > stats->maxUs) stats->maxUs = us;
+      if(heapDelta > stats->maxHeapDelta) stats->maxHeapDelta = heapDelta;
+    }
+  );
+}
+
+// GET /api/routes: count, mean/p99/max handler microseconds, and the
+// largest (approximate) heap delta
+void sendRouteStats(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response =
+    request->beginResponseStream("application/json");
+  response->addHeader("Cache-Control", "no-store");
+  response->print("[");
+  for(uint8_t i = 0; i < numRoutes; i++) {
+    route_stats_t *r = &routeStats[i];
+    uint8_t n = min(r->count, (uint32_t) ROUTE_SAMPLES);
+    uint32_t sorted[ROUTE_SAMPLES];
+    memcpy(sorted, r->samples, n * sizeof(uint32_t));
+    std::sort(sorted, sorted + n);
+    response->printf(
+      "%s{\"path\":\"%s\",\"method\":\"%s\",\"count\":%u,"
+      "\"meanUs\":%u,\"p99Us\":%u,\"maxUs\":%u,\"approxHeapDelta\":%d}",
+      i == 0 ? "" : ",", r->path, r->method == HTTP_POST ? "POST" : "GET",
+      r->count, r->count ? (uint32_t) (r->totalUs / r->count) : 0,
+      n ? sorted[(99 * (n - 1) + 50) / 100] : 0, r->maxUs, r->maxHeapDelta
+    );
+  }
+  response->print("]");
+  request->send(response);
+}
+
 void notFound(AsyncWebServerRequest *request) {
   request->send(404, "text/plain", "Not found");
 }
 
-void initWebServer() {
+// serve a static asset (web-assets.h) gzipped from flash; the ETag is of the
+// content, so a browser that has it already gets a 304 and no body (and
+// no-cache makes it ask each time, so a firmware update is seen at once)
+void sendAsset(AsyncWebServerRequest *request, const web_asset_t *asset) {
+  if(request->hasHeader("If-None-Match") &&
+    request->getHeader("If-None-Match")->value() == asset->etag) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", asset->etag);
+    request->send(response);
+    return;
+  }
+  AsyncWebServerResponse *response =
+    request->beginResponse_P(200, asset->type, asset->gz, asset->len);
+  response->addHeader("Content-Encoding", "gzip");
+  response->addHeader("ETag", asset->etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+void initWebServer(TimerHandle_t snapshotDue) {
   Serial.print("IP Address: ");
   Serial.println(WiFi.localIP());
 
@@ -126,7 +386,7 @@ void initWebServer() {
     request->send(200, "text/plain", "Hello, world");
   });
   */
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+  serveOn("/", HTTP_GET, [](AsyncWebServerRequest *request) {
     dln(netDBG, "serving page notionally at /");
     String paramStr =  ""; // collects all req parameters
 // naughty: ideally the values should come out of default_conf...
@@ -134,6 +394,7 @@ void initWebServer() {
     String redVal =    "value='127'>\n";
     String greenVal =  "value='127'>\n";
     String blueVal =   "value='127'>\n";
+    int red = -1, green = -1, blue = -1, bright = -1; // (-1: not given)
 
     int numParams = request->params();
     if(numParams > 0) paramStr = "     (current: ";
@@ -153,31 +414,58 @@ void initWebServer() {
       // so that the served version of / includes them
       if(strcmp("bright", p->name().c_str()) == 0) {
         brightVal = "value='" + p->value() + "'>\n";
+        bright = constrain(p->value().toInt(), 0, 100);
       } else if(strcmp("red", p->name().c_str()) == 0) {
         redVal = "value='" + p->value() + "'>\n";
+        red = constrain(p->value().toInt(), 0, 255);
       } else if(strcmp("green", p->name().c_str()) == 0) {
         greenVal = "value='" + p->value() + "'>\n";
+        green = constrain(p->value().toInt(), 0, 255);
       } else if(strcmp("blue", p->name().c_str()) == 0) {
         blueVal = "value='" + p->value() + "'>\n";
+        blue = constrain(p->value().toInt(), 0, 255);
       }
     }
     Serial.printf("GET[%s]\n", paramStr.c_str());
 
+    // apply them: queued for the UI task (which owns the I²C expander the
+    // LEDs and backlight are on), so we reply without waiting on hardware;
+    // the LEDs are on/off, so a colour is lit from half way up its range
+    unPhone::hw_cmd_t cmd;
+    if(red >= 0 || green >= 0 || blue >= 0) {
+      cmd.type = unPhone::HW_RGB;
+      cmd.rgb.red = red >= 128;
+      cmd.rgb.green = green >= 128;
+      cmd.rgb.blue = blue >= 128;
+      unPhone::me().hwCommand(cmd);
+    }
+    if(bright >= 0) {
+      cmd.type = unPhone::HW_BRIGHTNESS;
+      cmd.percent = bright;
+      unPhone::me().hwCommand(cmd);
+    }
+
     replacement_t repls[] = { // the elements to replace in the boilerplate
-      { 34, redVal.c_str() },
-      { 38, greenVal.c_str() },
-      { 42, blueVal.c_str() },
-      { 48, brightVal.c_str() },
-      { 56, paramStr.c_str() },
+      { 26, redVal.c_str() },
+      { 30, greenVal.c_str() },
+      { 34, blueVal.c_str() },
+      { 40, brightVal.c_str() },
+      { 48, paramStr.c_str() },
     };
-    String htmlPage = ""; // a String to hold the resultant page
-    GET_HTML(htmlPage, boiler, repls);
-    request->send(200, "text/html", htmlPage);
+    SEND_HTML(request, boiler, repls); // (chunked, from flash)
   });
 
 
+  // static assets (web/, via web-assets.py)
+  for(int i = 0; i < ALEN(webAssets); i++) {
+    const web_asset_t *asset = &webAssets[i];
+    serveOn(asset->path, HTTP_GET, [asset](AsyncWebServerRequest *request) {
+      sendAsset(request, asset);
+    });
+  }
+
   // Send a GET request to <IP>/get?message=<message>
-  server.on("/get", HTTP_GET, [] (AsyncWebServerRequest *request) {
+  serveOn("/get", HTTP_GET, [] (AsyncWebServerRequest *request) {
     String message;
     if(request->hasParam(PARAM_MESSAGE)) {
       message = request->getParam(PARAM_MESSAGE)->value();
@@ -188,7 +476,7 @@ void initWebServer() {
   });
 
   // Send a POST request to <IP>/post with a form field message set to <message>
-  server.on("/post", HTTP_POST, [](AsyncWebServerRequest *request){
+  serveOn("/post", HTTP_POST, [](AsyncWebServerRequest *request){
     String message;
     if(request->hasParam(PARAM_MESSAGE, true)) {
       message = request->getParam(PARAM_MESSAGE, true)->value();
@@ -198,6 +486,51 @@ void initWebServer() {
     request->send(200, "text/plain", "Hello, POST: " + message);
   });
 
+  // telemetry: GET /api/status, /events (SSE), GET /api/rate[?ms=n]
+  snapshotLock = xSemaphoreCreateMutex();
+  snapshotTimer = snapshotDue;
+  serveOn("/api/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response =
+      request->beginResponseStream("application/json");
+    response->addHeader("Cache-Control", "no-store");
+    xSemaphoreTake(snapshotLock, portMAX_DELAY);
+    response->print(snapshot);
+    xSemaphoreGive(snapshotLock);
+    request->send(response);
+  });
+  serveOn("/api/rate", HTTP_GET, [](AsyncWebServerRequest *request) {
+    char json[64];
+    if(request->hasParam("ms")) { // (toInt: 0 if not a number)
+      long ms = request->getParam("ms")->value().toInt();
+      if(ms < (long) SNAPSHOT_MIN_MS || ms > (long) SNAPSHOT_MAX_MS) {
+        snprintf(json, sizeof(json), "{\"error\":\"ms must be %u to %u\"}",
+          SNAPSHOT_MIN_MS, SNAPSHOT_MAX_MS);
+        request->send(400, "application/json", json);
+        return;
+      }
+      xTimerChangePeriod(snapshotTimer, pdMS_TO_TICKS(ms), 0);
+    }
+    snprintf(json, sizeof(json), "{\"ms\":%u}",
+      pdTICKS_TO_MS(xTimerGetPeriod(snapshotTimer)));
+    request->send(200, "application/json", json);
+  });
+  serveOn("/events", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if(eventClients >= EVENT_CLIENTS_MAX) {
+      request->send(503, "text/plain", "Too many /events clients");
+      return;
+    }
+    std::shared_ptr<event_stream_t> s = std::make_shared<event_stream_t>();
+    AsyncWebServerResponse *response = request->beginChunkedResponse(
+      "text/event-stream", [s](uint8_t *buf, size_t max, size_t) -> size_t {
+        return fillEvents(s.get(), buf, max);
+      }
+    );
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+  });
+  server.on("/api/routes", HTTP_GET, sendRouteStats); // (not itself counted)
+  xTimerStart(snapshotTimer, 0);
+
   server.onNotFound(notFound);
 
   server.begin();
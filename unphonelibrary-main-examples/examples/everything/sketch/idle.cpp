@@ -0,0 +1,127 @@
+// idle.cpp
+// idle governor: dim, park the UI and light sleep when nobody's using us
+
+#include "unphone.h"
+#include "wifi-state.h"
+#include <esp_sleep.h>
+
+static unPhone &u = unPhone::me();
+
+static uint32_t idleTimeoutMs = unPhone::IDLE_TIMEOUT_MS; // 0 = never idle
+static volatile uint32_t lastActivity = 0; // millis of last user activity
+static bool idle = false;                  // are we dimmed and parked?
+
+static const uint32_t BUTTON_POLL_MS = 100;  // how often to read buttons...
+static const uint32_t ACCEL_POLL_MS = 500;   // ...and the accelerometer
+static const float MOTION_THRESHOLD = 1.5;   // m/s^2 change that counts
+static const uint32_t SLEEP_MAX_MS = 500;    // longest single light sleep
+static const uint32_t SLEEP_MIN_MS = 20;     // not worth sleeping for less
+static const uint32_t RELEASE_WAIT_MS = 1000; // max wait for waking touch
+
+void unPhone::idleTimeout(uint32_t ms) { idleTimeoutMs = ms; activity(); }
+uint32_t unPhone::idleTimeout() { return idleTimeoutMs; }
+void unPhone::activity() { lastActivity = millis(); }
+bool unPhone::isIdle() { return idle; }
+
+// poll the buttons and the accelerometer (rate limited: the accelerometer
+// is on I²C, and the buttons needn't be read faster than they're pressed)
+static bool sawActivity() {
+  static uint32_t lastButtonPoll = 0, lastAccelPoll = 0;
+  static float lastX = 0.0, lastY = 0.0, lastZ = 0.0;
+  uint32_t now = millis();
+  bool active = false;
+
+  if(now - lastButtonPoll >= BUTTON_POLL_MS) {
+    lastButtonPoll = now;
+    if(u.button1() || u.button2() || u.button3()) active = true;
+  }
+  if(now - lastAccelPoll >= ACCEL_POLL_MS) {
+    lastAccelPoll = now;
+    sensors_event_t e;
+    u.getAccelEvent(&e);
+    float dx = e.acceleration.x - lastX, dy = e.acceleration.y - lastY,
+      dz = e.acceleration.z - lastZ;
+    if(sqrt(dx * dx + dy * dy + dz * dz) > MOTION_THRESHOLD) active = true;
+    lastX = e.acceleration.x; lastY = e.acceleration.y;
+    lastZ = e.acceleration.z;
+  }
+  return active;
+}
+
+// arm the wakeup sources for light sleep: a timer for the next LMIC job,
+// plus GPIO levels for whatever is wired to the ESP32 directly
+static void armWakeups(uint32_t sleepMs) {
+  esp_sleep_enable_timer_wakeup(sleepMs * 1000ULL);
+  // the buttons are on native GPIOs on both spins...
+  gpio_wakeup_enable((gpio_num_t) unPhone::BUTTON1, GPIO_INTR_LOW_LEVEL);
+  gpio_wakeup_enable((gpio_num_t) unPhone::BUTTON2, GPIO_INTR_LOW_LEVEL);
+  gpio_wakeup_enable((gpio_num_t) unPhone::BUTTON3, GPIO_INTR_LOW_LEVEL);
+#if UNPHONE_SPIN >= 9
+  // ...but the power switch is only on spin 9 (spin 7's is on the TCA9555)
+  gpio_wakeup_enable((gpio_num_t) unPhone::POWER_SWITCH, GPIO_INTR_LOW_LEVEL);
+#endif
+  // the touch controller's PENIRQ and the TCA9555's INT line aren't in the
+  // pin maps above; define these in the build flags where they are routed
+#ifdef UNPHONE_TOUCH_IRQ
+  gpio_wakeup_enable((gpio_num_t) UNPHONE_TOUCH_IRQ, GPIO_INTR_LOW_LEVEL);
+#endif
+#ifdef UNPHONE_EXPANDER_IRQ
+  gpio_wakeup_enable((gpio_num_t) UNPHONE_EXPANDER_IRQ, GPIO_INTR_LOW_LEVEL);
+#endif
+  esp_sleep_enable_gpio_wakeup();
+}
+
+// called each turn of the UI task; returns true when idle, in which case
+// the caller must not run the UI (LMIC carries on in the LoRa task)
+bool unPhone::idleCheck() {
+  if(idleTimeoutMs == 0) return false;
+  bool active = sawActivity();
+  if(!idle) {
+    if(active) activity();
+    if(millis() - lastActivity < idleTimeoutMs) return false;
+    D("idle: dimming and parking the UI\n")
+    backlight(false);
+    idle = true;
+  }
+
+  // woken by user activity? (touch we poll after each timer wakeup)
+  spiLock();
+  bool touched = tsp->touched();
+  spiUnlock();
+  if(active || touched) {
+    D("idle: waking up\n")
+    uint32_t start = millis(); // don't let the waking touch reach the UI
+    do {
+      WAIT_MS(10)
+      spiLock();
+      touched = tsp->touched();
+      spiUnlock();
+    } while(touched && millis() - start < RELEASE_WAIT_MS);
+    idle = false;
+    activity();
+    backlight(true);
+    return false;
+  }
+
+  // sleep until the next LMIC job is due (or the max, for touch polling)
+  spiLock(); // (which also guards LMIC's state)
+  uint32_t sleepMs = lora_idle_ms(SLEEP_MAX_MS);
+  spiUnlock();
+  if(sleepMs < SLEEP_MIN_MS) { // (e.g. 0 while a TX/RX window is open)
+    vTaskDelay(SLEEP_MIN_MS / portTICK_PERIOD_MS); // block, don't spin
+    return true;
+  }
+  wifi_state_t wifi = wifiStatus().state;
+  if(
+    wifi == WIFI_CONNECTED || wifi == WIFI_ASSOCIATING || wifi == WIFI_SCANNING
+  ) {
+    // light sleep would drop the association (or the scan or join under
+    // way); block instead so the IDLE task runs (and modem sleep / auto
+    // light sleep can kick in)
+    WAIT_MS(sleepMs)
+  } else {
+    armWakeups(sleepMs);
+    esp_light_sleep_start();
+  }
+  return true;
+}
@@ -7,7 +7,20 @@
 // and now lives here, now based on based on https://github.com/tzapu/WiFiManager
 
 #include "joinme.h"
+#include "ota-manifest.h"
+#include "ota-patch.h"
 #include <WiFiManager.h>
+#include <Preferences.h>
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#if CONFIG_IDF_TARGET_ESP32S3
+#  include <esp32s3/rom/miniz.h>
+#else
+#  include <esp32/rom/miniz.h>
+#endif
 
 WiFiManager wm; // global wm instance
 WiFiManagerParameter custom_field; // global param (for non blocking w params)
@@ -87,172 +100,430 @@ void saveParamCallback() {
 }
 
 
+// OTA over-the-air update stuff ///////////////////////////////////////////
+// the image is fetched in as many HTTP requests as it takes: after a dropped
+// or stalled connection we carry on from where we'd got to with a Range
+// request. each chunk is hashed as it's written to the inactive partition,
+// and the image is only installed (Update.end) if the hash matches its
+// manifest, and the manifest's signature checks out against otaKey. when
+// the manifest lists a patch from the running version that's fetched
+// instead (see ota-patch.h), falling back to the whole image if it fails
+
+static const uint16_t OTA_TIMEOUT_MS = 20000; // per HTTP request
+static const uint32_t OTA_STALL_MS = 10000;   // no data for this long: resume
+static const uint8_t OTA_RETRIES = 5;         // reconnects without progress
+static const size_t OTA_CHUNK = 4096;         // bytes per read and write
+static const char *otaKey = NULL;             // PEM public key
+static joinme_ota_listener_t otaListener = NULL;
+static joinme_ota_event_t otaLatest =
+  { 0, JOINME_OTA_IDLE, 0, 0, 0, 0, NULL };
+static portMUX_TYPE otaMux = portMUX_INITIALIZER_UNLOCKED;
+static const char *otaPrefsName = "joinme-ota"; // version check cache
+static void joinmeCloudBegin(HTTPClient *, String, String, String);
+
+void joinmeOTAKey(const char *publicKeyPem) { otaKey = publicKeyPem; }
+void joinmeOTAListen(joinme_ota_listener_t l) { otaListener = l; }
+
+joinme_ota_event_t joinmeOTAStatus() {
+  portENTER_CRITICAL(&otaMux);
+  joinme_ota_event_t e = otaLatest;
+  portEXIT_CRITICAL(&otaMux);
+  return e;
+}
 
+// publish an event; download progress only when the percentage changes
+static void otaEvent(
+  joinme_ota_phase_t phase, int version, uint32_t done = 0,
+  uint32_t total = 0, uint8_t resumes = 0, const char *error = NULL
+) {
+  portENTER_CRITICAL(&otaMux);
+  bool same = phase == JOINME_OTA_DOWNLOADING &&
+    otaLatest.phase == phase && otaLatest.resumes == resumes && total > 0 &&
+    (uint64_t) done * 100 / total == (uint64_t) otaLatest.done * 100 / total;
+  if(!same)
+    otaLatest = {
+      otaLatest.seq + 1, phase, version, done, total, resumes, error
+    };
+  joinme_ota_event_t e = otaLatest;
+  portEXIT_CRITICAL(&otaMux);
+
+  if(same) return;
+  if(phase == JOINME_OTA_FAILED)
+    Serial.printf("OTA to version %d failed: %s\n", version, error);
+  if(otaListener != NULL)
+    otaListener(&e);
+}
 
+// is the manifest signed by otaKey?
+static bool otaVerifyManifest(const char *text, const ota_manifest_t *m) {
+  uint8_t hash[32];
+  if(mbedtls_md(
+    mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+    (const uint8_t *) text, m->signedLen, hash
+  ) != 0)
+    return false;
+
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  bool ok = mbedtls_pk_parse_public_key(
+    &pk, (const uint8_t *) otaKey, strlen(otaKey) + 1
+  ) == 0 && mbedtls_pk_verify(
+    &pk, MBEDTLS_MD_SHA256, hash, sizeof(hash), m->sig, m->sigLen
+  ) == 0;
+  mbedtls_pk_free(&pk);
+  return ok;
+}
 
+// where downloaded bytes go; false to give up
+typedef bool (*ota_sink_t)(const uint8_t *, size_t, void *);
 
-/* lua derivative version:
-
-#include "joinme.h"
-#include <WiFiClient.h>
-#include <DNSServer.h>
-#include <Update.h>
-#include <ESPAsyncWebServer.h>
+// download fileName (size bytes) into sink, resuming as needed, and check
+// that it hashes to sha256; NULL, or why not
+static const char *otaFetch(
+  String gitProjID, String gitToken, String fileName, uint32_t size,
+  const uint8_t *sha256, int version, ota_sink_t sink, void *ctx
+) {
+  uint8_t *buf = (uint8_t *) malloc(OTA_CHUNK);
+  if(buf == NULL) return "out of memory";
+  mbedtls_md_context_t sha;
+  mbedtls_md_init(&sha);
+  mbedtls_md_setup(&sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+  mbedtls_md_starts(&sha);
+
+  const char *headers[] = { "Content-Range" };
+  const char *error = NULL;
+  ota_resume_t dl;
+  ota_resume_begin(&dl, size);
+  otaEvent(JOINME_OTA_DOWNLOADING, version, 0, size);
+  while(dl.done < size && error == NULL) {
+    HTTPClient http;
+    http.setTimeout(OTA_TIMEOUT_MS);
+    http.collectHeaders(headers, 1);
+    int respCode =
+      joinmeCloudGet(&http, gitProjID, gitToken, fileName, dl.done);
+
+    if(!ota_resume_response(
+      &dl, respCode, http.header("Content-Range").c_str()
+    )) {
+      Serial.printf(
+        "OTA: unusable response %d at byte %u\n", respCode, dl.done
+      );
+    } else {
+      WiFiClient *stream = http.getStreamPtr();
+      uint32_t lastData = millis();
+      while(dl.done < size) {
+        size_t avail = stream->available();
+        if(avail == 0) {
+          if(!http.connected() || millis() - lastData > OTA_STALL_MS) break;
+          delay(10);
+          continue;
+        }
+        size_t n = stream->readBytes(
+          buf, ota_resume_want(&dl, avail, OTA_CHUNK)
+        );
+        if(n == 0) break;
+        lastData = millis();
+
+        const uint8_t *p = buf;       // discard what we already have...
+        n = ota_resume_take(&dl, &p, n);
+        if(n == 0) continue;
+        mbedtls_md_update(&sha, p, n); // ...and hash and pass on the rest
+        if(!sink(p, n, ctx)) {
+          error = "flash write failed";
+          break;
+        }
+        otaEvent(
+          JOINME_OTA_DOWNLOADING, version, dl.done, size, dl.resumes
+        );
+      }
+    }
+    http.end();
 
-const byte DNS_PORT = 53;
-DNSServer dnsServer;
-IPAddress apIP_;
-void handleOTAProgress(size_t, size_t); // progress tracker
+    if(dl.done < size && error == NULL) { // dropped, stalled or refused
+      int wait = ota_resume_ended(&dl, OTA_RETRIES);
+      if(wait < 0) {
+        error = "download failed";
+        break;
+      }
+      delay(1000 * wait);
+      Serial.printf("OTA: resuming at %u of %u bytes\n", dl.done, size);
+    }
+  }
 
-// 307 is temporary redirect. if we used 301 we'd probably break the user's
-// browser for sites they were captured from until they cleared their cache
-int TEMPORARY_REDIRECT = 307;
+  uint8_t hash[32];
+  mbedtls_md_finish(&sha, hash);
+  mbedtls_md_free(&sha);
+  free(buf);
+  if(error == NULL) {
+    otaEvent(JOINME_OTA_VERIFYING, version, dl.done, size, dl.resumes);
+    if(memcmp(hash, sha256, sizeof(hash)) != 0)
+      error = "download hash mismatch";
+  }
+  return error;
+}
 
-void doRedirect(AsyncWebServerRequest* request) {
-  Serial.printf(
-    "joinme redirecting captured client to: %s\n",
-    apIP_.toString().c_str()
-  );
-  auto response = request->beginResponse(TEMPORARY_REDIRECT,"text/plain","");
-  response->addHeader("Location","http://"+apIP_.toString()+"/");
-  request->send(response);
+// a whole image goes straight into the inactive partition
+static bool otaFlashSink(const uint8_t *p, size_t n, void *ctx) {
+  return Update.write((uint8_t *) p, n) == n;
 }
 
-void handleL0(AsyncWebServerRequest* request) {
-  doRedirect(request);
+// a patch is inflated and applied as it arrives: new image bytes come from
+// it and the running partition, and go into the inactive one. RAM use is
+// fixed: the inflate state and its 32 KB window, plus OtaPatch's buffer
+typedef struct {
+  tinfl_decompressor inflator;
+  uint8_t window[TINFL_LZ_DICT_SIZE]; // (inflate's output goes here too)
+  size_t windowPos;
+  bool inflated;                      // end of the zlib stream seen
+  const esp_partition_t *running;
+  mbedtls_md_context_t imageSha;      // of the image being built
+  OtaPatch *patch;
+} ota_patching_t;
+
+static bool otaReadRunning(uint32_t offset, uint8_t *p, size_t n, void *ctx) {
+  ota_patching_t *z = (ota_patching_t *) ctx;
+  return esp_partition_read(z->running, offset, p, n) == ESP_OK;
 }
-void handleL2(AsyncWebServerRequest* request) {
-  doRedirect(request);
+static bool otaWritePatched(const uint8_t *p, size_t n, void *ctx) {
+  mbedtls_md_update(&((ota_patching_t *) ctx)->imageSha, p, n);
+  return Update.write((uint8_t *) p, n) == n;
 }
-void handleALL(AsyncWebServerRequest* request) {
-  doRedirect(request);
+static bool otaPatchSink(const uint8_t *p, size_t n, void *ctx) {
+  ota_patching_t *z = (ota_patching_t *) ctx;
+  while(!z->inflated) {
+    size_t in = n, out = TINFL_LZ_DICT_SIZE - z->windowPos;
+    tinfl_status status = tinfl_decompress(
+      &z->inflator, p, &in, z->window, z->window + z->windowPos, &out,
+      TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT
+    );
+    p += in; n -= in;
+    if(out > 0 && !z->patch->feed(z->window + z->windowPos, out))
+      return false;
+    z->windowPos = (z->windowPos + out) & (TINFL_LZ_DICT_SIZE - 1);
+    if(status == TINFL_STATUS_DONE)
+      z->inflated = true;
+    else if(status < 0)
+      return false;
+    else if(status == TINFL_STATUS_NEEDS_MORE_INPUT && n == 0)
+      return true;
+  }
+  return n == 0; // (nothing should follow the zlib stream)
 }
 
-void joinmeDNSSetup(void* server_p, IPAddress apIP) {
-  AsyncWebServer* server = (AsyncWebServer *) server_p;
-  assert(server != NULL);
-  apIP_ = apIP;
-  Serial.printf(
-    "joinme will direct captured clients to: %s\n",
-    apIP_.toString().c_str()
+// build the new image from a patch against the running one; NULL, or why
+// not
+static const char *otaPatch(
+  String gitProjID, String gitToken, String fileName,
+  const ota_manifest_t *m, const ota_patch_ref_t *ref
+) {
+  ota_patching_t *z = (ota_patching_t *) malloc(sizeof(ota_patching_t));
+  if(z == NULL) return "out of memory";
+  tinfl_init(&z->inflator);
+  z->windowPos = 0;
+  z->inflated = false;
+  z->running = esp_ota_get_running_partition();
+  mbedtls_md_init(&z->imageSha);
+  mbedtls_md_setup(
+    &z->imageSha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0
   );
-  dnsServer.setErrorReplyCode(DNSReplyCode::NoError);
-  dnsServer.start(DNS_PORT, "*", apIP_);
-  Serial.println("joinme captive dns server started");
-  server->on("/generate_204", doRedirect); // android captive portal
-  server->on("/L0", handleL0);
-  server->on("/L2", handleL2);
-  server->on("/ALL", handleALL);
-  Serial.println("joinme http handlers added");
+  mbedtls_md_starts(&z->imageSha);
+  OtaPatch patch(otaReadRunning, otaWritePatched, z, z->running->size);
+  z->patch = &patch;
+
+  const char *error = otaFetch(
+    gitProjID, gitToken, fileName, ref->size, ref->sha256, m->version,
+    otaPatchSink, z
+  );
+  uint8_t hash[32];
+  mbedtls_md_finish(&z->imageSha, hash);
+  mbedtls_md_free(&z->imageSha);
+  if(patch.error() != NULL)
+    error = patch.error();
+  else if(error == NULL && (!z->inflated || !patch.done()))
+    error = "patch incomplete";
+  else if(error == NULL && (
+    patch.written() != m->size || memcmp(hash, m->sha256, sizeof(hash)) != 0
+  ))
+    error = "patched image hash mismatch";
+  free(z);
+  return error;
 }
 
-void joinmeTurn() {
-  dnsServer.processNextRequest();
+// where the firmware files are: if the repo is public set gitToken to ""
+// (otherwise the API must be used and a valid personal access token
+// supplied)
+static String otaRepoPath(String gitToken, String relPath) {
+  if(gitToken.length() == 0) {  // use raw
+    relPath.replace("%2F", "/");
+    return relPath;
+  }
+  return "/repository/files/" + relPath; // use API
 }
 
-// OTA over-the-air update stuff ///////////////////////////////////////////
-// if the repo is public set gitToken to "" (otherwise the API must be used
-// and a valid personal access token supplied)
-void joinmeOTAUpdate(
+// the latest version available, or -1 if we can't tell. the version file
+// is fetched with a conditional GET: its ETag / Last-Modified and version
+// are kept in NVS, so while it's unchanged a check costs a bodiless 304,
+// even after a reboot
+int joinmeOTACheck(
   int firmwareVersion, String gitProjID, String gitToken, String relPath
 ) {
-  // materials for doing an HTTP GET on github from the firmware/ dir
-  HTTPClient http;              // manage the HTTP request process
-  http.setTimeout(20000);       // increase the timeout of a request
-  http.setReuse(true);          // keep alive
-  int respCode;    // the response code from the request (e.g. 404, 200, ...)
-  int highestAvailableVersion = -1;  // version of latest firmware on server
-  String repoPath;
-  if(gitToken.length() == 0) {  // use raw
-    relPath.replace("%2F", "/");
-    repoPath = relPath;
-  } else {                      // use API
-    repoPath = "/repository/files/" + relPath;
+  String fileName = otaRepoPath(gitToken, relPath) + "version";
+  String cacheKey = gitProjID + fileName;
+  otaEvent(JOINME_OTA_CHECKING, firmwareVersion);
+
+  Preferences prefs;
+  prefs.begin(otaPrefsName, true);
+  bool cached = prefs.getString("url", "") == cacheKey;
+  String etag = prefs.getString("etag", "");
+  String modified = prefs.getString("modified", "");
+  int cachedVersion = prefs.getUInt("latest", 0);
+  prefs.end();
+
+  HTTPClient http;
+  http.setTimeout(OTA_TIMEOUT_MS);
+  const char *headers[] = { "ETag", "Last-Modified" };
+  http.collectHeaders(headers, 2);
+  joinmeCloudBegin(&http, gitProjID, gitToken, fileName);
+  if(cached && etag.length() > 0)
+    http.addHeader("If-None-Match", etag);
+  if(cached && modified.length() > 0)
+    http.addHeader("If-Modified-Since", modified);
+  int respCode = http.GET();
+
+  int latest = -1;
+  if(respCode == 304 && cached) {
+    latest = cachedVersion;
+  } else if(respCode == 200) {
+    latest = atoi(http.getString().c_str());
+    if(
+      !cached || latest != cachedVersion || http.header("ETag") != etag ||
+      http.header("Last-Modified") != modified
+    ) {                         // (spare the flash if nothing's changed)
+      prefs.begin(otaPrefsName, false);
+      prefs.putString("url", cacheKey);
+      prefs.putString("etag", http.header("ETag"));
+      prefs.putString("modified", http.header("Last-Modified"));
+      prefs.putUInt("latest", latest);
+      prefs.end();
+    }
   }
+  http.end();
 
-  // do a GET to read the version file from the cloud
-  Serial.println("checking for firmware updates...");
-  respCode = joinmeCloudGet(&http, gitProjID, gitToken, repoPath + "version");
-  if(respCode == 200) // check response code (-ve on failure)
-    highestAvailableVersion = atoi(http.getString().c_str());
-  else
+  if(latest <= 0) {
     Serial.printf("couldn't get version! rtn code: %d\n", respCode);
-  http.end(); // free resources
+    otaEvent(JOINME_OTA_FAILED, firmwareVersion, 0, 0, 0, "no version file");
+    return -1;
+  }
+  otaEvent(
+    latest > firmwareVersion ? JOINME_OTA_AVAILABLE : JOINME_OTA_UP_TO_DATE,
+    latest
+  );
+  return latest;
+}
 
-  // do we know the latest version, and does the firmware need updating?
-  if(respCode != 200) {
-    Serial.printf("cannot update\n\n");
-    return;
-  } else if(firmwareVersion >= highestAvailableVersion) {
-    Serial.printf("firmware is up to date\n\n");
+// install the latest version if it's newer than ours (and then restart)
+void joinmeOTAUpdate(
+  int firmwareVersion, String gitProjID, String gitToken, String relPath
+) {
+  if(otaKey == NULL) {
+    otaEvent(JOINME_OTA_FAILED, firmwareVersion, 0, 0, 0, "no signing key");
     return;
   }
+  int highestAvailableVersion =
+    joinmeOTACheck(firmwareVersion, gitProjID, gitToken, relPath);
+  if(highestAvailableVersion <= firmwareVersion) // (or -1: failed)
+    return;
 
-  // ok, we need to do a firmware update...
-  Serial.printf(
-    "upgrading firmware from version %d to version %d\n",
-    firmwareVersion, highestAvailableVersion
+  // get the new version's manifest, and check that it's genuine
+  String repoPath = otaRepoPath(gitToken, relPath);
+  String version = String(highestAvailableVersion);
+  HTTPClient http;              // manage the HTTP request process
+  http.setTimeout(OTA_TIMEOUT_MS);
+  int respCode = joinmeCloudGet(
+    &http, gitProjID, gitToken, repoPath + version + ".manifest"
   );
-
-  // do a GET for the .bin
-  String binName = String(highestAvailableVersion);
-  binName += ".bin";
-  respCode = joinmeCloudGet(&http, gitProjID, gitToken, repoPath + binName);
-  int updateLength = http.getSize(); // if isn't big enough refuse to update
-  if(respCode == 200) {              // check response code (-ve on failure)
-    Serial.printf(".bin code/size: %d; %d\n\n", respCode, updateLength);
-    if(updateLength < 174992) {      // the size of the Blink example sketch
-      Serial.println("update size is too small! refusing to try OTA update");
-      return;
-    }
-  } else {
-    Serial.printf("failed to get a .bin! return code is: %d\n", respCode);
-    http.end(); // free resources
+  String text;
+  if(respCode == 200 && http.getSize() <= OTA_MANIFEST_MAX)
+    text = http.getString();
+  http.end();
+  ota_manifest_t manifest;
+  const char *error = NULL;
+  if(respCode != 200)
+    error = "no manifest";
+  else if(
+    !ota_manifest_parse(text.c_str(), text.length(), &manifest) ||
+    manifest.version != highestAvailableVersion
+  )
+    error = "bad manifest";
+  else if(!otaVerifyManifest(text.c_str(), &manifest))
+    error = "manifest signature invalid";
+  if(error != NULL) {
+    otaEvent(JOINME_OTA_FAILED, highestAvailableVersion, 0, 0, 0, error);
     return;
   }
 
-  // write the new version of the firmware to flash
-  WiFiClient* stream = http.getStreamPtr();
-  Update.onProgress(handleOTAProgress); // print out progress
-  if(Update.begin(updateLength)) {
-    Serial.printf("starting OTA, may take a minute or two...\n");
-    size_t written; // how much has been written
-    written = Update.writeStream(*stream);
-    stream->flush();
-    Serial.printf("update written\n");
-
-    // if the written amount is the same length as or longer than the
-    // original content length, then it should have been written to the
-    // device successfully
-    if (written >= updateLength) {
-      Serial.println("written " + String(written) + " successfully");
-    } else {
-      Serial.println(
-        "oops, written only " + String(written) + "/" + String(updateLength)
-      );
-    }
-
-    // if the end function returns a successful boolean then the OTA has been
-    // completed, otherwise output the error
-    if(Update.end()) {
-      Serial.printf("update done, now finishing...\n");
-      if(Update.isFinished()) {
-        Serial.printf("update successfully finished; rebooting...\n\n");
-        ESP.restart();
-      } else {
-        Serial.printf("update didn't finish correctly :(\n");
-      }
-    } else {
-      Serial.printf("an update error occurred, #: %d\n" + Update.getError());
+  // ok, we need to do a firmware update: from a patch, if there's one
+  // against this version, or else the whole image
+  Serial.printf(
+    "upgrading firmware from version %d to version %d (%u bytes)\n",
+    firmwareVersion, highestAvailableVersion, manifest.size
+  );
+  const ota_patch_ref_t *patch = ota_manifest_patch(&manifest, firmwareVersion);
+  bool patched = false;
+  if(!Update.begin(manifest.size))
+    error = "no room for the image";
+  if(error == NULL && patch != NULL) {
+    Serial.printf("OTA: using a %u byte patch\n", patch->size);
+    error = otaPatch(
+      gitProjID, gitToken,
+      repoPath + version + "-" + String(firmwareVersion) + ".patch",
+      &manifest, patch
+    );
+    patched = error == NULL;
+    if(!patched) {
+      Serial.printf("OTA: patch failed (%s); getting the whole image\n", error);
+      Update.abort();
+      error = Update.begin(manifest.size) ? NULL : "no room for the image";
     }
-  } else {
-    Serial.printf("not enough space to start OTA update :(\n");
   }
-  http.end(); // free resources
+  if(error == NULL && !patched)
+    error = otaFetch(
+      gitProjID, gitToken, repoPath + version + ".bin", manifest.size,
+      manifest.sha256, highestAvailableVersion, otaFlashSink, NULL
+    );
+  if(error == NULL && !Update.end())
+    error = Update.errorString();
+  if(error != NULL) {
+    Update.abort();
+    otaEvent(JOINME_OTA_FAILED, highestAvailableVersion, 0, 0, 0, error);
+    return;
+  }
+  otaEvent(
+    JOINME_OTA_RESTARTING, highestAvailableVersion, manifest.size,
+    manifest.size
+  );
+  Serial.printf("update successfully finished; rebooting...\n\n");
+  delay(1000); // (give listeners a moment to show it)
+  ESP.restart();
 }
 
-// helper for downloading from cloud firmware server via HTTP GET
+// helper for downloading from cloud firmware server via HTTP GET (of
+// rangeFrom onwards, if non-zero)
 int joinmeCloudGet(
+  HTTPClient *http, String gitProjID, String gitToken, String fileName,
+  uint32_t rangeFrom
+) {
+  joinmeCloudBegin(http, gitProjID, gitToken, fileName);
+  if(rangeFrom > 0)
+    http->addHeader("Range", "bytes=" + String(rangeFrom) + "-");
+  return http->GET();
+}
+
+// start a request for a file from the cloud firmware server; if gitProjID
+// is an http:// URL, files come from there instead (e.g. a local
+// ota-tool.py serve) -- the manifest signature protects the image either
+// way
+static void joinmeCloudBegin(
   HTTPClient *http, String gitProjID, String gitToken, String fileName
 ) {
   // build up URL from components; for example:
@@ -290,7 +561,10 @@ int joinmeCloudGet(
   // set up URL for download via either "raw" or the API with access tok
   String baseUrl = "https://gitlab.com";
   String url;
-  if(gitToken == NULL || gitToken.length() == 0) { // use raw URL ////
+  bool local = gitProjID.startsWith("http://");
+  if(local) {                                      // own server /////
+    url = gitProjID + fileName;
+  } else if(gitToken == NULL || gitToken.length() == 0) { // raw URL /
     baseUrl += "/hamishcunningham/unphone/raw/master/";
     url = baseUrl + fileName;
   } else {                                         // use API ////////
@@ -299,32 +573,75 @@ int joinmeCloudGet(
       "/raw?private_token=" + gitToken + "&ref=master";
   }
 
-  // make GET request and return the response code
-  Serial.printf("joinmeCloudGet, url = %s\n", url.c_str());
-  http->begin(url, gitlabRootCA);
+  // set up the request (the caller adds any more headers and does the GET)
+  Serial.printf("joinmeCloudBegin, url = %s\n", url.c_str());
+  if(local)
+    http->begin(url);
+  else
+    http->begin(url, gitlabRootCA);
   http->addHeader("User-Agent", "ESP32");
-  return http->GET();
 }
 
-// callback handler for tracking OTA progress
-void handleOTAProgress(size_t done, size_t total) {
-  float progress = (float) done / (float) total;
-  // dbf(otaDBG, "OTA written %d of %d, progress = %f\n", done, total, progress);
-
-  int barWidth = 70;
-  Serial.printf("[");
-  int pos = barWidth * progress;
-  for(int i = 0; i < barWidth; ++i) {
-    if(i < pos)
-      Serial.printf("=");
-    else if(i == pos)
-      Serial.printf(">");
-    else
-      Serial.printf(" ");
-  }
+
+
+
+
+
+/* lua derivative version:
+
+#include "joinme.h"
+#include <WiFiClient.h>
+#include <DNSServer.h>
+#include <Update.h>
+#include <ESPAsyncWebServer.h>
+
+const byte DNS_PORT = 53;
+DNSServer dnsServer;
+IPAddress apIP_;
+
+// 307 is temporary redirect. if we used 301 we'd probably break the user's
+// browser for sites they were captured from until they cleared their cache
+int TEMPORARY_REDIRECT = 307;
+
+void doRedirect(AsyncWebServerRequest* request) {
   Serial.printf(
-    "] %d %%%c", int(progress * 100.0), (progress == 1.0) ? '\n' : '\r'
+    "joinme redirecting captured client to: %s\n",
+    apIP_.toString().c_str()
   );
-  Serial.flush();
+  auto response = request->beginResponse(TEMPORARY_REDIRECT,"text/plain","");
+  response->addHeader("Location","http://"+apIP_.toString()+"/");
+  request->send(response);
+}
+
+void handleL0(AsyncWebServerRequest* request) {
+  doRedirect(request);
+}
+void handleL2(AsyncWebServerRequest* request) {
+  doRedirect(request);
+}
+void handleALL(AsyncWebServerRequest* request) {
+  doRedirect(request);
+}
+
+void joinmeDNSSetup(void* server_p, IPAddress apIP) {
+  AsyncWebServer* server = (AsyncWebServer *) server_p;
+  assert(server != NULL);
+  apIP_ = apIP;
+  Serial.printf(
+    "joinme will direct captured clients to: %s\n",
+    apIP_.toString().c_str()
+  );
+  dnsServer.setErrorReplyCode(DNSReplyCode::NoError);
+  dnsServer.start(DNS_PORT, "*", apIP_);
+  Serial.println("joinme captive dns server started");
+  server->on("/generate_204", doRedirect); // android captive portal
+  server->on("/L0", handleL0);
+  server->on("/L2", handleL2);
+  server->on("/ALL", handleALL);
+  Serial.println("joinme http handlers added");
+}
+
+void joinmeTurn() {
+  dnsServer.processNextRequest();
 }
 */
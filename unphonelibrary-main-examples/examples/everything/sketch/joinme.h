@@ -19,7 +19,40 @@ void joinmeTurn(); // run once per main loop iteration
 // server *must* live until after you last call joinmeTurn
 
 // OTA stuff ////////////////////////////////////////////////////////////////
-void joinmeOTAUpdate(int, String, String, String);         // main OTA logic
-int  joinmeCloudGet(HTTPClient *, String, String, String); // download 'ware
+// images are only installed if their manifest is signed by the key given to
+// joinmeOTAKey (see ota-manifest.h and ota-tool.py); progress is published
+// as events, to a listener and as the latest status (for the UI to poll)
+typedef enum {
+  JOINME_OTA_IDLE,          // no check yet
+  JOINME_OTA_CHECKING,      // reading the version file and manifest
+  JOINME_OTA_UP_TO_DATE,
+  JOINME_OTA_AVAILABLE,     // version is newer than ours
+  JOINME_OTA_DOWNLOADING,   // done of total bytes written
+  JOINME_OTA_VERIFYING,     // checking the image hash
+  JOINME_OTA_RESTARTING,    // installed; about to reboot
+  JOINME_OTA_FAILED,        // see error
+} joinme_ota_phase_t;
+typedef struct {
+  uint32_t seq;             // increments with each event
+  joinme_ota_phase_t phase;
+  int version;              // the version being installed (or latest seen)
+  uint32_t done, total;     // bytes
+  uint8_t resumes;          // downloads carried on after a dropped connection
+  const char *error;        // (static string) when FAILED
+} joinme_ota_event_t;
+typedef void (*joinme_ota_listener_t)(const joinme_ota_event_t *);
+
+// otaTask's (sketch.ino) notification bits: why it was woken
+#define JOINME_OTA_WAKE_ONLINE  0x01      // WiFi connected: check now
+#define JOINME_OTA_WAKE_INSTALL 0x02      // install what's available
+
+void joinmeOTAKey(const char *publicKeyPem);              // manifest signer
+void joinmeOTAListen(joinme_ota_listener_t);              // (one listener)
+joinme_ota_event_t joinmeOTAStatus();                     // latest event
+int  joinmeOTACheck(int, String, String, String);         // latest version
+void joinmeOTAUpdate(int, String, String, String);        // main OTA logic
+int  joinmeCloudGet(                                      // download 'ware
+  HTTPClient *, String, String, String, uint32_t rangeFrom = 0
+);
 
 #endif
@@ -0,0 +1,188 @@
+// lora-batch.h
+// packs many small sensor readings into one uplink frame. each reading is
+// a channel (0 to LORA_BATCH_CHANNELS - 1) and an integer value (scale it
+// first, e.g. millivolts or tenths of a degree); within a frame values are
+// sent as the zigzag varint delta from the previous value on that channel,
+// and times as varint seconds since the previous reading, so slowly changing
+// readings take 3 bytes or fewer. frame layout:
+//
+//   version (1 byte) | age of the first reading at flush, varint seconds |
+//   { channel (1 byte) | value delta, zigzag varint | dt, varint secs }*
+//
+// no hardware dependencies and no locking (callers serialise access);
+// LoraBatchReader decodes a frame, e.g. on the host
+
+#ifndef LORA_BATCH_H
+#define LORA_BATCH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef LORA_BATCH_MAX
+#  define LORA_BATCH_MAX       51 // frame bytes: fits SF12 in EU868
+#endif
+#ifndef LORA_BATCH_CHANNELS
+#  define LORA_BATCH_CHANNELS  32 // channels 0 to 31
+#endif
+
+static const uint8_t LORA_BATCH_VERSION = 1;
+
+// varint and zigzag coding (as in protocol buffers); deltas are taken
+// modulo 2^32, so any two int32 values are a delta apart without overflow
+static inline uint8_t batchPutVarint(uint8_t *p, uint32_t v) {
+  uint8_t n = 0;
+  while(v >= 0x80) { p[n++] = (v & 0x7F) | 0x80; v >>= 7; }
+  p[n++] = v;
+  return n;
+}
+static inline uint8_t batchGetVarint( // bytes used, 0 if truncated
+  const uint8_t *p, uint8_t avail, uint32_t *v
+) {
+  *v = 0;
+  for(uint8_t n = 0; n < avail && n < 5; n++) {
+    *v |= (uint32_t) (p[n] & 0x7F) << (7 * n);
+    if(!(p[n] & 0x80)) return n + 1;
+  }
+  return 0;
+}
+static inline uint32_t batchZigzag(int32_t v) {
+  return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+static inline int32_t batchUnzigzag(uint32_t v) {
+  return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+class LoraBatch {
+  static const uint8_t MAX_HEADER = 1 + 5;     // version, age
+  static const uint8_t MAX_READING = 1 + 5 + 5; // channel, delta, dt
+
+  uint8_t readings[LORA_BATCH_MAX];  // encoded readings (after the header)
+  uint8_t len = 0;
+  uint8_t count = 0;
+  int32_t last[LORA_BATCH_CHANNELS]; // previous value per channel
+  uint32_t firstMs = 0, lastMs = 0;  // times of first and latest readings
+  uint32_t maxAgeMs;
+  bool urgent = false;
+
+public:
+  // flush once the first reading is maxAge ms old (0 = only when full)
+  LoraBatch(uint32_t maxAge) : maxAgeMs(maxAge) { reset(); }
+
+  void reset() {
+    len = count = 0;
+    urgent = false;
+    memset(last, 0, sizeof(last));
+  }
+  uint8_t size() const { return count; }   // readings waiting
+  bool empty() const { return count == 0; }
+
+  // would the next reading risk not fitting? (so flush first)
+  bool full() const {
+    return MAX_HEADER + len + MAX_READING > LORA_BATCH_MAX;
+  }
+
+  // add a reading taken at nowMs; priority readings make the batch due at
+  // once. false if the channel is out of range or the batch is full
+  bool add(uint8_t channel, int32_t value, uint32_t nowMs, bool priority) {
+    if(channel >= LORA_BATCH_CHANNELS || full()) return false;
+    if(count == 0) firstMs = lastMs = nowMs;
+    uint8_t *p = readings + len;
+    p[0] = channel;
+    uint8_t n = 1;
+    int32_t delta = (int32_t) ((uint32_t) value - (uint32_t) last[channel]);
+    n += batchPutVarint(p + n, batchZigzag(delta));
+    n += batchPutVarint(p + n, (nowMs - lastMs) / 1000);
+    len += n;
+    count++;
+    last[channel] = value;
+    lastMs = nowMs - (nowMs - lastMs) % 1000; // (don't accumulate rounding)
+    if(priority) urgent = true;
+    return true;
+  }
+
+  // should the batch be sent now? (full, too old or urgent)
+  bool due(uint32_t nowMs) const {
+    if(count == 0) return false;
+    return urgent || full() || (maxAgeMs > 0 && nowMs - firstMs >= maxAgeMs);
+  }
+
+  // ms from nowMs until the batch is due (0: now, UINT32_MAX: never, i.e.
+  // empty, or no maximum age), so a sleeping caller knows when to flush
+  uint32_t dueIn(uint32_t nowMs) const {
+    if(due(nowMs)) return 0;
+    if(count == 0 || maxAgeMs == 0) return UINT32_MAX;
+    return maxAgeMs - (nowMs - firstMs);
+  }
+
+  // write the frame into out (LORA_BATCH_MAX bytes) and start a new batch;
+  // returns the frame length (0 if empty)
+  uint8_t flush(uint8_t *out, uint32_t nowMs) {
+    if(count == 0) return 0;
+    uint8_t n = 0;
+    out[n++] = LORA_BATCH_VERSION;
+    n += batchPutVarint(out + n, (nowMs - firstMs) / 1000);
+    memcpy(out + n, readings, len);
+    n += len;
+    reset();
+    return n;
+  }
+};
+
+// one decoded reading; secsAgo is relative to when the frame was flushed
+typedef struct {
+  uint8_t channel;
+  int32_t value;
+  int32_t secsAgo;
+} lora_reading_t;
+
+class LoraBatchReader {
+  const uint8_t *buf;
+  uint8_t len;
+  uint8_t pos = 0;
+  bool bad = false;
+  int32_t last[LORA_BATCH_CHANNELS];
+  int32_t secsAgo = 0;
+  bool first = true;
+
+public:
+  LoraBatchReader(const uint8_t *data, uint8_t length)
+    : buf(data), len(length) {
+    memset(last, 0, sizeof(last));
+    uint32_t age;
+    uint8_t n;
+    if(len < 2 || buf[0] != LORA_BATCH_VERSION ||
+      (n = batchGetVarint(buf + 1, len - 1, &age)) == 0) {
+      bad = true;
+      return;
+    }
+    secsAgo = age;
+    pos = 1 + n;
+  }
+
+  // decode the next reading; false at the end or if malformed()
+  bool next(lora_reading_t *r) {
+    if(bad || pos >= len) return false;
+    uint8_t channel = buf[pos];
+    uint32_t delta, dt;
+    uint8_t n1, n2;
+    if(channel >= LORA_BATCH_CHANNELS ||
+      (n1 = batchGetVarint(buf + pos + 1, len - pos - 1, &delta)) == 0 ||
+      (n2 = batchGetVarint(buf + pos + 1 + n1, len - pos - 1 - n1, &dt)) == 0
+    ) {
+      bad = true;
+      return false;
+    }
+    pos += 1 + n1 + n2;
+    if(!first) secsAgo -= dt; // (the first reading's dt is always 0)
+    first = false;
+    last[channel] = (int32_t)
+      ((uint32_t) last[channel] + (uint32_t) batchUnzigzag(delta));
+    r->channel = channel;
+    r->value = last[channel];
+    r->secsAgo = secsAgo;
+    return true;
+  }
+  bool malformed() const { return bad; }
+};
+
+#endif
@@ -0,0 +1,181 @@
+// lora-delivery.h
+// per-message delivery tracking for LoRaWAN uplinks: which message LMIC is
+// sending, what became of it, retries (with exponential backoff) for
+// confirmed messages the network didn't acknowledge, and latency / success
+// statistics. LMIC sends one message at a time, so there's at most one in
+// flight. no LMIC or hardware dependencies and no locking (callers
+// serialise access), so it can be driven by a simulated lossy gateway.
+//
+// a confirmed message goes up to 1 + MAX_RETRIES (4) times, and LMIC makes
+// LORA_LMIC_CONF_TRIES (2) attempts at each (lora-work.cpp cuts LMIC's own
+// TXCONF_ATTEMPTS, 8), so 8 transmissions at worst, not 32: at SF12 and 51
+// bytes (the most SF12 takes, 2.8 s on air) that's 22 s of airtime, which
+// the 1% duty cycle spreads over at least 37 minutes
+
+#ifndef LORA_DELIVERY_H
+#define LORA_DELIVERY_H
+
+#include <stdint.h>
+#include <string.h>
+#include "lora-queue.h"
+
+#ifndef LORA_LMIC_CONF_TRIES
+#  define LORA_LMIC_CONF_TRIES 2 // LMIC's attempts per send of a confirmed msg
+#endif
+
+typedef enum {
+  LORA_QUEUED,      // waiting (in the queue, or for a retry)
+  LORA_SENT,        // transmitted (final for unconfirmed messages)
+  LORA_ACKED,       // confirmed and acknowledged by the network
+  LORA_FAILED,      // refused by LMIC, or never acknowledged
+} lora_delivery_state_t;
+
+typedef struct {
+  uint32_t sent;    // unconfirmed messages transmitted
+  uint32_t acked;   // confirmed messages acknowledged
+  uint32_t failed;  // messages given up on
+  uint32_t retries; // confirmed messages re-sent
+  float successRate; // acked / (acked + failed) for confirmed (-1: none yet)
+  uint32_t p50Ms, p90Ms, p99Ms; // latency from enqueue to outcome
+  uint8_t samples;  // latencies the percentiles are taken over
+} lora_delivery_stats_t;
+
+class LoraDelivery {
+  static const uint8_t MAX_RETRIES = 3;       // (on top of LMIC's own)
+  static const uint32_t BACKOFF_MS = 30000;   // first retry wait, doubling
+  static const uint8_t RETRY_SLOTS = 4;       // retries waiting at once
+  static const uint8_t LATENCIES = 32;        // recent latencies kept
+
+  typedef struct {
+    lora_msg_t msg;
+    uint8_t attempts;                         // retries so far
+    uint32_t dueMs;
+    bool used;
+  } retry_t;
+  retry_t retries[RETRY_SLOTS];
+  lora_msg_t flying;                          // the message LMIC has
+  uint8_t flyingAttempts = 0;
+  bool inFlight = false;
+  uint32_t latency[LATENCIES];
+  uint8_t latNext = 0, latCount = 0;
+  lora_delivery_stats_t counts = { 0, 0, 0, 0, -1, 0, 0, 0, 0 };
+
+  void recordLatency(uint32_t ms) {
+    latency[latNext] = ms;
+    latNext = (latNext + 1) % LATENCIES;
+    if(latCount < LATENCIES) latCount++;
+  }
+
+public:
+  LoraDelivery() { memset(retries, 0, sizeof(retries)); }
+
+  // m was accepted by LMIC; attempts is 0, or the retry count from
+  // takeRetry()
+  void sent(const lora_msg_t &m, uint8_t attempts) {
+    flying = m;
+    flyingAttempts = attempts;
+    inFlight = true;
+  }
+
+  // LMIC refused a message outright (e.g. too long for the data rate)
+  lora_delivery_state_t refused() {
+    counts.failed++;
+    return LORA_FAILED;
+  }
+
+  // the TX finished: acked is LMIC's TXRX_ACK; cancelled if LMIC dropped it
+  // (which may be retried even if unconfirmed). id gets the message's id
+  lora_delivery_state_t completed(
+    bool acked, bool cancelled, uint32_t nowMs, uint32_t *id
+  ) {
+    if(!inFlight) return LORA_FAILED;
+    inFlight = false;
+    *id = flying.id;
+    uint32_t took = nowMs - flying.enqueuedMs;
+    if(!cancelled && !flying.confirmed) {
+      counts.sent++;
+      recordLatency(took);
+      return LORA_SENT;
+    }
+    if(!cancelled && acked) {
+      counts.acked++;
+      recordLatency(took);
+      return LORA_ACKED;
+    }
+
+    // not acknowledged (or cancelled): try again later, if we may
+    if(flyingAttempts < MAX_RETRIES) {
+      for(uint8_t i = 0; i < RETRY_SLOTS; i++) {
+        if(retries[i].used) continue;
+        retries[i].msg = flying;
+        retries[i].attempts = flyingAttempts + 1;
+        retries[i].dueMs = nowMs + (BACKOFF_MS << flyingAttempts);
+        retries[i].used = true;
+        counts.retries++;
+        return LORA_QUEUED;
+      }
+    }
+    counts.failed++;
+    return LORA_FAILED;
+  }
+
+  // retries due by nowMs
+  uint8_t retriesDue(uint32_t nowMs) const {
+    uint8_t n = 0;
+    for(uint8_t i = 0; i < RETRY_SLOTS; i++)
+      if(retries[i].used && (int32_t) (nowMs - retries[i].dueMs) >= 0) n++;
+    return n;
+  }
+
+  // ms until the next retry is due (0 if one is due, UINT32_MAX if none)
+  uint32_t nextRetryIn(uint32_t nowMs) const {
+    uint32_t next = UINT32_MAX;
+    for(uint8_t i = 0; i < RETRY_SLOTS; i++) {
+      if(!retries[i].used) continue;
+      int32_t wait = (int32_t) (retries[i].dueMs - nowMs);
+      if(wait <= 0) return 0;
+      if((uint32_t) wait < next) next = wait;
+    }
+    return next;
+  }
+
+  // take a due retry (the highest priority one), false if none is due
+  bool takeRetry(uint32_t nowMs, lora_msg_t *m, uint8_t *attempts) {
+    int8_t best = -1;
+    for(uint8_t i = 0; i < RETRY_SLOTS; i++) {
+      if(!retries[i].used || (int32_t) (nowMs - retries[i].dueMs) < 0)
+        continue;
+      if(best == -1 || retries[i].msg.priority > retries[best].msg.priority)
+        best = i;
+    }
+    if(best == -1) return false;
+    *m = retries[best].msg;
+    *attempts = retries[best].attempts;
+    retries[best].used = false;
+    return true;
+  }
+
+  // counters, success rate and latency percentiles
+  lora_delivery_stats_t stats() const {
+    lora_delivery_stats_t s = counts;
+    uint32_t confirmed = s.acked + s.failed;
+    s.successRate = confirmed == 0 ? -1 : (float) s.acked / confirmed;
+    s.samples = latCount;
+    if(latCount == 0) return s;
+
+    uint32_t sorted[LATENCIES];
+    memcpy(sorted, latency, latCount * sizeof(uint32_t));
+    for(uint8_t i = 1; i < latCount; i++) { // (insertion sort: n <= 32)
+      uint32_t v = sorted[i];
+      int8_t j = i - 1;
+      for( ; j >= 0 && sorted[j] > v; j--) sorted[j + 1] = sorted[j];
+      sorted[j + 1] = v;
+    }
+    s.p50Ms = sorted[(50 * (latCount - 1) + 50) / 100];
+    s.p90Ms = sorted[(90 * (latCount - 1) + 50) / 100];
+    s.p99Ms = sorted[(99 * (latCount - 1) + 50) / 100];
+    return s;
+  }
+};
+
+#endif
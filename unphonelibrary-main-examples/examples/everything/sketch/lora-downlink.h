@@ -0,0 +1,82 @@
+// lora-downlink.h
+// a table-driven router for LoRaWAN downlinks: handlers register for an
+// fPort and (optionally) an opcode, the first payload byte; dispatch() passes
+// them a pointer to the rest of the payload where it lies (in LMIC's frame
+// buffer, so handlers must copy anything they want to keep). no LMIC or
+// hardware dependencies, so frames can be injected on the host too
+
+#ifndef LORA_DOWNLINK_H
+#define LORA_DOWNLINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef LORA_DOWNLINK_ROUTES
+#  define LORA_DOWNLINK_ROUTES 16   // max registered handlers
+#endif
+
+static const int16_t LORA_ANY_OPCODE = -1; // handler takes the whole payload
+
+// args/len: the payload after the opcode (or all of it, for LORA_ANY_OPCODE)
+typedef void (*lora_downlink_handler_t)(
+  const uint8_t *args, uint8_t len, void *ctx
+);
+
+class LoraDownlinkRouter {
+  typedef struct {
+    uint8_t port;
+    int16_t opcode;
+    uint8_t minArgs;                // shorter payloads are rejected
+    lora_downlink_handler_t handler;
+    void *ctx;
+  } route_t;
+  route_t routes[LORA_DOWNLINK_ROUTES];
+  volatile uint8_t count = 0;       // routes are append-only
+  uint32_t unhandled = 0, rejected = 0;
+
+public:
+  // add a route; false if the table is full. not thread safe: callers
+  // serialise registration (dispatch may run concurrently, as entries are
+  // complete before count covers them)
+  bool on(
+    uint8_t port, int16_t opcode, lora_downlink_handler_t handler,
+    uint8_t minArgs = 0, void *ctx = NULL
+  ) {
+    if(count == LORA_DOWNLINK_ROUTES) return false;
+    route_t *r = &routes[count];
+    r->port = port;
+    r->opcode = opcode;
+    r->minArgs = minArgs;
+    r->handler = handler;
+    r->ctx = ctx;
+    count = count + 1;
+    return true;
+  }
+
+  // run every handler matching the frame; returns how many ran
+  uint8_t dispatch(uint8_t port, const uint8_t *data, uint8_t len) {
+    uint8_t ran = 0, n = count;
+    bool short_ = false;
+    for(uint8_t i = 0; i < n; i++) {
+      const route_t *r = &routes[i];
+      if(r->port != port) continue;
+      const uint8_t *args = data;
+      uint8_t argLen = len;
+      if(r->opcode != LORA_ANY_OPCODE) {
+        if(len == 0 || data[0] != (uint8_t) r->opcode) continue;
+        args++;
+        argLen--;
+      }
+      if(argLen < r->minArgs) { short_ = true; continue; }
+      r->handler(args, argLen, r->ctx);
+      ran++;
+    }
+    if(ran == 0) { if(short_) rejected++; else unhandled++; }
+    return ran;
+  }
+
+  uint32_t unhandledCount() const { return unhandled; } // no route matched
+  uint32_t rejectedCount() const { return rejected; }   // too short for one
+};
+
+#endif
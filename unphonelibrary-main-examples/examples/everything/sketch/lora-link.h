@@ -0,0 +1,127 @@
+// lora-link.h
+// a rolling estimate of LoRa link quality (SNR and RSSI of recent downlinks
+// and ACKs, and the delivery rate of recent confirmed uplinks), and from it
+// the fastest spreading factor (and, at SF7, lowest TX power) that should
+// keep delivery above a target. SNR is measured on the downlink, so it's
+// only a proxy for the uplink: the SNR margin grows when confirmed uplinks go
+// unacknowledged and shrinks slowly while they're getting through. no LMIC
+// or hardware dependencies and no locking (callers serialise access)
+
+#ifndef LORA_LINK_H
+#define LORA_LINK_H
+
+#include <stdint.h>
+
+#ifndef LORA_LINK_TARGET
+#  define LORA_LINK_TARGET 90     // percentage of confirmed uplinks acked
+#endif
+
+typedef struct {
+  int16_t snrTenths;              // smoothed SNR, dB x 10
+  int16_t rssi;                   // smoothed RSSI, dBm
+  uint32_t samples;               // frames received
+  int8_t deliveryPercent;         // recent confirmed uplinks acked (-1: none)
+  int16_t marginTenths;           // SNR margin required above the SF floor
+  uint8_t sf;                     // recommended spreading factor (7-12)
+  int8_t txPow;                   // recommended TX power, dBm
+} lora_link_stats_t;
+
+class LoraLinkTracker {
+  static const int16_t MIN_MARGIN = 30;    // dB x 10
+  static const int16_t MAX_MARGIN = 150;
+  static const int16_t MARGIN_UP = 25;     // after a failure below target
+  static const int16_t MARGIN_DOWN = 5;    // after a success above target
+  static const int16_t HYSTERESIS = 10;    // extra dB x 10 to speed up
+  static const int8_t POWER_STEP = 3;      // dB
+  static const uint8_t OUTCOMES = 16;      // confirmed uplinks remembered
+
+  int8_t maxPow, minPow;
+  int32_t snrAvg = 0, rssiAvg = 0;         // EWMA (1/4), scaled by 16
+  uint32_t count = 0;
+  uint16_t outcomes = 0;                   // bit ring: 1 = acked
+  uint8_t outcomeCount = 0;
+  int16_t margin;
+
+  // demodulation floor (dB x 10) for SF7 to SF12 (SX127x datasheet)
+  static int16_t floorFor(uint8_t sf) {
+    static const int16_t floors[] = { -75, -100, -125, -150, -175, -200 };
+    return floors[sf - 7];
+  }
+
+public:
+  LoraLinkTracker(int8_t maxPower, int8_t minPower)
+    : maxPow(maxPower), minPow(minPower), margin(MIN_MARGIN + 20) { }
+
+  // a frame (downlink or ACK) was received with this SNR and RSSI
+  void observe(int16_t snrTenths, int16_t rssi) {
+    if(count++ == 0) {
+      snrAvg = snrTenths * 16;
+      rssiAvg = rssi * 16;
+    } else {
+      snrAvg += (snrTenths * 16 - snrAvg) / 4;
+      rssiAvg += (rssi * 16 - rssiAvg) / 4;
+    }
+  }
+
+  // a confirmed uplink was acknowledged (or wasn't)
+  void outcome(bool acked) {
+    outcomes = (outcomes << 1) | (acked ? 1 : 0);
+    if(outcomeCount < OUTCOMES) outcomeCount++;
+    int8_t rate = deliveryPercent();
+    if(!acked && rate < LORA_LINK_TARGET) {
+      margin += MARGIN_UP;
+      if(margin > MAX_MARGIN) margin = MAX_MARGIN;
+    } else if(acked && rate >= LORA_LINK_TARGET) {
+      margin -= MARGIN_DOWN;
+      if(margin < MIN_MARGIN) margin = MIN_MARGIN;
+    }
+  }
+
+  int8_t deliveryPercent() const {
+    if(outcomeCount == 0) return -1;
+    uint8_t acked = 0;
+    for(uint8_t i = 0; i < outcomeCount; i++) acked += (outcomes >> i) & 1;
+    return acked * 100 / outcomeCount;
+  }
+  bool belowTarget() const {
+    int8_t rate = deliveryPercent();
+    return rate >= 0 && rate < LORA_LINK_TARGET;
+  }
+
+  // the SF and TX power to use, given the current SF; false if there's no
+  // estimate yet
+  bool choose(uint8_t curSf, uint8_t *sf, int8_t *txPow) const {
+    if(count == 0) return false;
+    int16_t snr = snrAvg / 16;
+    uint8_t best = 12;
+    for(uint8_t s = 7; s <= 12; s++) {
+      int16_t need = floorFor(s) + margin + (s < curSf ? HYSTERESIS : 0);
+      if(snr >= need) { best = s; break; }
+    }
+    *sf = best;
+
+    // at SF7, spend surplus margin on lower power
+    *txPow = maxPow;
+    if(best == 7) {
+      int16_t surplus = snr - floorFor(7) - margin - HYSTERESIS;
+      if(surplus > 0) *txPow -= POWER_STEP * (surplus / (POWER_STEP * 10));
+      if(*txPow < minPow) *txPow = minPow;
+    }
+    return true;
+  }
+
+  lora_link_stats_t stats(uint8_t curSf) const {
+    lora_link_stats_t s;
+    s.snrTenths = snrAvg / 16;
+    s.rssi = rssiAvg / 16;
+    s.samples = count;
+    s.deliveryPercent = deliveryPercent();
+    s.marginTenths = margin;
+    s.sf = curSf;
+    s.txPow = maxPow;
+    choose(curSf, &s.sf, &s.txPow);
+    return s;
+  }
+};
+
+#endif
@@ -0,0 +1,61 @@
+// lora-log.h
+// a lock-free, single producer / single consumer ring of binary log records
+// (timestamp, event id, args), so that time-critical code (LMIC callbacks)
+// can log without formatting or waiting on Serial; a low priority task
+// formats the records later. records are dropped (and counted) when the
+// ring is full, never waited for. no hardware dependencies
+
+#ifndef LORA_LOG_H
+#define LORA_LOG_H
+
+#include <stdint.h>
+
+#ifndef LORA_LOG_RECORDS
+#  define LORA_LOG_RECORDS 64     // ring size (a power of 2)
+#endif
+
+// levels for the compile time filter (see LORA_LOG in ttn-lora.cpp)
+#define LORA_LOG_OFF   0
+#define LORA_LOG_ERROR 1
+#define LORA_LOG_INFO  2
+#define LORA_LOG_DEBUG 3
+
+typedef struct {
+  int32_t time;                   // LMIC ostime_t ticks
+  uint8_t id;                     // what happened (see ttn-lora.cpp)
+  const char *text;               // a string literal, or NULL
+  int32_t args[4];                // meaning depends on id
+} lora_log_t;
+
+class LoraLog {
+  lora_log_t ring[LORA_LOG_RECORDS];
+  uint32_t head = 0;              // next write (producer owns)
+  uint32_t tail = 0;              // next read (consumer owns)
+  uint32_t lost = 0;              // records dropped when full
+
+public:
+  // producer side: copy r in, false (and counted) if the ring is full
+  bool put(const lora_log_t &r) {
+    uint32_t h = head;
+    if(h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == LORA_LOG_RECORDS) {
+      lost++;
+      return false;
+    }
+    ring[h % LORA_LOG_RECORDS] = r;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE); // publish the record
+    return true;
+  }
+
+  // consumer side: copy the oldest record out, false if there are none
+  bool get(lora_log_t *r) {
+    uint32_t t = tail;
+    if(__atomic_load_n(&head, __ATOMIC_ACQUIRE) == t) return false;
+    *r = ring[t % LORA_LOG_RECORDS];
+    __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE); // free the slot
+    return true;
+  }
+
+  uint32_t dropped() const { return lost; } // (approximate from consumer)
+};
+
+#endif
@@ -0,0 +1,179 @@
+// lora-payload.h
+// compact binary uplink payloads, Cayenne LPP style: each field is a channel
+// byte, a type byte and a fixed-size big-endian value; TTN's built-in
+// "CayenneLPP" payload formatter decodes these. LoraPayload builds a payload
+// in a fixed buffer (no allocation, never overruns: a field that won't fit
+// is refused and marks the payload as overflowed); LoraPayloadReader walks
+// one. no hardware dependencies, so both build on the host too
+
+#ifndef LORA_PAYLOAD_H
+#define LORA_PAYLOAD_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef LORA_PAYLOAD_MAX
+#  define LORA_PAYLOAD_MAX 51     // fits SF12 in EU868 (the slowest DR)
+#endif
+
+// field types (values are the IPSO ids less 3200, as Cayenne uses)
+enum lpp_type_t {
+  LPP_DIGITAL_IN  =   0,          // 1 byte, unsigned
+  LPP_ANALOG_IN   =   2,          // 2 bytes, signed, 0.01
+  LPP_U16         = 101,          // 2 bytes, unsigned (LPP "luminosity")
+  LPP_TEMPERATURE = 103,          // 2 bytes, signed, 0.1 °C
+  LPP_HUMIDITY    = 104,          // 1 byte, unsigned, 0.5 %
+  LPP_ACCEL       = 113,          // 3 x 2 bytes, signed, 0.001 G
+  LPP_VOLTAGE     = 116,          // 2 bytes, unsigned, 0.01 V
+};
+
+// bytes of value following the channel and type bytes (0 = unknown type)
+static inline uint8_t lppSize(uint8_t type) {
+  switch(type) {
+    case LPP_DIGITAL_IN:  return 1;
+    case LPP_ANALOG_IN:   return 2;
+    case LPP_U16:         return 2;
+    case LPP_TEMPERATURE: return 2;
+    case LPP_HUMIDITY:    return 1;
+    case LPP_ACCEL:       return 6;
+    case LPP_VOLTAGE:     return 2;
+  }
+  return 0;
+}
+
+class LoraPayload {
+  uint8_t buf[LORA_PAYLOAD_MAX];
+  uint8_t len = 0;
+  bool overflowed = false;
+
+  // scale and round (away from zero) to the wire's fixed point
+  static int32_t fixed(float v, float scale) {
+    float f = v * scale;
+    return (int32_t) (f < 0 ? f - 0.5f : f + 0.5f);
+  }
+  static int16_t clamp16(int32_t v) {
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : (int16_t) v);
+  }
+  static uint16_t clampU16(int32_t v) {
+    return v > 65535 ? 65535 : (v < 0 ? 0 : (uint16_t) v);
+  }
+
+  // start a field, returning where its value goes (or NULL if no room)
+  uint8_t *field(uint8_t channel, uint8_t type) {
+    uint8_t need = 2 + lppSize(type);
+    if(len + need > LORA_PAYLOAD_MAX) { overflowed = true; return NULL; }
+    uint8_t *p = buf + len;
+    p[0] = channel;
+    p[1] = type;
+    len += need;
+    return p + 2;
+  }
+  static void put16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+
+public:
+  void reset() { len = 0; overflowed = false; }
+  const uint8_t *data() const { return buf; }
+  uint8_t size() const { return len; }
+  bool overflow() const { return overflowed; } // was a field refused?
+
+  bool addDigital(uint8_t channel, uint8_t v) {
+    uint8_t *p = field(channel, LPP_DIGITAL_IN);
+    if(p == NULL) return false;
+    p[0] = v;
+    return true;
+  }
+  bool addAnalog(uint8_t channel, float v) {
+    uint8_t *p = field(channel, LPP_ANALOG_IN);
+    if(p == NULL) return false;
+    put16(p, (uint16_t) clamp16(fixed(v, 100.0f)));
+    return true;
+  }
+  bool addU16(uint8_t channel, uint16_t v) {
+    uint8_t *p = field(channel, LPP_U16);
+    if(p == NULL) return false;
+    put16(p, v);
+    return true;
+  }
+  bool addTemp(uint8_t channel, float celsius) {
+    uint8_t *p = field(channel, LPP_TEMPERATURE);
+    if(p == NULL) return false;
+    put16(p, (uint16_t) clamp16(fixed(celsius, 10.0f)));
+    return true;
+  }
+  bool addHumidity(uint8_t channel, float percent) {
+    uint8_t *p = field(channel, LPP_HUMIDITY);
+    if(p == NULL) return false;
+    int32_t v = fixed(percent, 2.0f);
+    p[0] = v > 255 ? 255 : (v < 0 ? 0 : v);
+    return true;
+  }
+  bool addAccel(uint8_t channel, float gx, float gy, float gz) { // in G
+    uint8_t *p = field(channel, LPP_ACCEL);
+    if(p == NULL) return false;
+    put16(p,     (uint16_t) clamp16(fixed(gx, 1000.0f)));
+    put16(p + 2, (uint16_t) clamp16(fixed(gy, 1000.0f)));
+    put16(p + 4, (uint16_t) clamp16(fixed(gz, 1000.0f)));
+    return true;
+  }
+  bool addVoltage(uint8_t channel, float volts) {
+    uint8_t *p = field(channel, LPP_VOLTAGE);
+    if(p == NULL) return false;
+    put16(p, clampU16(fixed(volts, 100.0f)));
+    return true;
+  }
+};
+
+// one decoded field: values[] holds 1 number, or 3 for LPP_ACCEL, already
+// scaled to their natural units (V, °C, G, ...)
+typedef struct {
+  uint8_t channel;
+  uint8_t type;
+  uint8_t count;
+  float values[3];
+} lpp_field_t;
+
+class LoraPayloadReader {
+  const uint8_t *buf;
+  uint8_t len;
+  uint8_t pos = 0;
+  bool bad = false;
+
+  static int16_t get16(const uint8_t *p) { return (int16_t) (p[0] << 8 | p[1]); }
+  static uint16_t getU16(const uint8_t *p) { return (uint16_t) (p[0] << 8 | p[1]); }
+
+public:
+  LoraPayloadReader(const uint8_t *data, uint8_t length)
+    : buf(data), len(length) { }
+
+  // decode the next field into f; false at the end or on a malformed
+  // payload (unknown type or truncated field, including a lone trailing
+  // byte; see malformed())
+  bool next(lpp_field_t *f) {
+    if(bad || pos == len) return false;
+    if(pos + 2 > len) { bad = true; return false; }
+    uint8_t size = lppSize(buf[pos + 1]);
+    if(size == 0 || pos + 2 + size > len) { bad = true; return false; }
+    f->channel = buf[pos];
+    f->type = buf[pos + 1];
+    f->count = 1;
+    const uint8_t *p = buf + pos + 2;
+    switch(f->type) {
+      case LPP_DIGITAL_IN:  f->values[0] = p[0]; break;
+      case LPP_ANALOG_IN:   f->values[0] = get16(p) / 100.0f; break;
+      case LPP_U16:         f->values[0] = getU16(p); break;
+      case LPP_TEMPERATURE: f->values[0] = get16(p) / 10.0f; break;
+      case LPP_HUMIDITY:    f->values[0] = p[0] / 2.0f; break;
+      case LPP_VOLTAGE:     f->values[0] = getU16(p) / 100.0f; break;
+      case LPP_ACCEL:
+        f->count = 3;
+        for(uint8_t i = 0; i < 3; i++)
+          f->values[i] = get16(p + 2 * i) / 1000.0f;
+        break;
+    }
+    pos += 2 + size;
+    return true;
+  }
+  bool malformed() const { return bad; }
+};
+
+#endif
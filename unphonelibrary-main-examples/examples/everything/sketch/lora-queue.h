@@ -0,0 +1,123 @@
+// lora-queue.h
+// a bounded queue of LoRaWAN uplink messages, highest priority first (and
+// first in, first out within a priority); no hardware or LMIC dependencies,
+// and no locking: callers serialise access
+
+#ifndef LORA_QUEUE_H
+#define LORA_QUEUE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef LORA_QUEUE_SLOTS
+#  define LORA_QUEUE_SLOTS 8      // messages held before we start dropping
+#endif
+#ifndef LORA_MSG_MAX
+#  define LORA_MSG_MAX     100    // max payload bytes per message
+#endif
+
+typedef struct {
+  uint32_t id;                    // unique (wrapping) message number
+  uint8_t  port;                  // LoRaWAN fPort (1-223)
+  bool     confirmed;             // ask the network to ACK?
+  uint8_t  priority;              // higher goes first
+  uint32_t enqueuedMs;            // when it was queued
+  uint8_t  len;                   // payload length
+  uint8_t  data[LORA_MSG_MAX];    // payload
+} lora_msg_t;
+
+typedef struct {
+  uint32_t enqueued;              // messages accepted
+  uint32_t dequeued;              // messages handed to LMIC
+  uint32_t dropped;               // messages discarded (new or evicted)
+  uint32_t overflows;             // pushes that found the queue full
+  uint8_t  depth;                 // messages waiting now
+  uint8_t  maxDepth;              // high water mark
+} lora_queue_stats_t;
+
+class LoraQueue {
+  lora_msg_t slots[LORA_QUEUE_SLOTS];
+  uint32_t seq[LORA_QUEUE_SLOTS]; // arrival order (0 = slot empty)
+  uint32_t nextSeq = 1;
+  lora_queue_stats_t stats = { 0, 0, 0, 0, 0, 0 };
+
+  // the slot that should go next (or -1); lowest picks the next victim
+  int8_t find(bool lowest) const {
+    int8_t best = -1;
+    for(int8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+      if(seq[i] == 0) continue;
+      if(best == -1) { best = i; continue; }
+      uint8_t p = slots[i].priority, bp = slots[best].priority;
+      if(lowest) { // lowest priority, newest arrival
+        if(p < bp || (p == bp && seq[i] > seq[best])) best = i;
+      } else {     // highest priority, oldest arrival
+        if(p > bp || (p == bp && seq[i] < seq[best])) best = i;
+      }
+    }
+    return best;
+  }
+
+public:
+  LoraQueue() { memset(seq, 0, sizeof(seq)); }
+
+  // queue a message, returning its id; when full the lowest priority
+  // message loses (if the new one doesn't outrank anything it is the one
+  // dropped, and push returns 0)
+  uint32_t push(
+    uint8_t port, const uint8_t *data, uint8_t len, bool confirmed,
+    uint8_t priority, uint32_t nowMs
+  ) {
+    if(len > LORA_MSG_MAX) len = LORA_MSG_MAX;
+    int8_t slot = -1;
+    for(int8_t i = 0; i < LORA_QUEUE_SLOTS && slot == -1; i++)
+      if(seq[i] == 0) slot = i;
+    if(slot == -1) {
+      stats.overflows++;
+      stats.dropped++;
+      int8_t victim = find(true);
+      if(slots[victim].priority >= priority) return 0;     // drop new
+      seq[victim] = 0;                                      // evict old
+      stats.depth--;
+      slot = victim;
+    }
+
+    lora_msg_t *m = &slots[slot];
+    m->port = port;
+    m->confirmed = confirmed;
+    m->priority = priority;
+    m->enqueuedMs = nowMs;
+    m->len = len;
+    memcpy(m->data, data, len);
+    m->id = seq[slot] = nextSeq++;
+    if(nextSeq == 0) nextSeq = 1; // (0 marks an empty slot)
+
+    stats.enqueued++;
+    if(++stats.depth > stats.maxDepth) stats.maxDepth = stats.depth;
+    return m->id;
+  }
+
+  // the next message to send (or NULL); it stays queued until remove()
+  const lora_msg_t *peek() const {
+    int8_t i = find(false);
+    return (i == -1) ? NULL : &slots[i];
+  }
+
+  // remove message id, if still queued (it may have been evicted since it
+  // was peeked); sent is false when LMIC refused it (e.g. too long for the
+  // current data rate), which counts as a drop
+  void remove(uint32_t id, bool sent = true) {
+    for(int8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+      if(seq[i] != id) continue;
+      seq[i] = 0;
+      stats.depth--;
+      if(sent) stats.dequeued++; else stats.dropped++;
+      return;
+    }
+  }
+
+  uint8_t depth() const { return stats.depth; }
+  bool empty() const { return stats.depth == 0; }
+  lora_queue_stats_t getStats() const { return stats; }
+};
+
+#endif
@@ -0,0 +1,98 @@
+// lora-sched.h
+// the decisions behind the doWork job (whether to send, when to run next),
+// kept free of LMIC and hardware: lora-work.cpp feeds in LMIC's state (and
+// host-test/lora-sim-test.cpp runs lora-work.cpp against a fake LMIC and
+// gateway to measure messages per hour)
+
+#ifndef LORA_SCHED_H
+#define LORA_SCHED_H
+
+#include <stdint.h>
+
+typedef enum {
+  LORA_WORK_NONE,     // nothing to do (not joined, or nothing queued)
+  LORA_WORK_BUSY,     // a TX/RX is in flight; try again later
+  LORA_WORK_WAIT,     // duty cycle: not allowed to transmit yet
+  LORA_WORK_SEND,     // hand the next queued message to LMIC
+} lora_work_t;
+
+// what LMIC and the uplink queue look like when the doWork job runs
+typedef struct {
+  bool joined;        // have a session (devaddr != 0)
+  bool txPending;     // LMIC has a frame (OP_TXDATA: waiting or in flight)
+  uint8_t queued;     // messages waiting (including retries now due)
+  uint32_t txInMs;    // until the duty cycle allows a TX (0 = now)
+  uint32_t retryInMs; // until the next retry is due (UINT32_MAX = none)
+} lora_state_t;
+
+// runs are: immediate on enqueue (see wake()) and after each TX while the
+// queue is non-empty; at the next feasible TX time while the duty cycle
+// holds us back; otherwise every interval, doubling while there's nothing
+// to send (so an idle node rarely wakes) up to 8 intervals
+class LoraScheduler {
+  static const uint8_t MAX_BACKOFF_SHIFT = 3; // i.e. 8 x interval
+  static const uint32_t MIN_RUN_MS = 10;      // never spin
+  uint32_t intervalMs;
+  uint8_t idleShift = 0;         // backoff: interval << idleShift
+  uint32_t runs = 0, sends = 0;  // for stats
+
+public:
+  LoraScheduler(uint32_t interval) : intervalMs(interval) { }
+
+  // LMIC's ms2osticks() overflows ostime_t (62.5 ticks/ms in an int32)
+  // past ~34,000 s, so runs are at most this far apart
+  static const uint32_t MAX_RUN_MS = 30000000UL;  // ~8.3 hours
+
+  // the doWork interval; false (and unchanged) if 0 or over MAX_INTERVAL_MS
+  // (so that backed off, it stays under MAX_RUN_MS)
+  static const uint32_t MAX_INTERVAL_MS = 3600000UL;
+  bool interval(uint32_t ms) {
+    if(ms == 0 || ms > MAX_INTERVAL_MS) return false;
+    intervalMs = ms;
+    idleShift = 0;
+    return true;
+  }
+  uint32_t interval() const { return intervalMs; }
+
+  // something was queued: stop backing off (the caller runs doWork now)
+  void wake() { idleShift = 0; }
+
+  // what should this run of the doWork job do?
+  lora_work_t decide(const lora_state_t &s) {
+    runs++;
+    if(!s.joined) return LORA_WORK_NONE;
+    if(s.queued == 0) {
+      if(idleShift < MAX_BACKOFF_SHIFT) idleShift++;
+      return LORA_WORK_NONE;
+    }
+    idleShift = 0;
+    if(s.txPending) return LORA_WORK_BUSY;
+    if(s.txInMs > 0) return LORA_WORK_WAIT;
+    sends++;
+    return LORA_WORK_SEND;
+  }
+
+  // ms from a run until the next one (s is the state after it), between
+  // MIN_RUN_MS and MAX_RUN_MS
+  uint32_t nextRunIn(const lora_state_t &s) const {
+    uint32_t ms;
+    if(s.joined && s.queued > 0 && !s.txPending) // waiting on duty cycle
+      ms = s.txInMs;
+    else {
+      uint32_t idle = intervalMs;  // (a TX completing also runs us)
+      for(uint8_t i = 0; i < idleShift && idle < MAX_RUN_MS; i++) idle <<= 1;
+      ms = s.retryInMs < idle ? s.retryInMs : idle; // (a retry backing off)
+    }
+    if(ms < MIN_RUN_MS) return MIN_RUN_MS;
+    return ms > MAX_RUN_MS ? MAX_RUN_MS : ms;
+  }
+
+  // after a TX completes, should doWork run straight away (rather than
+  // waiting out its interval)? (if the duty cycle isn't ready it will wait)
+  bool runAfterTx(const lora_state_t &s) const { return s.queued > 0; }
+
+  uint32_t workRuns() const { return runs; }
+  uint32_t workSends() const { return sends; }
+};
+
+#endif
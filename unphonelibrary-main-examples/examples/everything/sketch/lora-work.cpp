@@ -0,0 +1,570 @@
+// lora-work.cpp
+// the uplink pipeline: lora_enqueue and friends feed a queue (and batch)
+// that the doWork job drains into LMIC as the duty cycle allows, tracking
+// each message to ACKED, SENT or FAILED and steering SF and power from the
+// link quality. LMIC isn't thread safe, so all LMIC calls happen in the
+// LoRa task (lora_loop, jobs and events); the lora_* entry points may be
+// called from any task. see lora-work.h
+
+#include <Arduino.h>
+#include "lora-work.h"
+#include "lora-sched.h"
+#include "lora-batch.h"
+#include "debug.h"
+
+// uplinks waiting for LMIC: lora_send/lora_enqueue may be called from any
+// task, the doWork job drains the queue in the LoRa task; queueMux guards it
+static LoraQueue loraQueue;
+static portMUX_TYPE queueMux = portMUX_INITIALIZER_UNLOCKED;
+
+// what became of each uplink (lora-delivery.h): driven from the LoRa task,
+// deliveryMux guards it for lora_delivery_stats readers; unacknowledged
+// confirmed messages wait there for their retry (ahead of the queue)
+static LoraDelivery loraDelivery;
+static portMUX_TYPE deliveryMux = portMUX_INITIALIZER_UNLOCKED;
+static lora_delivery_cb_t deliveryCallback = NULL;
+static void deliveryOutcome(uint32_t id, lora_delivery_state_t state);
+
+// small readings are batched (lora-batch.h) into frames on LORA_BATCH_PORT,
+// sent when full, when the oldest is LORA_BATCH_AGE_SECONDS old or at once
+// for priority readings; batchMux guards the batch
+static LoraBatch loraBatch(LORA_BATCH_AGE_SECONDS * 1000UL);
+static portMUX_TYPE batchMux = portMUX_INITIALIZER_UNLOCKED;
+static void batchFlush(bool onlyIfDue);
+
+// the log ring (see LORA_LOG), emptied by lora_log_flush
+LoraLog loraLog;
+void loraLogPut(
+  uint8_t id, int32_t time, const char *text,
+  int32_t a0, int32_t a1, int32_t a2, int32_t a3
+) {
+  lora_log_t r = { time, id, text, { a0, a1, a2, a3 } };
+  loraLog.put(r);
+}
+
+static uint8_t payloadBuffer[LORA_MSG_MAX];
+static osjob_t doWorkJob;
+static void doWorkCallback(osjob_t* job);
+
+// (re)schedule doWork to run at once; as a timed job, not os_setCallback's
+// runnable one, so os_queryTimeCriticalJobs (lora_idle_ms) sees it
+static void doWorkNow() {
+  os_setTimedCallback(&doWorkJob, os_getTime(), doWorkCallback);
+}
+static void processWork(ostime_t timestamp);
+static void processDownlink(
+  ostime_t txCompleteTimestamp, uint8_t fPort, uint8_t* data,
+  uint8_t dataLength
+);
+
+// when doWork runs and what it does (interval: change in platformio.ini)
+static LoraScheduler loraSched(DO_WORK_INTERVAL_SECONDS * 1000UL);
+
+// set by lora_enqueue (any task), acted on in lora_loop (the LoRa task, as
+// LMIC isn't thread safe)
+static volatile bool workRequested = false;
+
+// ms until LMIC's duty cycle limits let us transmit: the global limit and
+// (in EU-like regions) the earliest band that has an enabled channel
+static uint32_t txAvailInMs() {
+  ostime_t avail = LMIC.globalDutyAvail;
+#if CFG_LMIC_EU_like
+  bool found = false;
+  ostime_t bandAvail = 0;
+  for(uint8_t ch = 0; ch < MAX_CHANNELS; ch++) {
+    if(!(LMIC.channelMap & (1 << ch)) || LMIC.channelFreq[ch] == 0)
+      continue;
+    ostime_t a = LMIC.bands[LMIC.channelFreq[ch] & 0x3].avail;
+    if(!found || a - bandAvail < 0) bandAvail = a;
+    found = true;
+  }
+  if(found && bandAvail - avail > 0) avail = bandAvail;
+#endif
+  ostime_t wait = avail - os_getTime();
+  return wait > 0 ? osticks2ms(wait) : 0;
+}
+
+// link quality from received frames and confirmed uplink outcomes
+// (lora-link.h), used to pick data rate and TX power; linkMux guards it for
+// lora_link_stats readers
+static LoraLinkTracker loraLink(DefaultABPTxPower, MinTxPower);
+static portMUX_TYPE linkMux = portMUX_INITIALIZER_UNLOCKED;
+
+// the current spreading factor (0 if not a LoRa data rate we steer)
+static uint8_t currentSf() {
+#if CFG_LMIC_EU_like
+  if(LMIC.datarate <= DR_SF7) return 7 + DR_SF7 - LMIC.datarate;
+#endif
+  return 0;
+}
+
+// move to the SF and power the link tracker recommends; with ADR on the
+// network sets the data rate, so only step in to slow down when delivery is
+// below target (ADR is slow to notice a worsening link)
+static void applyLinkPolicy() {
+  uint8_t cur = currentSf(), sf;
+  int8_t pow;
+  if(cur == 0) return;
+  portENTER_CRITICAL(&linkMux);
+  bool chosen = loraLink.choose(cur, &sf, &pow);
+  bool below = loraLink.belowTarget();
+  lora_link_stats_t s = loraLink.stats(cur);
+  portEXIT_CRITICAL(&linkMux);
+  if(!chosen || (sf == cur && pow == LMIC.adrTxPow)) return;
+  if(LMIC.adrEnabled && !(sf > cur && below)) return;
+  LMIC_setDrTxpow(DR_SF7 - (sf - 7), pow);
+  LORA_LOG(LORA_LOG_INFO, LOG_LINK, 0, NULL,
+    sf, pow, s.snrTenths, s.deliveryPercent);
+}
+
+// a confirmed uplink went unacknowledged: a step slower, as LMIC would
+// have stepped down over the retransmissions EV_TXSTART cut short
+static void slowDown() {
+  uint8_t cur = currentSf();
+  if(cur == 0 || cur >= 12) return;
+  LMIC_setDrTxpow(DR_SF7 - (cur + 1 - 7), KEEP_TXPOW);
+  LORA_LOG(LORA_LOG_INFO, LOG_LINK, 0, NULL, cur + 1, LMIC.adrTxPow, 0, 0);
+}
+
+// LMIC's and the queue's state, as the scheduler sees it
+static lora_state_t loraState() {
+  lora_state_t s;
+  s.joined = LMIC.devaddr != 0;
+  // (OP_TXDATA too: a frame waiting for the duty cycle is LMIC's until it
+  // completes, and LMIC_setTxData2 can't take another meanwhile)
+  s.txPending = LMIC.opmode & (OP_TXDATA | OP_TXRXPEND);
+  s.txInMs = txAvailInMs();
+  uint32_t now = millis();
+  portENTER_CRITICAL(&deliveryMux);
+  s.queued = loraDelivery.retriesDue(now);
+  s.retryInMs = loraDelivery.nextRetryIn(now);
+  portEXIT_CRITICAL(&deliveryMux);
+  portENTER_CRITICAL(&queueMux);
+  s.queued += loraQueue.depth();
+  portEXIT_CRITICAL(&queueMux);
+  return s;
+}
+
+
+int16_t getSnrTenfold()
+{
+    // Returns ten times the SNR (dB) value of the last received packet.
+    // Ten times to prevent the use of float but keep 1 decimal digit accuracy.
+    // Calculation per SX1276 datasheet rev.7 §6.4, SX1276 datasheet rev.4 §6.4.
+    // LMIC.snr contains value of PacketSnr, which is 4 times the actual SNR value.
+    return (LMIC.snr * 10) / 4;
+}
+
+
+int16_t getRssi(int8_t snr)
+{
+    // Returns correct RSSI (dBm) value of the last received packet.
+    // Calculation per SX1276 datasheet rev.7 §5.5.5, SX1272 datasheet rev.4 §5.5.5.
+
+    #define RSSI_OFFSET            64
+    #define SX1276_FREQ_LF_MAX     525000000     // per datasheet 6.3
+    #define SX1272_RSSI_ADJUST     -139
+    #define SX1276_RSSI_ADJUST_LF  -164
+    #define SX1276_RSSI_ADJUST_HF  -157
+
+    int16_t rssi;
+
+    #ifdef MCCI_LMIC
+
+        rssi = LMIC.rssi - RSSI_OFFSET;
+
+    #else
+        int16_t rssiAdjust;
+        #ifdef CFG_sx1276_radio
+            if (LMIC.freq > SX1276_FREQ_LF_MAX)
+            {
+                rssiAdjust = SX1276_RSSI_ADJUST_HF;
+            }
+            else
+            {
+                rssiAdjust = SX1276_RSSI_ADJUST_LF;
+            }
+        #else
+            // CFG_sx1272_radio
+            rssiAdjust = SX1272_RSSI_ADJUST;
+        #endif
+
+        // Revert modification (applied in lmic/radio.c) to get PacketRssi.
+        int16_t packetRssi = LMIC.rssi + 125 - RSSI_OFFSET;
+        if (snr < 0)
+        {
+            rssi = rssiAdjust + packetRssi + snr;
+        }
+        else
+        {
+            rssi = rssiAdjust + (16 * packetRssi) / 15;
+        }
+    #endif
+
+    return rssi;
+}
+
+
+static void doWorkCallback(osjob_t* job)
+{
+    // Event hander for doWorkJob. Gets called by the LMIC scheduler.
+    // The actual work is performed in function processWork() which is called below.
+
+    ostime_t timestamp = os_getTime();
+    LORA_LOG(LORA_LOG_DEBUG, LOG_TEXT, timestamp, "TTN LoRa doWork job started");
+
+    // Do the work that needs to be performed.
+    processWork(timestamp);
+
+    // This job must explicitly reschedule itself for the next run.
+    uint32_t nextMs = loraSched.nextRunIn(loraState());
+    ostime_t startAt = timestamp + ms2osticks(nextMs);
+    os_setTimedCallback(&doWorkJob, startAt, doWorkCallback);
+}
+
+
+static lmic_tx_error_t scheduleUplink(uint8_t fPort, uint8_t* data, uint8_t dataLength, bool confirmed = false)
+{
+    // This function is called from the processWork() function to schedule
+    // transmission of an uplink message that was prepared by processWork().
+    // Transmission will be performed at the next possible time
+
+    ostime_t timestamp = os_getTime();
+    LORA_LOG(LORA_LOG_INFO, LOG_TEXT, timestamp, "Packet queued");
+    lora_work_show(timestamp, "Packet queued");
+
+    lmic_tx_error_t retval = LMIC_setTxData2(fPort, data, dataLength, confirmed ? 1 : 0);
+    timestamp = os_getTime();
+
+    if (retval != LMIC_ERROR_SUCCESS)
+    {
+        LORA_LOG(LORA_LOG_ERROR, LOG_TX_ERROR, timestamp, NULL, retval);
+        lora_work_show(timestamp, "LMIC Err");
+    }
+    return retval;
+}
+
+
+// This function is called from the doWorkCallback() callback function when
+// the doWork job is executed. Uses globals: payloadBuffer and LMIC data
+// structure. This is where the main work is performed like reading sensor and
+// GPS data and schedule uplink messages if anything needs to be transmitted.
+static void processWork(ostime_t doWorkJobTimeStamp) {
+    // Skip processWork if using OTAA and still joining.
+    if (LMIC.devaddr == 0) {
+        loraSched.decide(loraState());
+        return;
+    }
+    lora_work_t work = loraSched.decide(loraState());
+    ostime_t timestamp = os_getTime();
+
+    // if there's nothing queued do nothing (the scheduler backs off, and
+    // lora_enqueue wakes us)
+    if (work == LORA_WORK_NONE) {
+      lora_work_show(timestamp, "no pyld, UL !scheduled");
+      LORA_LOG(LORA_LOG_DEBUG, LOG_TEXT, timestamp,
+        "no payload, uplink not scheduled");
+      return;
+    }
+
+    // Schedule uplink message if possible
+    if (work == LORA_WORK_BUSY) {
+        // TxRx is currently pending, do not send.
+        LORA_LOG(LORA_LOG_DEBUG, LOG_TEXT, timestamp,
+          "Uplink not scheduled because TxRx pending");
+        lora_work_show(timestamp, "UL not scheduled");
+        return;
+    }
+    if (work == LORA_WORK_WAIT) {
+        // Duty cycle not yet available; doWork is rescheduled for when it
+        // is, and the message stays queued (so later, higher priority
+        // messages can still overtake it).
+        LORA_LOG(LORA_LOG_DEBUG, LOG_TEXT, timestamp,
+          "Uplink deferred until duty cycle allows");
+        lora_work_show(timestamp, "UL deferred");
+        return;
+    }
+    lora_work_sending(loraSched.interval());
+
+    // Prepare uplink payload: a retry that's due, else copy the next
+    // message off the queue (so LMIC's copy of it isn't made while holding
+    // the mux)
+    lora_msg_t msg;
+    uint8_t attempts = 0;
+    portENTER_CRITICAL(&deliveryMux);
+    bool retry = loraDelivery.takeRetry(millis(), &msg, &attempts);
+    portEXIT_CRITICAL(&deliveryMux);
+    if(!retry) {
+      portENTER_CRITICAL(&queueMux);
+      const lora_msg_t *next = loraQueue.peek();
+      if(next != NULL) msg = *next;
+      portEXIT_CRITICAL(&queueMux);
+      if(next == NULL) return;
+    }
+    memcpy(payloadBuffer, msg.data, msg.len);
+
+    // schedule an uplink; drop the message if LMIC won't take it (e.g. too
+    // long for the current data rate) so it can't block the rest of the
+    // queue
+    lmic_tx_error_t err =
+      scheduleUplink(msg.port, payloadBuffer, msg.len, msg.confirmed);
+    if(!retry) {
+      portENTER_CRITICAL(&queueMux);
+      loraQueue.remove(msg.id, err == LMIC_ERROR_SUCCESS);
+      portEXIT_CRITICAL(&queueMux);
+    }
+    portENTER_CRITICAL(&deliveryMux);
+    if(err == LMIC_ERROR_SUCCESS)
+      loraDelivery.sent(msg, attempts);
+    else
+      loraDelivery.refused();
+    portEXIT_CRITICAL(&deliveryMux);
+    if(err != LMIC_ERROR_SUCCESS) deliveryOutcome(msg.id, LORA_FAILED);
+}
+
+// log an uplink's outcome and pass it to the lora_on_delivery callback
+static void deliveryOutcome(uint32_t id, lora_delivery_state_t state) {
+  LORA_LOG(LORA_LOG_INFO, LOG_DELIVERY, 0, NULL, id, state);
+  lora_delivery_cb_t cb = deliveryCallback;
+  if(cb != NULL) cb(id, state);
+}
+
+// Downlinks are routed by fPort and opcode (first payload byte) to handlers
+// registered with lora_on_downlink(). The 'set interval' command is built
+// in (and ttn-lora.cpp adds LMIC-node's 'reset counter'); to send them to
+// the node, send a downlink message (e.g. from the TTN Console) on port
+// LORA_CMD_PORT:
+//   C0          reset counter
+//   C1 hh ll    set the doWork interval to 0xhhll seconds (1 to 3600)
+static LoraDownlinkRouter downlinkRouter;
+static portMUX_TYPE routerMux = portMUX_INITIALIZER_UNLOCKED;
+static const uint8_t intervalCmd = 0xC1;
+
+static void onIntervalCmd(const uint8_t *args, uint8_t len, void *ctx) {
+    uint16_t secs = args[0] << 8 | args[1];
+    if (!loraSched.interval(secs * 1000UL)) { // 0, or over an hour
+        LORA_LOG(LORA_LOG_ERROR, LOG_VALUE, 0,
+          "Interval rejected (seconds): ", secs);
+        return;
+    }
+    LORA_LOG(LORA_LOG_INFO, LOG_VALUE, 0, "Interval set (seconds): ", secs);
+}
+
+// This function is called on EV_TXCOMPLETE when a downlink message was
+// received. data points into LMIC's frame buffer (it is not copied).
+static void processDownlink(
+  ostime_t txCompleteTimestamp, uint8_t fPort, uint8_t* data, uint8_t dataLength
+) {
+    if (downlinkRouter.dispatch(fPort, data, dataLength) == 0)
+        LORA_LOG(LORA_LOG_INFO, LOG_TEXT, txCompleteTimestamp,
+          "Downlink not handled");
+}
+
+void lora_work_start() {
+  lora_on_downlink(LORA_CMD_PORT, intervalCmd, onIntervalCmd, 2, NULL);
+
+  // schedule initial doWork job for immediate execution.
+  doWorkNow();
+}
+
+void lora_work_event(ev_t ev) {
+  ostime_t timestamp = os_getTime();
+  uint32_t id = 0;
+  lora_delivery_state_t state;
+
+  switch(ev) {
+#ifdef MCCI_LMIC
+    case EV_TXCANCELED: // (e.g. by a rejoin) the message may be retried
+      portENTER_CRITICAL(&deliveryMux);
+      state = loraDelivery.completed(false, true, millis(), &id);
+      portEXIT_CRITICAL(&deliveryMux);
+      if(id != 0) deliveryOutcome(id, state);
+      break;
+
+    case EV_TXSTART:
+      // LoraDelivery retries unacknowledged confirmed uplinks itself, so
+      // LMIC gets LORA_LMIC_CONF_TRIES attempts rather than TXCONF_ATTEMPTS
+      // (its txCnt is skipped ahead once the frame, and seqnoUp, is built)
+      if(LMIC.pendTxConf && LMIC.txCnt == 0 && !(LMIC.opmode & OP_JOINING))
+        LMIC.txCnt = TXCONF_ATTEMPTS - (LORA_LMIC_CONF_TRIES - 1);
+      break;
+#endif
+
+    case EV_JOINED:
+      // The doWork job has probably run already (while
+      // the node was still joining) and have rescheduled itself.
+      // Cancel the next scheduled doWork job and re-schedule
+      // for immediate execution to prevent that any uplink will
+      // have to wait until the current doWork interval ends.
+      doWorkNow();
+      break;
+
+    case EV_TXCOMPLETE: {
+      // ACKed, sent, or to be retried (TXRX_ACK arrives with the
+      // downlink for confirmed uplinks)
+      bool acked = LMIC.txrxFlags & TXRX_ACK;
+      portENTER_CRITICAL(&deliveryMux);
+      state = loraDelivery.completed(acked, false, millis(), &id);
+      portEXIT_CRITICAL(&deliveryMux);
+      if(id != 0) deliveryOutcome(id, state);
+
+      // feed the link tracker: the SNR of anything received, and
+      // whether a confirmed uplink got through
+      portENTER_CRITICAL(&linkMux);
+      if(LMIC.txrxFlags & (TXRX_DNW1 | TXRX_DNW2))
+        loraLink.observe(getSnrTenfold(), getRssi(getSnrTenfold() / 10));
+      if(id != 0 && state != LORA_SENT)
+        loraLink.outcome(state == LORA_ACKED);
+      portEXIT_CRITICAL(&linkMux);
+      if(id != 0 && (state == LORA_QUEUED || state == LORA_FAILED))
+        slowDown();                      // (LMIC's DRADJUST, see EV_TXSTART)
+      applyLinkPolicy();
+
+      // Check if downlink was received
+      if(LMIC.dataLen != 0 || LMIC.dataBeg != 0) {
+        uint8_t fPort = 0;
+        if(LMIC.txrxFlags & TXRX_PORT)
+          fPort = LMIC.frame[LMIC.dataBeg - 1];
+        processDownlink(
+          timestamp, fPort, LMIC.frame + LMIC.dataBeg, LMIC.dataLen
+        );
+      }
+
+      // More uplinks waiting? Run doWork now rather than at the end of
+      // the interval; LMIC holds the next TX until duty cycle allows.
+      if(loraSched.runAfterTx(loraState())) {
+        doWorkNow();
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+void lora_loop() {
+  if(workRequested && LMIC.devaddr != 0) { // run doWork now for new uplinks
+    workRequested = false;                 // (EV_JOINED does it otherwise)
+    loraSched.wake();
+    doWorkNow();
+  }
+  batchFlush(true);                        // batched readings aged out?
+  os_runloop_once();
+}
+
+void lora_send(const char *fmt, va_list arglist) { // ttn msg (vsprintf style)
+  char text[LORA_MSG_MAX + 1];
+  int len = vsnprintf(text, sizeof(text), fmt, arglist);
+  if(len < 0) return;
+  if(len > LORA_MSG_MAX) len = LORA_MSG_MAX;  // (truncated; no '\0' sent)
+  lora_enqueue(LORA_TEXT_PORT, (const uint8_t *) text, len, false, 0);
+}
+
+uint32_t lora_enqueue( // queue a binary uplink; its id, 0 if dropped
+  uint8_t port, const uint8_t *data, uint8_t len, bool confirmed,
+  uint8_t priority
+) {
+  portENTER_CRITICAL(&queueMux);
+  uint32_t id =
+    loraQueue.push(port, data, len, confirmed, priority, millis());
+  portEXIT_CRITICAL(&queueMux);
+  if(id == 0) {
+    E("lora queue full, uplink dropped (port %u)\n", port)
+    return 0;
+  }
+
+  // wake the LoRa task so doWork runs now, not at its next interval
+  workRequested = true;
+  lora_work_wake();
+  return id;
+}
+
+bool lora_on_downlink( // route downlinks on port (and opcode) to handler
+  uint8_t port, int16_t opcode, lora_downlink_handler_t handler,
+  uint8_t minArgs, void *ctx
+) {
+  portENTER_CRITICAL(&routerMux);
+  bool added = downlinkRouter.on(port, opcode, handler, minArgs, ctx);
+  portEXIT_CRITICAL(&routerMux);
+  if(!added) E("lora downlink routes full (port %u)\n", port)
+  return added;
+}
+
+// hand the batch to the uplink queue (if due, or if it has anything)
+static void batchFlush(bool onlyIfDue) {
+  uint8_t frame[LORA_BATCH_MAX];
+  uint8_t len = 0;
+  uint32_t now = millis();
+  portENTER_CRITICAL(&batchMux);
+  if(!onlyIfDue || loraBatch.due(now)) len = loraBatch.flush(frame, now);
+  portEXIT_CRITICAL(&batchMux);
+  if(len > 0)
+    lora_enqueue(LORA_BATCH_PORT, frame, len, false, 0);
+}
+
+bool lora_batch_add( // add a reading to the batch; priority sends it now
+  uint8_t channel, int32_t value, bool priority
+) {
+  uint8_t full[LORA_BATCH_MAX], due[LORA_BATCH_MAX];
+  uint8_t fullLen = 0, dueLen = 0;
+  uint32_t now = millis();
+  portENTER_CRITICAL(&batchMux);
+  if(loraBatch.full()) fullLen = loraBatch.flush(full, now); // size
+  bool added = loraBatch.add(channel, value, now, priority);
+  if(loraBatch.due(now)) dueLen = loraBatch.flush(due, now);  // prio/age
+  portEXIT_CRITICAL(&batchMux);
+
+  if(fullLen > 0)
+    lora_enqueue(LORA_BATCH_PORT, full, fullLen, false, 0);
+  if(dueLen > 0)
+    lora_enqueue(LORA_BATCH_PORT, due, dueLen, false, priority ? 1 : 0);
+  return added;
+}
+
+void lora_queue_stats(lora_queue_stats_t *stats) { // copy of queue counters
+  portENTER_CRITICAL(&queueMux);
+  *stats = loraQueue.getStats();
+  portEXIT_CRITICAL(&queueMux);
+}
+
+// cb gets each uplink's id (from lora_enqueue) and state as it changes: SENT,
+// ACKED or FAILED (final), or QUEUED when an unacknowledged confirmed
+// message is waiting to be retried; it runs in the LoRa task
+void lora_on_delivery(lora_delivery_cb_t cb) { deliveryCallback = cb; }
+
+void lora_delivery_stats(lora_delivery_stats_t *stats) { // outcomes, latency
+  portENTER_CRITICAL(&deliveryMux);
+  *stats = loraDelivery.stats();
+  portEXIT_CRITICAL(&deliveryMux);
+}
+
+void lora_link_stats(lora_link_stats_t *stats) { // SNR, RSSI, recommendation
+  uint8_t cur = currentSf();
+  portENTER_CRITICAL(&linkMux);
+  *stats = loraLink.stats(cur);
+  portEXIT_CRITICAL(&linkMux);
+}
+
+// how long (up to maxMs) can LMIC be left unserviced? until its next
+// scheduled job or the batch falling due (found by bisection, as LMIC only
+// lets us ask whether a time-critical job is due within a given interval);
+// no more than LORA_BUSY_BLOCK_MS while a TX/RX is in flight, though the
+// DIO interrupts (ttn-lora.cpp) wake the LoRa task for the radio sooner.
+// lora_enqueue and friends wake it for new uplinks
+uint32_t lora_idle_ms(uint32_t maxMs) {
+  if(workRequested && LMIC.devaddr != 0) return 0; // (lora_loop acts)
+  if((LMIC.opmode & OP_TXRXPEND) && maxMs > LORA_BUSY_BLOCK_MS)
+    maxMs = LORA_BUSY_BLOCK_MS;
+  portENTER_CRITICAL(&batchMux);
+  uint32_t batchMs = loraBatch.dueIn(millis());
+  portEXIT_CRITICAL(&batchMux);
+  if(batchMs < maxMs) maxMs = batchMs;
+  if(!os_queryTimeCriticalJobs(ms2osticks(maxMs))) return maxMs;
+  uint32_t lo = 0, hi = maxMs;
+  while(hi - lo > 10) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(os_queryTimeCriticalJobs(ms2osticks(mid))) hi = mid; else lo = mid;
+  }
+  return lo;
+}
@@ -0,0 +1,74 @@
+// lora-work.h
+// the uplink pipeline between the lora_* API (ttn-lora.h) and LMIC: the
+// queue, batch, delivery tracking and link policy, and the doWork job that
+// hands messages to LMIC. lora-work.cpp uses nothing but LMIC's API (lmic.h,
+// the os_* scheduler and millis()), so host-test/ builds the same code
+// against a fake LMIC; ttn-lora.cpp keeps the board, the session and the
+// printing, and calls in here from its setup and event handler
+
+#ifndef LORA_WORK_H
+#define LORA_WORK_H
+
+#include "lmic.h"
+#include "ttn-lora.h"
+
+// Determine which LMIC library is used
+#ifdef _LMIC_CONFIG_PRECONDITIONS_H_
+    #define MCCI_LMIC
+#else
+    #define CLASSIC_LMIC
+#endif
+
+#ifndef DO_WORK_INTERVAL_SECONDS            // Should be set in platformio.ini
+// HC changed to a min:
+//   #define DO_WORK_INTERVAL_SECONDS 300   // Default 5 minutes if not set
+     #define DO_WORK_INTERVAL_SECONDS 60    // Default to a min if not set
+#endif
+
+#ifndef LORA_BATCH_AGE_SECONDS              // oldest batched reading's wait
+#  define LORA_BATCH_AGE_SECONDS (15 * 60)
+#endif
+
+#ifndef LORA_BUSY_BLOCK_MS                  // LoRa task's longest sleep mid
+#  define LORA_BUSY_BLOCK_MS 50             // TX/RX (DIO interrupts wake it)
+#endif
+
+const s1_t DefaultABPTxPower =  14;
+const s1_t MinTxPower = 2;
+
+// logging from the LoRa task (LMIC callbacks and jobs) goes into a binary
+// ring that the log task formats later (lora_log_flush), so callbacks never
+// wait on Serial; LORA_LOG compiles away for levels above LORA_LOG_LEVEL
+enum lora_log_id_t {
+  LOG_TEXT,          // text
+  LOG_LMIC_EVENT,    // args: ev_t
+  LOG_VALUE,         // text, args: value (printed indented)
+  LOG_COUNTERS,      // args: seqnoUp, seqnoDn, RX late count, last late ms
+  LOG_DOWNLINK,      // args: port, length, rssi, snr * 10
+  LOG_SESSION,       // args: netid, devaddr
+  LOG_TX_ERROR,      // args: lmic_tx_error_t
+  LOG_DELIVERY,      // args: message id, lora_delivery_state_t
+  LOG_LINK,          // args: new SF, TX power, SNR * 10, delivery %
+};
+extern LoraLog loraLog;
+void loraLogPut(
+  uint8_t id, int32_t time, const char *text,
+  int32_t a0 = 0, int32_t a1 = 0, int32_t a2 = 0, int32_t a3 = 0
+);
+#define LORA_LOG(level, ...) \
+  do { if((level) <= LORA_LOG_LEVEL) loraLogPut(__VA_ARGS__); } while(0)
+
+void lora_work_start();                  // after initLmic: schedule doWork
+void lora_work_event(ev_t);              // EV_TXSTART, EV_JOINED,
+                                         // EV_TXCOMPLETE and EV_TXCANCELED,
+                                         // from onLmicEvent
+int16_t getSnrTenfold();                 // of the last frame received
+int16_t getRssi(int8_t snr);             // (dBm)
+
+// provided by the LMIC side (ttn-lora.cpp on the unPhone, the fakes in
+// host-test/)
+void lora_work_wake();                   // notify the LoRa task (any task)
+void lora_work_show(ostime_t, const char *); // status line (USE_DISPLAY)
+void lora_work_sending(uint32_t);        // an uplink is going (interval ms)
+
+#endif
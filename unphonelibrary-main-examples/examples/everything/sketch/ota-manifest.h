@@ -0,0 +1,227 @@
+// ota-manifest.h
+// parsing for OTA firmware manifests, and the bookkeeping for resuming an
+// image download with HTTP Range requests. a manifest is a few lines of
+// text (as written by ota-tool.py):
+//
+//   version 3
+//   size 1234567
+//   sha256 <64 hex digits: the hash of the .bin>
+//   patch <from version> <size> <sha256 of the .patch>   (zero or more)
+//   sig <hex: DER ECDSA P-256 signature of all the text before this line>
+//
+// patch lines describe N-<from>.patch files, which turn the image of an
+// earlier version into this one (see ota-patch.h)
+//
+// no crypto, networking or hardware dependencies: joinme.cpp checks the
+// signature and hashes the image (see host-test/ota-manifest-test.cpp)
+
+#ifndef OTA_MANIFEST_H
+#define OTA_MANIFEST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef OTA_MANIFEST_MAX
+#  define OTA_MANIFEST_MAX 768    // max manifest bytes
+#endif
+#ifndef OTA_PATCHES_MAX
+#  define OTA_PATCHES_MAX  4      // patch lines kept
+#endif
+#define OTA_SIG_MAX        72     // DER ECDSA P-256 signatures are <= 72
+
+typedef struct {
+  int from;                       // the version the patch applies to
+  uint32_t size;                  // patch bytes
+  uint8_t sha256[32];             // patch hash
+} ota_patch_ref_t;
+
+typedef struct {
+  int version;
+  uint32_t size;                  // image bytes
+  uint8_t sha256[32];             // image hash
+  ota_patch_ref_t patches[OTA_PATCHES_MAX];
+  uint8_t patchCount;
+  uint8_t sig[OTA_SIG_MAX];       // signature...
+  uint8_t sigLen;
+  uint16_t signedLen;             // ...over this many bytes of the text
+} ota_manifest_t;
+
+// hex digits to bytes; the number of bytes, or -1 if malformed or too long
+static inline int ota_unhex(
+  const char *s, size_t len, uint8_t *out, size_t max
+) {
+  if(len % 2 != 0 || len / 2 > max) return -1;
+  for(size_t i = 0; i < len; i++) {
+    char c = s[i];
+    uint8_t v;
+    if(c >= '0' && c <= '9')      v = c - '0';
+    else if(c >= 'a' && c <= 'f') v = c - 'a' + 10;
+    else if(c >= 'A' && c <= 'F') v = c - 'A' + 10;
+    else return -1;
+    if(i % 2 == 0) out[i / 2] = v << 4; else out[i / 2] |= v;
+  }
+  return len / 2;
+}
+
+// parse manifest text; false unless it has a version, size and hash, and
+// a signature (last)
+static inline bool ota_manifest_parse(
+  const char *text, size_t len, ota_manifest_t *m
+) {
+  if(len > OTA_MANIFEST_MAX) return false;
+  memset(m, 0, sizeof(*m));
+  bool gotVersion = false, gotSize = false, gotHash = false;
+  size_t pos = 0;
+  while(pos < len) {
+    size_t end = pos;
+    while(end < len && text[end] != '\n') end++;
+    size_t lineLen = end - pos;
+    if(lineLen > 0 && text[end - 1] == '\r') lineLen--;
+    const char *line = text + pos;
+    const char *space = (const char *) memchr(line, ' ', lineLen);
+
+    if(space != NULL) {
+      size_t keyLen = space - line;
+      const char *val = space + 1;
+      size_t valLen = lineLen - keyLen - 1;
+      char num[12];                                  // (for atoi/strtoul)
+      size_t numLen = valLen < sizeof(num) - 1 ? valLen : sizeof(num) - 1;
+      memcpy(num, val, numLen);
+      num[numLen] = '\0';
+
+      if(keyLen == 7 && memcmp(line, "version", 7) == 0) {
+        m->version = atoi(num);
+        gotVersion = m->version > 0;
+      } else if(keyLen == 4 && memcmp(line, "size", 4) == 0) {
+        m->size = strtoul(num, NULL, 10);
+        gotSize = m->size > 0;
+      } else if(keyLen == 6 && memcmp(line, "sha256", 6) == 0) {
+        gotHash = ota_unhex(val, valLen, m->sha256, 32) == 32;
+      } else if(
+        keyLen == 5 && memcmp(line, "patch", 5) == 0 &&
+        m->patchCount < OTA_PATCHES_MAX
+      ) {
+        ota_patch_ref_t *r = &m->patches[m->patchCount];
+        char *rest;
+        r->from = strtol(val, &rest, 10);
+        if(*rest != ' ') return false;
+        r->size = strtoul(rest + 1, &rest, 10);
+        if(*rest != ' ') return false;
+        rest++;
+        size_t hexLen = valLen - (rest - val);
+        if(
+          r->from <= 0 || r->size == 0 ||
+          ota_unhex(rest, hexLen, r->sha256, 32) != 32
+        )
+          return false;
+        m->patchCount++;
+      } else if(keyLen == 3 && memcmp(line, "sig", 3) == 0) {
+        int n = ota_unhex(val, valLen, m->sig, OTA_SIG_MAX);
+        if(n <= 0) return false;
+        m->sigLen = n;
+        m->signedLen = pos;
+        return gotVersion && gotSize && gotHash; // (anything after is ignored)
+      }
+    }
+    pos = end + 1;
+  }
+  return false;
+}
+
+// the patch from version from, or NULL
+static inline const ota_patch_ref_t *ota_manifest_patch(
+  const ota_manifest_t *m, int from
+) {
+  for(uint8_t i = 0; i < m->patchCount; i++)
+    if(m->patches[i].from == from) return &m->patches[i];
+  return NULL;
+}
+
+// where a download should carry on from: given the response to a request
+// for bytes done onwards (with a Range header when done > 0), the number of
+// leading bytes of the body to discard (non-zero when a server ignores Range
+// and sends the whole image with a 200), or -1 if the response is no use
+static inline int32_t ota_resume_skip(
+  int code, const char *contentRange, uint32_t done, uint32_t size
+) {
+  if(code == 200) return done;
+  if(code != 206 || contentRange == NULL) return -1;
+
+  // Content-Range: bytes first-last/total
+  if(strncmp(contentRange, "bytes ", 6) != 0) return -1;
+  char *rest;
+  uint32_t first = strtoul(contentRange + 6, &rest, 10);
+  if(*rest != '-') return -1;
+  strtoul(rest + 1, &rest, 10);
+  if(*rest != '/') return -1;
+  if(rest[1] != '*' && strtoul(rest + 1, NULL, 10) != size) return -1;
+  if(first > done) return -1;     // (a gap: we can't use this)
+  return done - first;
+}
+
+// a resumable download's bookkeeping (joinme.cpp's otaFetch does the HTTP):
+// begin, then for each request pass its response to ota_resume_response,
+// read ota_resume_want bytes at a time and put them through ota_resume_take,
+// which drops any the server resent and counts the rest as done; when a
+// request ends short, ota_resume_ended says whether (and when) to try again
+typedef struct {
+  uint32_t size, done;            // image bytes, and bytes kept so far
+  uint32_t before;                // done when this request began
+  int32_t skip;                   // body bytes still to discard
+  uint8_t resumes;                // requests that carried on from a drop
+  uint8_t retries;                // requests in a row that got nothing
+} ota_resume_t;
+
+static inline void ota_resume_begin(ota_resume_t *r, uint32_t size) {
+  memset(r, 0, sizeof(*r));
+  r->size = size;
+}
+
+// a response to a request for bytes done onwards; false if it's no use
+static inline bool ota_resume_response(
+  ota_resume_t *r, int code, const char *contentRange
+) {
+  r->before = r->done;
+  r->skip = ota_resume_skip(code, contentRange, r->done, r->size);
+  return r->skip >= 0;
+}
+
+// how much to read next, given avail bytes waiting and a buffer of max
+// (never past the end of the image)
+static inline size_t ota_resume_want(
+  const ota_resume_t *r, size_t avail, size_t max
+) {
+  size_t want = r->size - r->done + r->skip;
+  if(want > avail) want = avail;
+  if(want > max) want = max;
+  return want;
+}
+
+// n bytes were read into *p: moves *p past any to discard, and returns how
+// many of the rest are new (and now counted as done)
+static inline size_t ota_resume_take(
+  ota_resume_t *r, const uint8_t **p, size_t n
+) {
+  if(r->skip > 0) {
+    size_t s = (size_t) r->skip < n ? (size_t) r->skip : n;
+    *p += s; n -= s; r->skip -= s;
+  }
+  if(n > r->size - r->done) n = r->size - r->done;
+  r->done += n;
+  return n;
+}
+
+// a request ended before the image did: -1 to give up (more than
+// maxRetries in a row made no progress), else seconds to wait first
+static inline int ota_resume_ended(ota_resume_t *r, uint8_t maxRetries) {
+  if(r->done > r->before) {
+    r->retries = 0;
+    r->resumes++;
+    return 0;
+  }
+  if(++r->retries > maxRetries) return -1;
+  return r->retries;
+}
+
+#endif
@@ -0,0 +1,144 @@
+// ota-patch.h
+// a streaming applier for bsdiff-style firmware patches (as made by
+// ota-tool.py): the new image is built from the old (running) one as the
+// patch arrives, in any size of pieces, using a fixed 256 byte buffer. the
+// (uncompressed) patch format, all integers little endian, is:
+//
+//   "OTP1", old image size (u32), new image size (u32), then records of
+//   diff length (u32), extra length (u32), seek (i32), diff bytes, extra
+//   bytes; each diff byte is added to the next old byte to give a new one,
+//   extra bytes are new bytes as is, and after each record the old position
+//   moves on by seek
+//
+// on the wire the patch is zlib compressed (joinme.cpp inflates it). no
+// hardware dependencies: old bytes are read, and new ones written, by
+// callbacks (see host-test/ota-patch-test.cpp)
+
+#ifndef OTA_PATCH_H
+#define OTA_PATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef OTA_PATCH_BUF
+#  define OTA_PATCH_BUF 256       // old image bytes read at once
+#endif
+
+// read len bytes of the old image from offset; write len bytes of the new
+// image (in order); false on failure
+typedef bool (*ota_patch_read_t)(uint32_t, uint8_t *, size_t, void *);
+typedef bool (*ota_patch_write_t)(const uint8_t *, size_t, void *);
+
+class OtaPatch {
+  typedef enum { HEADER, RECORD, DIFF, EXTRA, DONE, FAILED } state_t;
+  static const uint8_t HEADER_LEN = 12, RECORD_LEN = 12;
+
+  ota_patch_read_t readOld;
+  ota_patch_write_t writeNew;
+  void *ctx;
+  uint32_t oldLimit;              // size of the space the old image is in
+  state_t state = HEADER;
+  uint8_t hdr[12];                // (header or record being collected)
+  uint8_t hdrLen = 0;
+  uint32_t oldSize = 0, newSize = 0, oldPos = 0, newPos = 0;
+  uint32_t diffLeft = 0, extraLeft = 0;
+  int32_t seek = 0;
+  const char *err = NULL;
+  uint8_t buf[OTA_PATCH_BUF];
+
+  static uint32_t u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+  }
+  bool fail(const char *why) { state = FAILED; err = why; return false; }
+
+  // a header or record is complete
+  bool parsed() {
+    hdrLen = 0;
+    if(state == HEADER) {
+      if(hdr[0] != 'O' || hdr[1] != 'T' || hdr[2] != 'P' || hdr[3] != '1')
+        return fail("not a patch");
+      oldSize = u32(hdr + 4);
+      newSize = u32(hdr + 8);
+      if(oldSize > oldLimit) return fail("patch is for a bigger image");
+      state = newSize == 0 ? DONE : RECORD;
+      return true;
+    }
+    diffLeft = u32(hdr);
+    extraLeft = u32(hdr + 4);
+    seek = (int32_t) u32(hdr + 8);
+    if(
+      (uint64_t) newPos + diffLeft + extraLeft > newSize ||
+      (uint64_t) oldPos + diffLeft > oldSize
+    )
+      return fail("patch record out of range");
+    state = diffLeft > 0 ? DIFF : EXTRA;
+    return endOfRecord();
+  }
+
+  // move on if the current record is used up
+  bool endOfRecord() {
+    if(state == DIFF && diffLeft == 0) state = EXTRA;
+    if(state != EXTRA || extraLeft > 0) return true;
+    int64_t pos = (int64_t) oldPos + seek;
+    if(pos < 0 || pos > oldSize) return fail("patch seeks out of range");
+    oldPos = pos;
+    state = newPos == newSize ? DONE : RECORD;
+    return true;
+  }
+
+public:
+  // oldLimit: the size of the partition holding the old image
+  OtaPatch(
+    ota_patch_read_t r, ota_patch_write_t w, void *context, uint32_t oldLimit
+  ) : readOld(r), writeNew(w), ctx(context), oldLimit(oldLimit) { }
+
+  // the next n bytes of patch; false on error (see error())
+  bool feed(const uint8_t *p, size_t n) {
+    while(n > 0) {
+      switch(state) {
+        case HEADER:
+        case RECORD:
+          hdr[hdrLen++] = *p++;
+          n--;
+          if(hdrLen == (state == HEADER ? HEADER_LEN : RECORD_LEN) && !parsed())
+            return false;
+          break;
+
+        case DIFF: {
+          size_t len = n < diffLeft ? n : diffLeft;
+          if(len > OTA_PATCH_BUF) len = OTA_PATCH_BUF;
+          if(!readOld(oldPos, buf, len, ctx))
+            return fail("can't read old image");
+          for(size_t i = 0; i < len; i++) buf[i] += p[i];
+          if(!writeNew(buf, len, ctx)) return fail("can't write new image");
+          p += len; n -= len;
+          oldPos += len; newPos += len; diffLeft -= len;
+          if(!endOfRecord()) return false;
+          break;
+        }
+
+        case EXTRA: {
+          size_t len = n < extraLeft ? n : extraLeft;
+          if(!writeNew(p, len, ctx)) return fail("can't write new image");
+          p += len; n -= len;
+          newPos += len; extraLeft -= len;
+          if(!endOfRecord()) return false;
+          break;
+        }
+
+        case DONE:
+          return fail("data after the end of the patch");
+        case FAILED:
+          return false;
+      }
+    }
+    return true;
+  }
+
+  bool done() const { return state == DONE; }
+  const char *error() const { return err; }
+  uint32_t oldImageSize() const { return oldSize; }  // (once the header's in)
+  uint32_t written() const { return newPos; }
+};
+
+#endif
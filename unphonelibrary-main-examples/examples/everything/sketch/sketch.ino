@@ -2,14 +2,17 @@
 
 #include <Arduino.h>
 #include <freertos/task.h>
+#include <freertos/event_groups.h>
+#include <freertos/timers.h>
 #include <Update.h>
 #include <WiFi.h>
-#include <WiFiMulti.h>
 #include <WiFiManager.h> // force inclusion to fix pio LDF WebServer.h issue
 #include <HTTPClient.h>
 #include <ESPmDNS.h>
 #include "private.h"
 #include "unphone.h"
+#include "lora-payload.h"
+#include "wifi-state.h"
 #include <Adafruit_EPD.h>
 
 unPhone u = unPhone();
@@ -19,18 +22,63 @@ String apPassword = _DEFAULT_AP_KEY;     // passkey for the AP
 char BUILD_TIME[] = (__DATE__ " at " __TIME__); // build data
 
 bool useWifi = true;
-WiFiMulti wifiMulti;
 HTTPClient http;
 int firmwareVersion = 1; // keep up-to-date! (used to check for updates)
-static uint32_t loopIter = 0;   // time slicing iterator
+
+// loop() blocks on these events instead of spinning
+static EventGroupHandle_t loopEvents;
+static const EventBits_t SEND_TELEMETRY   = 1 << 0; // send a TTN message
+static const EventBits_t FACTORY_MODE     = 1 << 1; // run the factory tests
+static const EventBits_t PRINT_TASK_STATS = 1 << 2; // per-task CPU use
+static const EventBits_t SAMPLE_SENSORS   = 1 << 3; // batch some readings
+static const EventBits_t WEB_SNAPSHOT     = 1 << 4; // telemetry for httpd
+static const EventBits_t BATTERY_REPLY    = 1 << 5; // answer a C2 downlink
+static const EventBits_t LOOP_EVENTS =
+  SEND_TELEMETRY | FACTORY_MODE | PRINT_TASK_STATS | SAMPLE_SENSORS |
+  WEB_SNAPSHOT | BATTERY_REPLY;
+static const uint32_t SAMPLE_MS = 60 * 1000;        // reading interval
+static const uint32_t SECOND_TELEMETRY_MS = 5 * 60 * 1000; // 2nd msg after
+static const uint32_t WEB_SNAPSHOT_MS = 2000;        // default /events rate
+static const uint32_t OTA_CHECK_MS = 6 * 60 * 60 * 1000; // firmware checks
+#ifndef OTA_AUTO_INSTALL    // 1: install updates at once, rather than...
+#  define OTA_AUTO_INSTALL 0 // ...when the firmware line on Home is tapped
+#endif
+static const char OTA_PATH[] = "examples%2FBigDemoIDF%2Ffirmware%2F";
+#ifndef TASK_STATS_SECONDS  // set (e.g.) to 60 in platformio.ini to see...
+#  define TASK_STATS_SECONDS 0 // ...per-task CPU use periodically; 0 = off
+#endif
+static uint8_t telemetrySent = 0;            // number of messages sent
+enum telemetry_channel_t {     // LPP channels of our telemetry uplinks
+  CH_SPIN = 1, CH_FIRST, CH_VBAT, CH_USB, CH_ACCEL, CH_EMPTY_MINS
+};
+void sendTelemetry();
+enum batch_channel_t {         // lora-batch.h channels of our readings
+  BC_VBAT_MV = 0, BC_TEMP_DECIC, BC_ACCEL_X_MG, BC_ACCEL_Y_MG, BC_ACCEL_Z_MG
+};
+void sampleSensors();
+
+// downlink commands (on unPhone::LORA_CMD_PORT) handled by the sketch
+static const uint8_t BATTERY_CMD = 0xC2;     // C2: uplink battery stats
+static const uint8_t UI_MODE_CMD = 0xC3;     // C3 mm: switch to screen mm
+void onBatteryCmd(const uint8_t *, uint8_t, void *);
+void sendBatteryReply();
+void onUIModeCmd(const uint8_t *, uint8_t, void *);
+static void setLoopEvent(TimerHandle_t t) {  // timer callback: wake loop()
+  EventBits_t event = (EventBits_t) (uintptr_t) pvTimerGetTimerID(t);
+  xEventGroupSetBits(loopEvents, event);
+}
 void wifiSetup();               // TODO move to unPhone?
-void wifiConnectTask(void *);   // TODO move to unPhone?
-void initWebServer();           // TODO move to unPhone?
+void onWiFiState(const wifi_event_t *); // (on the wifi task)
+void otaTask(void *);           // firmware update checks (joinme.cpp)
+void onOtaWiFiState(const wifi_event_t *); // wakes otaTask when online
+void initWebServer(TimerHandle_t); // TODO move to unPhone?
+void webSnapshot();             // (httpd.cpp)
 
 void setup() { ///////////////////////////////////////////////////////////////
   // say hi, init, blink etc.
   Serial.begin(115200);
   Serial.printf("Starting build from: %s\n", BUILD_TIME);
+  loopEvents = xEventGroupCreate();
   u.begin();
   u.store(BUILD_TIME);
   apSSID.concat(u.getMAC()); // add the MAC to the AP SSID
@@ -72,7 +120,10 @@ delay(2000);
   // if all three buttons pressed, go into factory test mode
   if(u.button1() && u.button2() && u.button3()) {
     u.factoryTestMode(true);
+    u.spiLock(); // the LoRa task is running: share the bus
     u.factoryTestSetup();
+    u.spiUnlock();
+    xEventGroupSetBits(loopEvents, FACTORY_MODE);
     return;
   }
 
@@ -103,7 +154,7 @@ delay(2000);
   /*
   TODO
   (this is the old provisioning cycle, but we've replaced it temporarily with
-  wifiMulti as below)
+  wifi.cpp's connection manager as below)
 
   // wifi provisioning
   Serial.printf("doing wifi manager\n");
@@ -117,14 +168,7 @@ delay(2000);
   initWebServer();
   Serial.printf("firmware is at version %d\n", firmwareVersion);
 
-  // check for and perform firmware updates as needed
-  delay(2000); // let wifi settle
-  uiCont->message("(firmware update check)");
-  joinmeOTAUpdate(
-    firmwareVersion, _GITLAB_PROJ_ID, "", // use _GITLAB_TOKEN if private repo
-    "examples%2FBigDemoIDF%2Ffirmware%2F"
-  );
-  uiCont->message("");
+  // (firmware updates are now checked for in the background: see otaTask)
   if(!MDNS.begin("sketch"))
     Serial.println("Error setting up MDNS responder!");
   */
@@ -135,99 +179,199 @@ delay(2000);
     u.vibe(false); delay(150);
   }
   u.printStore(); // print out stored messages
+#ifdef _OTA_PUBLIC_KEY
+  joinmeOTAKey(_OTA_PUBLIC_KEY); // OTA only installs images signed with this
+#endif
 
   // get a connection
   if(useWifi) {
     // run the wifi connection task
     Serial.println("trying to connect to wifi...");
     wifiSetup();
-    xTaskCreate(wifiConnectTask, "wifi connect task", 4096, NULL, 1, NULL);
+    wifiListen(onWiFiState);
+#if defined(_GITLAB_PROJ_ID) && defined(_OTA_PUBLIC_KEY)
+    u.startTask(unPhone::TASK_OTA, otaTask);
+    wifiListen(onOtaWiFiState);
+#endif
+    wifiBegin();
   }
   u.provisioned();
 
+  // handle our own downlink commands (the counter reset and interval
+  // commands are built in)
+  u.loraOnDownlink(unPhone::LORA_CMD_PORT, BATTERY_CMD, onBatteryCmd);
+  u.loraOnDownlink(unPhone::LORA_CMD_PORT, UI_MODE_CMD, onUIModeCmd, 1);
+
+  // send a couple of TTN messages for testing purposes: one now, one later
+  xEventGroupSetBits(loopEvents, SEND_TELEMETRY);
+  xTimerStart(xTimerCreate(
+    "telemetry", pdMS_TO_TICKS(SECOND_TELEMETRY_MS), pdFALSE,
+    (void *) (uintptr_t) SEND_TELEMETRY, setLoopEvent
+  ), 0);
+  xTimerStart(xTimerCreate(
+    "sample", pdMS_TO_TICKS(SAMPLE_MS), pdTRUE,
+    (void *) (uintptr_t) SAMPLE_SENSORS, setLoopEvent
+  ), 0);
+  if(TASK_STATS_SECONDS > 0)
+    xTimerStart(xTimerCreate(
+      "task stats", pdMS_TO_TICKS(TASK_STATS_SECONDS * 1000), pdTRUE,
+      (void *) (uintptr_t) PRINT_TASK_STATS, setLoopEvent
+    ), 0);
+
   Serial.println("done with setup()");
 }
 
 void loop() { ////////////////////////////////////////////////////////////////
-  if(u.factoryTestMode()) { u.factoryTestLoop(); return; }
+  // block (so this core can idle) until there's something to do
+  EventBits_t events = xEventGroupWaitBits(
+    loopEvents, LOOP_EVENTS, pdFALSE, pdFALSE, portMAX_DELAY
+  );
+  if(events & FACTORY_MODE) { // (stays set)
+    u.spiLock(); u.factoryTestLoop(); u.spiUnlock();
+    return;
+  }
+  xEventGroupClearBits(loopEvents, events);
 
-  // send a couple of TTN messages for testing purposes
-  if(loopIter++ == 0)
-    u.loraSend("first time: UNPHONE_SPIN=%d MAC=%s", UNPHONE_SPIN, u.getMAC());
-  else if(loopIter == 20000000)
-    u.loraSend("20000000: UNPHONE_SPIN=%d MAC=%s", UNPHONE_SPIN, u.getMAC());
+  if(events & SEND_TELEMETRY)
+    sendTelemetry();
+  if(events & SAMPLE_SENSORS)
+    sampleSensors();
+  if(events & WEB_SNAPSHOT)
+    webSnapshot();
+  if(events & BATTERY_REPLY)
+    sendBatteryReply();
+  if(events & PRINT_TASK_STATS) {
+    u.printTaskStats();
+    u.printTaskStacks();
+  }
+}
+
+void sendTelemetry() { ///////////////////////////////////////////////////////
+  // binary (LPP) rather than text: 21 bytes instead of ~50, so less airtime
+  // (TTN knows our device EUI, so there's no need to send the MAC)
+  LoraPayload p;
+  p.addDigital(CH_SPIN, UNPHONE_SPIN);
+  p.addDigital(CH_FIRST, telemetrySent++ == 0);
+  p.addVoltage(CH_VBAT, u.batteryVoltageSmoothed());
+  p.addDigital(CH_USB, u.usbPowerConnected());
+  sensors_event_t e;
+  u.getAccelEvent(&e);
+  p.addAccel(CH_ACCEL, e.acceleration.x / SENSORS_GRAVITY_STANDARD,
+    e.acceleration.y / SENSORS_GRAVITY_STANDARD,
+    e.acceleration.z / SENSORS_GRAVITY_STANDARD);
+  u.loraSendBytes(unPhone::LORA_LPP_PORT, p.data(), p.size());
+}
 
-  if(loopIter % 25000 == 0) // allow IDLE; 100 is min to allow it to fire:
-    delay(100);  // https://github.com/espressif/arduino-esp32/issues/6946
+void sampleSensors() { ///////////////////////////////////////////////////////
+  // small readings go into a batch that's sent as one frame every 15 mins or
+  // so (or when full), rather than one uplink per reading
+  u.loraBatchAdd(BC_VBAT_MV, u.batteryVoltageSmoothed() * 1000);
+  u.loraBatchAdd(BC_TEMP_DECIC, temperatureRead() * 10); // (the ESP32's)
+  sensors_event_t e;
+  u.getAccelEvent(&e);
+  const float mG = 1000 / SENSORS_GRAVITY_STANDARD;
+  u.loraBatchAdd(BC_ACCEL_X_MG, e.acceleration.x * mG);
+  u.loraBatchAdd(BC_ACCEL_Y_MG, e.acceleration.y * mG);
+  u.loraBatchAdd(BC_ACCEL_Z_MG, e.acceleration.z * mG);
+}
+
+// downlink handlers: these run in the LoRa task (holding the SPI lock), so
+// they only queue work; reading the battery (over I²C) is left to loop()
+void onBatteryCmd(const uint8_t *args, uint8_t len, void *ctx) { /////////////
+  xEventGroupSetBits(loopEvents, BATTERY_REPLY);
+}
+void sendBatteryReply() { ////////////////////////////////////////////////////
+  LoraPayload p;
+  p.addVoltage(CH_VBAT, u.batteryVoltageSmoothed());
+  p.addDigital(CH_USB, u.usbPowerConnected());
+  int32_t secs = u.batterySecsToEmpty();      // -1 (0xFFFF) if unknown
+  p.addU16(CH_EMPTY_MINS, secs < 0 ? 0xFFFF : min(secs / 60, (int32_t) 0xFFFE));
+  // someone asked, so make sure it arrives: confirmed (retried until the
+  // network ACKs it, see lora-delivery.h) and ahead of routine telemetry
+  u.loraSendBytes(unPhone::LORA_LPP_PORT, p.data(), p.size(), true, 1);
+}
+void onUIModeCmd(const uint8_t *args, uint8_t len, void *ctx) { //////////////
+  u.uiMode(args[0]);
 }
 
 void wifiSetup() { ///////////////////////////////////////////////////////////
 // TODO move these to a credentials store, manage with WifiMgr
 #ifdef _MULTI_SSID1
-  Serial.printf("wifiMulti.addAP %s\n", _MULTI_SSID1);
-  wifiMulti.addAP(_MULTI_SSID1, _MULTI_KEY1);
+  Serial.printf("wifiAddAP %s\n", _MULTI_SSID1);
+  wifiAddAP(_MULTI_SSID1, _MULTI_KEY1);
 #endif
 #ifdef _MULTI_SSID2
-  Serial.printf("wifiMulti.addAP %s\n", _MULTI_SSID2);
-  wifiMulti.addAP(_MULTI_SSID2, _MULTI_KEY2);
+  Serial.printf("wifiAddAP %s\n", _MULTI_SSID2);
+  wifiAddAP(_MULTI_SSID2, _MULTI_KEY2);
 #endif
 #ifdef _MULTI_SSID3
-  Serial.printf("wifiMulti.addAP %s\n", _MULTI_SSID3);
-  wifiMulti.addAP(_MULTI_SSID3, _MULTI_KEY3);
+  Serial.printf("wifiAddAP %s\n", _MULTI_SSID3);
+  wifiAddAP(_MULTI_SSID3, _MULTI_KEY3);
 #endif
 #ifdef _MULTI_SSID4
-  Serial.printf("wifiMulti.addAP %s\n", _MULTI_SSID4);
-  wifiMulti.addAP(_MULTI_SSID4, _MULTI_KEY4);
+  Serial.printf("wifiAddAP %s\n", _MULTI_SSID4);
+  wifiAddAP(_MULTI_SSID4, _MULTI_KEY4);
 #endif
 #ifdef _MULTI_SSID5
-  Serial.printf("wifiMulti.addAP %s\n", _MULTI_SSID5);
-  wifiMulti.addAP(_MULTI_SSID5, _MULTI_KEY5);
+  Serial.printf("wifiAddAP %s\n", _MULTI_SSID5);
+  wifiAddAP(_MULTI_SSID5, _MULTI_KEY5);
 #endif
 #ifdef _MULTI_SSID6
-  Serial.printf("wifiMulti.addAP %s\n", _MULTI_SSID6);
-  wifiMulti.addAP(_MULTI_SSID6, _MULTI_KEY6);
+  Serial.printf("wifiAddAP %s\n", _MULTI_SSID6);
+  wifiAddAP(_MULTI_SSID6, _MULTI_KEY6);
 #endif
 #ifdef _MULTI_SSID7
-  Serial.printf("wifiMulti.addAP %s\n", _MULTI_SSID7);
-  wifiMulti.addAP(_MULTI_SSID7, _MULTI_KEY7);
+  Serial.printf("wifiAddAP %s\n", _MULTI_SSID7);
+  wifiAddAP(_MULTI_SSID7, _MULTI_KEY7);
 #endif
 #ifdef _MULTI_SSID8
-  Serial.printf("wifiMulti.addAP 8\n");
-  wifiMulti.addAP(_MULTI_SSID8, _MULTI_KEY8);
+  Serial.printf("wifiAddAP 8\n");
+  wifiAddAP(_MULTI_SSID8, _MULTI_KEY8);
 #endif
 }
 
-static bool wifiConnected = false; ///////////////////////////////////////////
-void wifiConnectTask(void *param) {
-/* TODO probably time to start using std:: to manage this!
-#include <string>
-#include <map>
-#include <iterator>
-using namespace std;
-map<string, string> ssidMap;
-ssidMap.insert(make_pair(_MULTI_SSID1, _MULTI_KEY1));
-...
-map<string, string>::iterator it = ssidMap.begin();
-for (pair<string, string> element : ssidMap) {
-  string name = element.first;
-  string key = element.second;
-  Serial.printf("wifiMulti.addAP %s\n", name);
-  wifiMulti.addAP(name, key);
+void onWiFiState(const wifi_event_t *e) { /////////////////////////////////////
+  // serve the web UI and telemetry API once we're first on the network (the
+  // UI notices state changes itself, and redraws just its wifi lines)
+  static bool serving = false;
+  if(e->state == WIFI_CONNECTED && !serving) {
+    serving = true;
+    initWebServer(xTimerCreate(
+      "web snapshot", pdMS_TO_TICKS(WEB_SNAPSHOT_MS), pdTRUE,
+      (void *) (uintptr_t) WEB_SNAPSHOT, setLoopEvent
+    ));
+  }
 }
-*/
+
+#if defined(_GITLAB_PROJ_ID) && defined(_OTA_PUBLIC_KEY)
+void otaTask(void *param) { //////////////////////////////////////////////////
+  // check for newer firmware once we're online and every few hours after
+  // (cheaply: see joinmeOTACheck); Home shows what's available, and a tap
+  // on its firmware line wakes us to install it. offline, we sleep until
+  // onOtaWiFiState says we've connected
+  uint32_t woken = 0;
   while(true) {
-    bool previousWifiState = wifiConnected;
-    if(wifiMulti.run() == WL_CONNECTED)
-      wifiConnected = true;
-    else
-      wifiConnected = false;
-
-    // call back to UI controller if state has changed
-    if(previousWifiState != wifiConnected) {
-      previousWifiState = wifiConnected;
-      u.provisioned();
+    bool online = wifiStatus().state == WIFI_CONNECTED;
+    if(online) {
+      int latest = joinmeOTACheck( // (use _GITLAB_TOKEN if private repo)
+        firmwareVersion, _GITLAB_PROJ_ID, "", OTA_PATH
+      );
+      bool install = (woken & JOINME_OTA_WAKE_INSTALL) || OTA_AUTO_INSTALL;
+      if(latest > firmwareVersion && install)
+        joinmeOTAUpdate(firmwareVersion, _GITLAB_PROJ_ID, "", OTA_PATH);
     }
-
-    delay(1000);
+    woken = 0;
+    xTaskNotifyWait(                   // (6h overflows pdMS_TO_TICKS)
+      0, UINT32_MAX, &woken,
+      online ? OTA_CHECK_MS / portTICK_PERIOD_MS : portMAX_DELAY
+    );
   }
 }
+
+void onOtaWiFiState(const wifi_event_t *e) { //////////////////////////////////
+  // (on the WiFi task) wake otaTask to check as soon as we're online
+  TaskHandle_t ota = unPhone::tasks[unPhone::TASK_OTA].handle;
+  if(e->state == WIFI_CONNECTED && ota != NULL)
+    xTaskNotify(ota, JOINME_OTA_WAKE_ONLINE, eSetBits);
+}
+#endif
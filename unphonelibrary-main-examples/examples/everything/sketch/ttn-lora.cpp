@@ -14,8 +14,6 @@
 
 #include "unphone.h"
 static unPhone &u = unPhone::me();
-static char lora_payload[unPhone::LORA_PAYLOAD_LEN];
-static bool lora_payload_ready = false;
 
 //////////////////////////////////////////////////////////////////////////////
 // ttn-lora.cpp //////////////////////////////////////////////////////////////
@@ -49,8 +47,11 @@ static bool lora_payload_ready = false;
 //////////////////////////////////////////////////////////////////////////////
 
 #include <Arduino.h>
+#include <Preferences.h>
+#include <esp_attr.h>
 #include "lmic.h"
 #include "hal/hal.h"
+#include "lora-work.h"
 #ifdef USE_DISPLAY
     #include <Wire.h>
     #include "U8x8lib.h"
@@ -63,31 +64,14 @@ enum class InitType { Hardware, PostInitSerial };
 enum class PrintTarget { All, Serial, Display };
 
 const dr_t DefaultABPDataRate = DR_SF7;
-const s1_t DefaultABPTxPower =  14;
 
 // Forward declarations
-static void doWorkCallback(osjob_t* job);
-void processWork(ostime_t timestamp);
-void processDownlink(ostime_t eventTimestamp, uint8_t fPort, uint8_t* data, uint8_t dataLength);
 void onLmicEvent(void *pUserData, ev_t ev);
 void displayTxSymbol(bool visible);
 
-#ifndef DO_WORK_INTERVAL_SECONDS            // Should be set in platformio.ini
-// HC changed to a min:
-//   #define DO_WORK_INTERVAL_SECONDS 300   // Default 5 minutes if not set
-     #define DO_WORK_INTERVAL_SECONDS 60    // Default to a min if not set
-#endif    
-
 #define TIMESTAMP_WIDTH 12 // Number of columns to display eventtime (zero-padded)
 #define MESSAGE_INDENT TIMESTAMP_WIDTH + 3
 
-// Determine which LMIC library is used
-#ifdef _LMIC_CONFIG_PRECONDITIONS_H_   
-    #define MCCI_LMIC
-#else
-    #define CLASSIC_LMIC
-#endif    
-
 #if !defined(ABP_ACTIVATION) && !defined(OTAA_ACTIVATION)
     #define OTAA_ACTIVATION
 #endif
@@ -555,17 +539,9 @@ bool boardInit(InitType initType)
 //  ▀▀▀ ▀▀▀ ▀▀▀ ▀ ▀   ▀▀▀ ▀▀▀ ▀▀  ▀▀▀   ▀▀  ▀▀▀ ▀▀▀ ▀▀▀ ▀ ▀
 
 
-const uint8_t payloadBufferLength = unPhone::LORA_PAYLOAD_LEN;
-
+// (the uplink pipeline, from the payload buffer to the doWork job, is in
+// lora-work.cpp)
 
-//  █ █ █▀▀ █▀▀ █▀▄   █▀▀ █▀█ █▀▄ █▀▀   █▀▀ █▀█ █▀▄
-//  █ █ ▀▀█ █▀▀ █▀▄   █   █ █ █ █ █▀▀   █▀▀ █ █ █ █
-//  ▀▀▀ ▀▀▀ ▀▀▀ ▀ ▀   ▀▀▀ ▀▀▀ ▀▀  ▀▀▀   ▀▀▀ ▀ ▀ ▀▀ 
-
-
-uint8_t payloadBuffer[payloadBufferLength];
-static osjob_t doWorkJob;
-uint32_t doWorkIntervalSeconds = DO_WORK_INTERVAL_SECONDS;  // Change value in platformio.ini
 
 // Note: LoRa module pin mappings are defined in the Board Support Files.
 
@@ -590,65 +566,6 @@ uint32_t doWorkIntervalSeconds = DO_WORK_INTERVAL_SECONDS;  // Change value in p
 #endif
 
 
-int16_t getSnrTenfold()
-{
-    // Returns ten times the SNR (dB) value of the last received packet.
-    // Ten times to prevent the use of float but keep 1 decimal digit accuracy.
-    // Calculation per SX1276 datasheet rev.7 §6.4, SX1276 datasheet rev.4 §6.4.
-    // LMIC.snr contains value of PacketSnr, which is 4 times the actual SNR value.
-    return (LMIC.snr * 10) / 4;
-}
-
-
-int16_t getRssi(int8_t snr)
-{
-    // Returns correct RSSI (dBm) value of the last received packet.
-    // Calculation per SX1276 datasheet rev.7 §5.5.5, SX1272 datasheet rev.4 §5.5.5.
-
-    #define RSSI_OFFSET            64
-    #define SX1276_FREQ_LF_MAX     525000000     // per datasheet 6.3
-    #define SX1272_RSSI_ADJUST     -139
-    #define SX1276_RSSI_ADJUST_LF  -164
-    #define SX1276_RSSI_ADJUST_HF  -157
-
-    int16_t rssi;
-
-    #ifdef MCCI_LMIC
-
-        rssi = LMIC.rssi - RSSI_OFFSET;
-
-    #else
-        int16_t rssiAdjust;
-        #ifdef CFG_sx1276_radio
-            if (LMIC.freq > SX1276_FREQ_LF_MAX)
-            {
-                rssiAdjust = SX1276_RSSI_ADJUST_HF;
-            }
-            else
-            {
-                rssiAdjust = SX1276_RSSI_ADJUST_LF;   
-            }
-        #else
-            // CFG_sx1272_radio    
-            rssiAdjust = SX1272_RSSI_ADJUST;
-        #endif    
-        
-        // Revert modification (applied in lmic/radio.c) to get PacketRssi.
-        int16_t packetRssi = LMIC.rssi + 125 - RSSI_OFFSET;
-        if (snr < 0)
-        {
-            rssi = rssiAdjust + packetRssi + snr;
-        }
-        else
-        {
-            rssi = rssiAdjust + (16 * packetRssi) / 15;
-        }
-    #endif
-
-    return rssi;
-}
-
-
 void printEvent(ostime_t timestamp, 
                 const char * const message, 
                 PrintTarget target = PrintTarget::All,
@@ -672,26 +589,11 @@ void printEvent(ostime_t timestamp,
         }
     #endif  
     
-    #ifdef USE_SERIAL
-        // Create padded/indented output without using printf().
-        // printf() is not default supported/enabled in each Arduino core. 
-        // Not using printf() will save memory for memory constrainted devices.
-        String timeString(timestamp);
-        uint8_t len = timeString.length();
-        uint8_t zerosCount = TIMESTAMP_WIDTH > len ? TIMESTAMP_WIDTH - len : 0;
-
-        if (target == PrintTarget::All || target == PrintTarget::Serial)
-        {
-            printChars(serial, '0', zerosCount);
-            serial.print(timeString);
-            serial.print(":  ");
-            if (eventLabel)
-            {
-                serial.print(F("TTN LoRa Event: "));
-            }
-            serial.println(message);
-        }
-    #endif   
+    // (message must be a string literal: it's formatted later)
+    if (target == PrintTarget::All || target == PrintTarget::Serial)
+    {
+        LORA_LOG(LORA_LOG_INFO, LOG_TEXT, timestamp, message);
+    }
 }           
 
 void printEvent(ostime_t timestamp, 
@@ -699,9 +601,17 @@ void printEvent(ostime_t timestamp,
                 PrintTarget target = PrintTarget::All, 
                 bool clearDisplayStatusRow = true)
 {
-    #if defined(USE_DISPLAY) || defined(USE_SERIAL)
-        printEvent(timestamp, lmicEventNames[ev], target, clearDisplayStatusRow, true);
+    #ifdef USE_DISPLAY
+        if (target == PrintTarget::All || target == PrintTarget::Display)
+        {
+            printEvent(timestamp, lmicEventNames[ev], PrintTarget::Display,
+                       clearDisplayStatusRow, true);
+        }
     #endif
+    if (target == PrintTarget::All || target == PrintTarget::Serial)
+    {
+        LORA_LOG(LORA_LOG_INFO, LOG_LMIC_EVENT, timestamp, NULL, ev);
+    }
 }
 
 
@@ -719,52 +629,40 @@ void printFrameCounters(PrintTarget target = PrintTarget::All)
         }
     #endif
 
-    #ifdef USE_SERIAL
-        if (target == PrintTarget::Serial || target == PrintTarget::All)
-        {
-            printSpaces(serial, MESSAGE_INDENT);
-            serial.print(F("Up: "));
-            serial.print(LMIC.seqnoUp);
-            serial.print(F(",  Down: "));
-            serial.println(LMIC.seqnoDn);        
-        }
-    #endif        
+    if (target == PrintTarget::Serial || target == PrintTarget::All)
+    {
+        #ifdef MCCI_LMIC
+            // RX windows opened late (a sign of LMIC servicing latency)
+            LORA_LOG(LORA_LOG_INFO, LOG_COUNTERS, 0, NULL,
+                     LMIC.seqnoUp, LMIC.seqnoDn, LMIC.radio.rxlate_count,
+                     osticks2ms(LMIC.radio.rxlate_ticks));
+        #else
+            LORA_LOG(LORA_LOG_INFO, LOG_COUNTERS, 0, NULL,
+                     LMIC.seqnoUp, LMIC.seqnoDn, -1, 0);
+        #endif
+    }
 }      
 
 
 void printSessionKeys()
 {    
-    #if defined(USE_SERIAL) && defined(MCCI_LMIC)
+    // (the session keys are secrets, so they aren't logged)
+    #ifdef MCCI_LMIC
         u4_t networkId = 0;
         devaddr_t deviceAddress = 0;
         u1_t networkSessionKey[16];
         u1_t applicationSessionKey[16];
         LMIC_getSessionKeys(&networkId, &deviceAddress, 
                             networkSessionKey, applicationSessionKey);
-
-        printSpaces(serial, MESSAGE_INDENT);    
-        serial.print(F("Network Id: "));
-        serial.println(networkId, DEC);
-
-        printSpaces(serial, MESSAGE_INDENT);    
-        serial.print(F("Device Address: "));
-        serial.println(deviceAddress, HEX);
-
-        printSpaces(serial, MESSAGE_INDENT);    
-        serial.print(F("Application Session Key: "));
-        printHex(serial, applicationSessionKey, 16, true, '-');
-
-        printSpaces(serial, MESSAGE_INDENT);    
-        serial.print(F("Network Session Key:     "));
-        printHex(serial, networkSessionKey, 16, true, '-');
+        LORA_LOG(LORA_LOG_INFO, LOG_SESSION, 0, NULL,
+                 networkId, deviceAddress);
     #endif
 }
 
 
 void printDownlinkInfo(void)
 {
-    #if defined(USE_SERIAL) || defined(USE_DISPLAY)
-
+    #ifdef USE_DISPLAY
         uint8_t dataLength = LMIC.dataLen;
         // bool ackReceived = LMIC.txrxFlags & TXRX_ACK;
 
@@ -799,34 +697,10 @@ void printDownlinkInfo(void)
             display.print(snrDecimalFraction);                      
         #endif
 
-        #ifdef USE_SERIAL
-            printSpaces(serial, MESSAGE_INDENT);    
-            serial.println(F("Downlink received"));
-
-            printSpaces(serial, MESSAGE_INDENT);
-            serial.print(F("RSSI: "));
-            serial.print(rssi);
-            serial.print(F(" dBm,  SNR: "));
-            serial.print(snr);                        
-            serial.print(".");                        
-            serial.print(snrDecimalFraction);                        
-            serial.println(F(" dB"));
-
-            printSpaces(serial, MESSAGE_INDENT);    
-            serial.print(F("Port: "));
-            serial.println(fPort);
-   
-            if (dataLength != 0)
-            {
-                printSpaces(serial, MESSAGE_INDENT);
-                serial.print(F("Length: "));
-                serial.println(LMIC.dataLen);                   
-                printSpaces(serial, MESSAGE_INDENT);    
-                serial.print(F("Data: "));
-                printHex(serial, LMIC.frame+LMIC.dataBeg, LMIC.dataLen, true, ' ');
-            }
-        #endif
     #endif
+    LORA_LOG(LORA_LOG_INFO, LOG_DOWNLINK, 0, NULL,
+             (LMIC.txrxFlags & TXRX_PORT) ? LMIC.frame[LMIC.dataBeg - 1] : 0,
+             LMIC.dataLen, getRssi(getSnrTenfold() / 10), getSnrTenfold());
 } 
 
 
@@ -845,7 +719,7 @@ void printHeader(void)
         display.drawString(COL_0, DEVICEID_ROW, deviceId);
         display.setCursor(COL_0, INTERVAL_ROW);
         display.print(F("Interval:"));
-        display.print(doWorkIntervalSeconds);
+        display.print(DO_WORK_INTERVAL_SECONDS);
         display.print("s");
     #endif
 
@@ -870,7 +744,7 @@ void printHeader(void)
             serial.println(LMIC_DEBUG_LEVEL);
         #endif
         serial.print(F("               Interval:      "));
-        serial.print(doWorkIntervalSeconds);
+        serial.print(DO_WORK_INTERVAL_SECONDS);
         serial.println(F(" seconds"));
 //      if (activationMode == ActivationMode::OTAA)
 //      {
@@ -880,6 +754,69 @@ void printHeader(void)
 }     
 
 
+void setupTtnChannels()
+{
+    // Channels (and sub bands) used by the Things Network; LMIC_setSession
+    // sets up only the minimal channel set, so this follows it (for ABP, and
+    // for OTAA when a saved session is restored rather than joining)
+    #if defined(CFG_eu868)
+        // Set up the channels used by the Things Network, which corresponds
+        // to the defaults of most gateways. Without this, only three base
+        // channels from the LoRaWAN specification are used, which certainly
+        // works, so it is good for debugging, but can overload those
+        // frequencies, so be sure to configure the full frequency range of
+        // your network here (unless your network autoconfigures them).
+        // Setting up channels should happen after LMIC_setSession, as that
+        // configures the minimal channel set. The LMIC doesn't let you change
+        // the three basic settings, but we show them here.
+        LMIC_setupChannel(0, 868100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
+        LMIC_setupChannel(1, 868300000, DR_RANGE_MAP(DR_SF12, DR_SF7B), BAND_CENTI);      // g-band
+        LMIC_setupChannel(2, 868500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
+        LMIC_setupChannel(3, 867100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
+        LMIC_setupChannel(4, 867300000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
+        LMIC_setupChannel(5, 867500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
+        LMIC_setupChannel(6, 867700000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
+        LMIC_setupChannel(7, 867900000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
+        LMIC_setupChannel(8, 868800000, DR_RANGE_MAP(DR_FSK,  DR_FSK),  BAND_MILLI);      // g2-band
+        // TTN defines an additional channel at 869.525Mhz using SF9 for class B
+        // devices' ping slots. LMIC does not have an easy way to define set this
+        // frequency and support for class B is spotty and untested, so this
+        // frequency is not configured here.
+    #elif defined(CFG_us915) || defined(CFG_au915)
+        // NA-US and AU channels 0-71 are configured automatically
+        // but only one group of 8 should (a subband) should be active
+        // TTN recommends the second sub band, 1 in a zero based count.
+        // https://github.com/TheThingsNetwork/gateway-conf/blob/master/US-global_conf.json
+        LMIC_selectSubBand(1);
+    #elif defined(CFG_as923)
+        // Set up the channels used in your country. Only two are defined by default,
+        // and they cannot be changed.  Use BAND_CENTI to indicate 1% duty cycle.
+        // LMIC_setupChannel(0, 923200000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);
+        // LMIC_setupChannel(1, 923400000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);
+
+        // ... extra definitions for channels 2..n here
+    #elif defined(CFG_kr920)
+        // Set up the channels used in your country. Three are defined by default,
+        // and they cannot be changed. Duty cycle doesn't matter, but is conventionally
+        // BAND_MILLI.
+        // LMIC_setupChannel(0, 922100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
+        // LMIC_setupChannel(1, 922300000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
+        // LMIC_setupChannel(2, 922500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
+
+        // ... extra definitions for channels 3..n here.
+    #elif defined(CFG_in866)
+        // Set up the channels used in your country. Three are defined by default,
+        // and they cannot be changed. Duty cycle doesn't matter, but is conventionally
+        // BAND_MILLI.
+        // LMIC_setupChannel(0, 865062500, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
+        // LMIC_setupChannel(1, 865402500, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
+        // LMIC_setupChannel(2, 865985000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
+
+        // ... extra definitions for channels 3..n here.
+    #endif
+}
+
+
 #ifdef ABP_ACTIVATION
     void setAbpParameters(dr_t dataRate = DefaultABPDataRate, s1_t txPower = DefaultABPTxPower) 
     {
@@ -899,61 +836,7 @@ void printHeader(void)
             LMIC_setSession (0x1, DEVADDR, NWKSKEY, APPSKEY);
         #endif
 
-        #if defined(CFG_eu868)
-            // Set up the channels used by the Things Network, which corresponds
-            // to the defaults of most gateways. Without this, only three base
-            // channels from the LoRaWAN specification are used, which certainly
-            // works, so it is good for debugging, but can overload those
-            // frequencies, so be sure to configure the full frequency range of
-            // your network here (unless your network autoconfigures them).
-            // Setting up channels should happen after LMIC_setSession, as that
-            // configures the minimal channel set. The LMIC doesn't let you change
-            // the three basic settings, but we show them here.
-            LMIC_setupChannel(0, 868100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-            LMIC_setupChannel(1, 868300000, DR_RANGE_MAP(DR_SF12, DR_SF7B), BAND_CENTI);      // g-band
-            LMIC_setupChannel(2, 868500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-            LMIC_setupChannel(3, 867100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-            LMIC_setupChannel(4, 867300000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-            LMIC_setupChannel(5, 867500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-            LMIC_setupChannel(6, 867700000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-            LMIC_setupChannel(7, 867900000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-            LMIC_setupChannel(8, 868800000, DR_RANGE_MAP(DR_FSK,  DR_FSK),  BAND_MILLI);      // g2-band
-            // TTN defines an additional channel at 869.525Mhz using SF9 for class B
-            // devices' ping slots. LMIC does not have an easy way to define set this
-            // frequency and support for class B is spotty and untested, so this
-            // frequency is not configured here.
-        #elif defined(CFG_us915) || defined(CFG_au915)
-            // NA-US and AU channels 0-71 are configured automatically
-            // but only one group of 8 should (a subband) should be active
-            // TTN recommends the second sub band, 1 in a zero based count.
-            // https://github.com/TheThingsNetwork/gateway-conf/blob/master/US-global_conf.json
-            LMIC_selectSubBand(1);
-        #elif defined(CFG_as923)
-            // Set up the channels used in your country. Only two are defined by default,
-            // and they cannot be changed.  Use BAND_CENTI to indicate 1% duty cycle.
-            // LMIC_setupChannel(0, 923200000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);
-            // LMIC_setupChannel(1, 923400000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);
-
-            // ... extra definitions for channels 2..n here
-        #elif defined(CFG_kr920)
-            // Set up the channels used in your country. Three are defined by default,
-            // and they cannot be changed. Duty cycle doesn't matter, but is conventionally
-            // BAND_MILLI.
-            // LMIC_setupChannel(0, 922100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
-            // LMIC_setupChannel(1, 922300000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
-            // LMIC_setupChannel(2, 922500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
-
-            // ... extra definitions for channels 3..n here.
-        #elif defined(CFG_in866)
-            // Set up the channels used in your country. Three are defined by default,
-            // and they cannot be changed. Duty cycle doesn't matter, but is conventionally
-            // BAND_MILLI.
-            // LMIC_setupChannel(0, 865062500, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
-            // LMIC_setupChannel(1, 865402500, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
-            // LMIC_setupChannel(2, 865985000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_MILLI);
-
-            // ... extra definitions for channels 3..n here.
-        #endif
+        setupTtnChannels();
 
         // Disable link check validation
         LMIC_setLinkCheckMode(0);
@@ -967,6 +850,146 @@ void printHeader(void)
 #endif //ABP_ACTIVATION
 
 
+// Session persistence: the session (keys, devaddr, frame counters, data
+// rate, and the RX windows and channels the network set up with MAC
+// commands and the join accept's CFList) is kept in RTC memory after every
+// uplink, which survives deep sleep, and in NVS after joining, on shutdown
+// and every SESSION_NVS_EVERY uplinks, which survives power loss.
+// initLmic() restores it, so a wake or reboot can send straight away
+// instead of spending seconds of radio time on a join.
+// Frame counters must never go backwards (the network drops replays), so an
+// NVS restore skips ahead by SESSION_NVS_EVERY.
+typedef struct {
+    uint32_t magic;
+    u4_t netid;
+    devaddr_t devaddr;
+    u1_t nwkKey[16];
+    u1_t artKey[16];
+    u4_t seqnoUp;
+    u4_t seqnoDn;
+    dr_t datarate;
+    s1_t txpow;
+    u1_t rxDelay;                                   // RX1 delay, seconds
+    u1_t rx1DrOffset;
+    dr_t dn2Dr;                                     // RX2 data rate...
+    u4_t dn2Freq;                                   // ...and frequency
+    u2_t channelMap[sizeof(LMIC.channelMap) / sizeof(u2_t)]; // enabled
+#if CFG_LMIC_EU_like
+    u4_t channelFreq[MAX_CHANNELS];                 // (with the band)
+    u2_t channelDrMap[MAX_CHANNELS];
+#endif
+} lora_session_t;
+static const uint32_t SESSION_MAGIC = 0x4C4D5332;   // "LMS2"
+static const u4_t SESSION_NVS_EVERY = 16;           // uplinks per NVS write
+static const char sessionPrefsName[] = "lorasession";
+RTC_DATA_ATTR static lora_session_t rtcSession;     // (survives deep sleep)
+static u4_t nvsSeqnoUp = 0;                         // seqnoUp last in NVS
+static bool sessionRestored = false;
+
+static bool readNvsSession(lora_session_t *session)
+{
+    Preferences prefs;
+    prefs.begin(sessionPrefsName, true);
+    size_t got = prefs.getBytes("session", session, sizeof(*session));
+    prefs.end();
+    return got == sizeof(*session) && session->magic == SESSION_MAGIC;
+}
+
+// save the session (if joined): to RTC always, to NVS if toNvs or if enough
+// uplinks have gone by since the last NVS write
+void lora_save_session(bool toNvs)
+{
+    if (LMIC.devaddr == 0)
+        return;
+    lora_session_t session;
+    session.magic = SESSION_MAGIC;
+    LMIC_getSessionKeys(&session.netid, &session.devaddr,
+                        session.nwkKey, session.artKey);
+    session.seqnoUp = LMIC.seqnoUp;
+    session.seqnoDn = LMIC.seqnoDn;
+    session.datarate = LMIC.datarate;
+    session.txpow = LMIC.adrTxPow;
+    session.rxDelay = LMIC.rxDelay;
+    session.rx1DrOffset = LMIC.rx1DrOffset;
+    session.dn2Dr = LMIC.dn2Dr;
+    session.dn2Freq = LMIC.dn2Freq;
+    memcpy(session.channelMap, &LMIC.channelMap, sizeof(session.channelMap));
+#if CFG_LMIC_EU_like
+    memcpy(session.channelFreq, LMIC.channelFreq, sizeof(session.channelFreq));
+    memcpy(
+      session.channelDrMap, LMIC.channelDrMap, sizeof(session.channelDrMap)
+    );
+#endif
+    rtcSession = session;
+
+    if (toNvs || session.seqnoUp - nvsSeqnoUp >= SESSION_NVS_EVERY)
+    {
+        Preferences prefs;
+        prefs.begin(sessionPrefsName, false);
+        prefs.putBytes("session", &session, sizeof(session));
+        prefs.end();
+        nvsSeqnoUp = session.seqnoUp;
+    }
+}
+
+// forget the saved session, so the next boot joins afresh
+void lora_forget_session()
+{
+    rtcSession.magic = 0;
+    Preferences prefs;
+    prefs.begin(sessionPrefsName, false);
+    prefs.remove("session");
+    prefs.end();
+    nvsSeqnoUp = 0;
+}
+
+static bool restoreSession()
+{
+    lora_session_t session, nvsSession;
+    bool inNvs = readNvsSession(&nvsSession);
+    if (rtcSession.magic == SESSION_MAGIC && rtcSession.devaddr != 0)
+    {
+        session = rtcSession;                       // exact counters
+        nvsSeqnoUp = inNvs ? nvsSession.seqnoUp : 0;
+    }
+    else if (inNvs)
+    {
+        session = nvsSession;                       // counters may be stale
+        session.seqnoUp += SESSION_NVS_EVERY;
+        nvsSeqnoUp = nvsSession.seqnoUp;
+    }
+    else
+    {
+        return false;
+    }
+
+    LMIC_setSession(session.netid, session.devaddr,
+                    session.nwkKey, session.artKey);
+    setupTtnChannels();
+    LMIC.seqnoUp = session.seqnoUp;
+    LMIC.seqnoDn = session.seqnoDn;
+
+    // LMIC_setSession reset these to the regional defaults (e.g. a 1 s RX1
+    // delay where TTN uses 5 s, so every downlink would be missed)
+    LMIC.rxDelay = session.rxDelay;
+    LMIC.rx1DrOffset = session.rx1DrOffset;
+    LMIC.dn2Dr = session.dn2Dr;
+    LMIC.dn2Freq = session.dn2Freq;
+    memcpy(&LMIC.channelMap, session.channelMap, sizeof(session.channelMap));
+#if CFG_LMIC_EU_like
+    memcpy(LMIC.channelFreq, session.channelFreq, sizeof(session.channelFreq));
+    memcpy(
+      LMIC.channelDrMap, session.channelDrMap, sizeof(session.channelDrMap)
+    );
+#endif
+    LMIC_setDrTxpow(session.datarate, session.txpow);
+
+    LORA_LOG(LORA_LOG_INFO, LOG_VALUE, 0, "Session restored, Up: ",
+             session.seqnoUp);
+    return true;
+}
+
+
 void initLmic(bit_t adrEnabled = 1,
               dr_t abpDataRate = DefaultABPDataRate, 
               s1_t abpTxPower = DefaultABPTxPower) 
@@ -982,6 +1005,9 @@ void initLmic(bit_t adrEnabled = 1,
         setAbpParameters(abpDataRate, abpTxPower);
     #endif
 
+    // Pick up where we left off (before deep sleep or power off), if we can.
+    sessionRestored = restoreSession();
+
     // Enable or disable ADR (data rate adaptation). 
     // Should be turned off if the device is not stationary (mobile).
     // 1 is on, 0 is off.
@@ -1047,13 +1073,20 @@ void onEvent(ev_t ev)
         case EV_TXSTART:
             setTxIndicatorsOn();
             printEvent(timestamp, ev);            
+            lora_work_event(ev);      // (LMIC's confirmed attempts)
             break;               
 
         case EV_JOIN_TXCOMPLETE:
-        case EV_TXCANCELED:
             setTxIndicatorsOn(false);
             printEvent(timestamp, ev);
             break;               
+
+        case EV_TXCANCELED:
+            // (e.g. by a rejoin) the message may be retried
+            setTxIndicatorsOn(false);
+            printEvent(timestamp, ev);
+            lora_work_event(ev);
+            break;
 #endif
         case EV_JOINED:
             setTxIndicatorsOn(false);
@@ -1065,14 +1098,9 @@ void onEvent(ev_t ev)
             // during join, but because slow data rates change
             // max TX size, it is not used in this example.                    
             LMIC_setLinkCheckMode(0);
+            lora_save_session(true);    // so we needn't join next boot
 
-            // The doWork job has probably run already (while
-            // the node was still joining) and have rescheduled itself.
-            // Cancel the next scheduled doWork job and re-schedule
-            // for immediate execution to prevent that any uplink will
-            // have to wait until the current doWork interval ends.
-            os_clearCallback(&doWorkJob);
-            os_setCallback(&doWorkJob, doWorkCallback);
+            lora_work_event(ev);      // (runs doWork now)
             break;
 
         case EV_TXCOMPLETE:
@@ -1080,18 +1108,14 @@ void onEvent(ev_t ev)
             setTxIndicatorsOn(false);   
             printEvent(timestamp, ev);
             printFrameCounters();
+            lora_save_session(false);   // (frame counters to RTC memory)
 
             // Check if downlink was received
             if (LMIC.dataLen != 0 || LMIC.dataBeg != 0)
-            {
-                uint8_t fPort = 0;
-                if (LMIC.txrxFlags & TXRX_PORT)
-                {
-                    fPort = LMIC.frame[LMIC.dataBeg -1];
-                }
                 printDownlinkInfo();
-                processDownlink(timestamp, fPort, LMIC.frame + LMIC.dataBeg, LMIC.dataLen);                
-            }
+
+            // delivery, link policy, downlink handlers, next doWork
+            lora_work_event(ev);
             break;     
           
         // Below events are printed only.
@@ -1106,7 +1130,6 @@ void onEvent(ev_t ev)
         case EV_LOST_TSYNC:
         case EV_RESET:
         case EV_RXCOMPLETE:
-        case EV_LINK_DEAD:
         case EV_LINK_ALIVE:
 #ifdef MCCI_LMIC
         // Only supported in MCCI LMIC library:
@@ -1115,6 +1138,21 @@ void onEvent(ev_t ev)
             printEvent(timestamp, ev);    
             break;
 
+        case EV_LINK_DEAD:
+            // No response to ADR acknowledgement requests: under OTAA the
+            // network may no longer know this (restored) session, so forget
+            // it and join afresh. An ABP session can't be renewed, and
+            // forgetting it would restart seqnoUp at 0 (every uplink then
+            // dropped as a replay), so keep it and its counters.
+            printEvent(timestamp, ev);
+            #ifdef MCCI_LMIC
+                if (activationMode == ActivationMode::OTAA) {
+                    lora_forget_session();
+                    LMIC_unjoinAndRejoin();
+                }
+            #endif
+            break;
+
         default: 
             printEvent(timestamp, "Unknown Event");    
             break;
@@ -1122,177 +1160,71 @@ void onEvent(ev_t ev)
 }
 
 
-static void doWorkCallback(osjob_t* job)
-{
-    // Event hander for doWorkJob. Gets called by the LMIC scheduler.
-    // The actual work is performed in function processWork() which is called below.
-
-    ostime_t timestamp = os_getTime();
-    #ifdef USE_SERIAL
-//      serial.println();
-        printEvent(timestamp, "TTN LoRa doWork job started", PrintTarget::Serial);
-    #endif    
-
-    // Do the work that needs to be performed.
-    processWork(timestamp);
-
-    // This job must explicitly reschedule itself for the next run.
-    ostime_t startAt = timestamp + sec2osticks((int64_t)doWorkIntervalSeconds);
-    os_setTimedCallback(&doWorkJob, startAt, doWorkCallback);    
-}
-
-
-lmic_tx_error_t scheduleUplink(uint8_t fPort, uint8_t* data, uint8_t dataLength, bool confirmed = false)
-{
-    // This function is called from the processWork() function to schedule
-    // transmission of an uplink message that was prepared by processWork().
-    // Transmission will be performed at the next possible time
-
-    ostime_t timestamp = os_getTime();
-    printEvent(timestamp, "Packet queued");
-
-    lmic_tx_error_t retval = LMIC_setTxData2(fPort, data, dataLength, confirmed ? 1 : 0);
-    timestamp = os_getTime();
-
-    if (retval == LMIC_ERROR_SUCCESS)
-    {
-        #ifdef CLASSIC_LMIC
-            // For MCCI_LMIC this will be handled in EV_TXSTART        
-            setTxIndicatorsOn();  
-        #endif        
-    }
-    else
-    {
-        String errmsg; 
-        #ifdef USE_SERIAL
-            errmsg = "LMIC Error: ";
-            #ifdef MCCI_LMIC
-                errmsg.concat(lmicErrorNames[abs(retval)]);
-            #else
-                errmsg.concat(retval);
-            #endif
-            printEvent(timestamp, errmsg.c_str(), PrintTarget::Serial);
-        #endif
-        #ifdef USE_DISPLAY
-            errmsg = "LMIC Err: ";
-            errmsg.concat(retval);
-            printEvent(timestamp, errmsg.c_str(), PrintTarget::Display);
-        #endif         
-    }
-    return retval;    
-}
-
-
 //  █ █ █▀▀ █▀▀ █▀▄   █▀▀ █▀█ █▀▄ █▀▀   █▀▄ █▀▀ █▀▀ ▀█▀ █▀█
 //  █ █ ▀▀█ █▀▀ █▀▄   █   █ █ █ █ █▀▀   █▀▄ █▀▀ █ █  █  █ █
 //  ▀▀▀ ▀▀▀ ▀▀▀ ▀ ▀   ▀▀▀ ▀▀▀ ▀▀  ▀▀▀   ▀▀  ▀▀▀ ▀▀▀ ▀▀▀ ▀ ▀
 
 static volatile uint16_t counter_ = 0;
 uint16_t getCounterValue() { // Increments counter and returns the new value.
-    delay(50); // Fake this takes some time
     return ++counter_;
 }
 void resetCounter() { counter_ = 0; } // Reset counter to 0
 
-// This function is called from the doWorkCallback() callback function when
-// the doWork job is executed. Uses globals: payloadBuffer and LMIC data
-// structure. This is where the main work is performed like reading sensor and
-// GPS data and schedule uplink messages if anything needs to be transmitted.
-void processWork(ostime_t doWorkJobTimeStamp) {
-    // Skip processWork if using OTAA and still joining.
-    if (LMIC.devaddr != 0) {
-        // Collect input data.
-        // For simplicity LMIC-node uses a counter to simulate a sensor.
-        // The counter is increased automatically by getCounterValue()
-        // and can be reset with a 'reset counter' command downlink message.
+// the lora-work.cpp hooks: display status, and LMIC-node's counter (shown
+// with the interval) as an uplink goes
+void lora_work_show(ostime_t timestamp, const char *message) {
+    #ifdef USE_DISPLAY
+        printEvent(timestamp, message, PrintTarget::Display);
+    #endif
+}
 
+void lora_work_sending(uint32_t intervalMs) {
+    #ifdef CLASSIC_LMIC
+        // For MCCI_LMIC this will be handled in EV_TXSTART
+        setTxIndicatorsOn();
+    #endif
+    // LMIC-node's simulated sensor, a counter (reset by the C0 downlink), is
+    // only shown on the display; uplinks carry the queued payloads
+    #ifdef USE_DISPLAY
         uint16_t counterValue = getCounterValue();
-        ostime_t timestamp = os_getTime();
-
-        // if there's no payload do nothing
-        if(! lora_payload_ready) {
-          #ifdef USE_DISPLAY
-            printEvent(timestamp, "no pyld, UL !scheduled", PrintTarget::Display);
-          #endif
-          #ifdef USE_SERIAL
-            printEvent(
-              timestamp, "no payload, uplink not scheduled", PrintTarget::Serial
-            );
-          #endif
-          return;
-        }
-
-        #ifdef USE_DISPLAY
-            // Interval and Counter values are combined on a single row. This
-            // allows to keep the 3rd row empty which makes the information
-            // better readable on the small display.
-            display.clearLine(INTERVAL_ROW);
-            display.setCursor(COL_0, INTERVAL_ROW);
-            display.print("I:");
-            display.print(doWorkIntervalSeconds);
-            display.print("s");
-            display.print(" Ctr:");
-            display.print(counterValue);
-        #endif
-        #ifdef USE_SERIAL
-            printEvent(timestamp, "Input data collected", PrintTarget::Serial);
-            printSpaces(serial, MESSAGE_INDENT);
-            serial.print(F("COUNTER value: "));
-            serial.println(counterValue);
-        #endif
+        // Interval and Counter values are combined on a single row. This
+        // allows to keep the 3rd row empty which makes the information
+        // better readable on the small display.
+        display.clearLine(INTERVAL_ROW);
+        display.setCursor(COL_0, INTERVAL_ROW);
+        display.print("I:");
+        display.print(intervalMs / 1000);
+        display.print("s");
+        display.print(" Ctr:");
+        display.print(counterValue);
+        LORA_LOG(LORA_LOG_DEBUG, LOG_VALUE, 0, "COUNTER value: ", counterValue);
+    #endif
+}
 
-        // For simplicity LMIC-node will try to send an uplink message every
-        // time processWork() is executed.
+void lora_work_wake() {
+    TaskHandle_t loraTask = unPhone::tasks[unPhone::TASK_LORA].handle;
+    if (loraTask != NULL) xTaskNotifyGive(loraTask);
+}
 
-        // Schedule uplink message if possible
-        if (LMIC.opmode & OP_TXRXPEND) {
-            // TxRx is currently pending, do not send.
-            #ifdef USE_SERIAL
-                printEvent(timestamp,
-                  "Uplink not scheduled because TxRx pending",
-                  PrintTarget::Serial);
-            #endif
-            #ifdef USE_DISPLAY
-                printEvent(timestamp, "UL not scheduled", PrintTarget::Display);
-            #endif
-        } else { // Prepare uplink payload.
-            // copy payload from (lora_send) caller
-            uint8_t payloadLength =
-              min((uint8_t) strlen(lora_payload), unPhone::LORA_PAYLOAD_LEN);
-            strncpy((char *) payloadBuffer, lora_payload, payloadLength);
-            payloadBuffer[unPhone::LORA_PAYLOAD_LEN - 1] = '\0'; // no overrun
-
-            // schedule an uplink
-            uint8_t fPort = 10;
-//          payloadBuffer[0] = counterValue >> 8;
-//          payloadBuffer[1] = counterValue & 0xFF;
-//          uint8_t payloadLength = 2;
-            scheduleUplink(fPort, payloadBuffer, payloadLength);
-            lora_payload_ready = false;
-        }
-    }
+// the radio's DIO lines (TxDone, RxDone, RxTimeout) wake the LoRa task, so
+// it can sleep through a TX/RX rather than poll; the HAL still reads the
+// pins itself (no LMIC_USE_INTERRUPTS) when the run loop next turns
+static void IRAM_ATTR onRadioDio() {
+    TaskHandle_t loraTask = unPhone::tasks[unPhone::TASK_LORA].handle;
+    BaseType_t woken = pdFALSE;
+    if (loraTask != NULL) vTaskNotifyGiveFromISR(loraTask, &woken);
+    if (woken) portYIELD_FROM_ISR();
 }
 
-// This function is called from the onEvent() event handler on EV_TXCOMPLETE
-// when a downlink message was received. Implements a 'reset counter' command
-// that can be sent via a downlink message. To send the reset counter command
-// to the node, send a downlink message (e.g. from the TTN Console) with
-// single byte value resetCmd on port cmdPort.
-void processDownlink(
-  ostime_t txCompleteTimestamp, uint8_t fPort, uint8_t* data, uint8_t dataLength
-) {
-    const uint8_t cmdPort = 100;
-    const uint8_t resetCmd= 0xC0;
-
-    if (fPort == cmdPort && dataLength == 1 && data[0] == resetCmd) {
-        #ifdef USE_SERIAL
-            printSpaces(serial, MESSAGE_INDENT);
-            serial.println(F("Reset cmd received"));
-        #endif
-        ostime_t timestamp = os_getTime();
-        resetCounter();
-        printEvent(timestamp, "Counter reset", PrintTarget::All, false);
-    }
+// LMIC-node's 'reset counter' command (C0 on LORA_CMD_PORT; lora-work.cpp
+// routes downlinks)
+static const uint8_t resetCmd = 0xC0;
+
+static void onResetCmd(const uint8_t *args, uint8_t len, void *ctx) {
+    ostime_t timestamp = os_getTime();
+    LORA_LOG(LORA_LOG_INFO, LOG_TEXT, timestamp, "Reset cmd received");
+    resetCounter();
+    printEvent(timestamp, "Counter reset", PrintTarget::All, false);
 }
 
 // ("user code" setup and loop merged into exported API) /////////////////////
@@ -1334,25 +1266,106 @@ void lora_setup() {
   }
 
   initLmic();
+  attachInterrupt(unPhone::LMIC_DIO0, onRadioDio, RISING); // (after the
+  attachInterrupt(unPhone::LMIC_DIO1, onRadioDio, RISING); // HAL's pinMode)
 
   //  "user code" begin: place code for initializing sensors etc. here.
   resetCounter();
+  lora_on_downlink(LORA_CMD_PORT, resetCmd, onResetCmd, 0, NULL);
   //  "user code" end
 
-  if (activationMode == ActivationMode::OTAA)
+  if (activationMode == ActivationMode::OTAA && !sessionRestored)
     LMIC_startJoining();
 
-  // schedule initial doWork job for immediate execution.
-  os_setCallback(&doWorkJob, doWorkCallback);
+  lora_work_start();              // doWork runs at once
 }
 
-void lora_loop() {
-  os_runloop_once();
+#if defined(USE_SERIAL) && LORA_LOG_LEVEL > LORA_LOG_OFF
+// format one log record (as LMIC-node printed them)
+static void formatLogRecord(Print &out, const lora_log_t &r) {
+  if(r.id == LOG_TEXT || r.id == LOG_LMIC_EVENT || r.id == LOG_TX_ERROR) {
+    String timeString(r.time);
+    uint8_t len = timeString.length();
+    printChars(out, '0', TIMESTAMP_WIDTH > len ? TIMESTAMP_WIDTH - len : 0);
+    out.print(timeString);
+    out.print(":  ");
+  } else {
+    printSpaces(out, MESSAGE_INDENT);
+  }
+
+  switch(r.id) {
+    case LOG_TEXT:
+      out.println(r.text); break;
+    case LOG_LMIC_EVENT:
+      out.print(F("TTN LoRa Event: "));
+      out.println(lmicEventNames[r.args[0]]); break;
+    case LOG_VALUE:
+      out.print(r.text); out.println(r.args[0]); break;
+    case LOG_COUNTERS:
+      out.printf("Up: %d,  Down: %d", r.args[0], r.args[1]);
+      if(r.args[2] >= 0)
+        out.printf(",  RX late: %d (last by %d ms)", r.args[2], r.args[3]);
+      out.println(); break;
+    case LOG_DOWNLINK:
+      out.printf("Downlink received, port: %d,  length: %d\n",
+        r.args[0], r.args[1]);
+      printSpaces(out, MESSAGE_INDENT);
+      out.printf("RSSI: %d dBm,  SNR: %d.%d dB\n",
+        r.args[2], r.args[3] / 10, abs(r.args[3] % 10)); break;
+    case LOG_SESSION:
+      out.printf("Network Id: %u,  Device Address: %X\n",
+        r.args[0], r.args[1]); break;
+    case LOG_TX_ERROR:
+      out.print(F("LMIC Error: "));
+      #ifdef MCCI_LMIC
+        out.println(lmicErrorNames[abs(r.args[0])]);
+      #else
+        out.println(r.args[0]);
+      #endif
+      break;
+    case LOG_DELIVERY: {
+      static const char *states[] = { "retrying", "sent", "acked", "failed" };
+      out.printf("Uplink %u %s\n", r.args[0], states[r.args[1]]); break;
+    }
+    case LOG_LINK:
+      out.printf("Link: SF%d at %d dBm (SNR %d.%d dB, delivery %d%%)\n",
+        r.args[0], r.args[1], r.args[2] / 10, abs(r.args[2] % 10), r.args[3]);
+      break;
+  }
 }
 
-void lora_send(const char *fmt, va_list arglist) { // ttn msg (vsprintf style)
-  vsprintf(lora_payload, fmt, arglist);
-  lora_payload_ready = true;
+// format pending log records to Serial (and, with LORA_LOG_SD, append them
+// to LORA_LOG_SD on the SD card); called from the (low priority) log task,
+// never from the LoRa task. returns the number of records written
+uint16_t lora_log_flush() {
+  static uint32_t reportedDropped = 0;
+  lora_log_t batch[16];
+  uint8_t n = 0;
+  while(n < 16 && loraLog.get(&batch[n])) n++;
+  uint32_t dropped = loraLog.dropped();
+  if(n == 0 && dropped == reportedDropped) return 0;
+
+  for(uint8_t i = 0; i < n; i++)
+    formatLogRecord(Serial, batch[i]);
+  if(dropped != reportedDropped) {
+    Serial.printf("(%u LoRa log records dropped)\n", dropped - reportedDropped);
+    reportedDropped = dropped;
+  }
+
+#ifdef LORA_LOG_SD
+  u.spiLock();   // (the SD card shares SPI with the radio)
+  auto logFile = u.sdp->open(LORA_LOG_SD, O_WRITE | O_CREAT | O_APPEND);
+  if(logFile) {
+    for(uint8_t i = 0; i < n; i++)
+      formatLogRecord(logFile, batch[i]);
+    logFile.close();
+  }
+  u.spiUnlock();
+#endif
+  return n;
 }
+#else
+uint16_t lora_log_flush() { return 0; }
+#endif
 
-void lora_shutdown() { LMIC_shutdown(); }
+void lora_shutdown() { lora_save_session(true); LMIC_shutdown(); }
@@ -6,9 +6,46 @@
 #ifndef LORA_H
 #define LORA_H
 
+#include "lora-queue.h"
+#include "lora-delivery.h"
+#include "lora-link.h"
+#include "lora-downlink.h"
+#include "lora-log.h"
+
+#ifndef LORA_LOG_LEVEL           // set in platformio.ini, e.g. LORA_LOG_DEBUG
+#  ifdef USE_SERIAL
+#    define LORA_LOG_LEVEL LORA_LOG_INFO
+#  else
+#    define LORA_LOG_LEVEL LORA_LOG_OFF
+#  endif
+#endif
+
+// fPorts (the unPhone class has these too, e.g. unPhone::LORA_LPP_PORT)
+static const uint8_t LORA_TEXT_PORT = 10;  // lora_send text
+static const uint8_t LORA_LPP_PORT = 11;   // LPP (lora-payload.h)
+static const uint8_t LORA_BATCH_PORT = 12; // lora-batch.h frames
+static const uint8_t LORA_CMD_PORT = 100;  // command downlinks
+
 void lora_setup();                       // initialise lora/ttn
 void lora_loop();                        // service pending lora transactions
 void lora_send(const char *, va_list);   // send a ttn message (vsprintf style)
-void lora_shutdown();                    // shut down LMIC
+uint32_t lora_enqueue(                   // queue a binary uplink (port, data,
+  uint8_t, const uint8_t *, uint8_t, bool, uint8_t); // len, confirmed, prio);
+                                         // its id, or 0 if dropped
+void lora_queue_stats(lora_queue_stats_t *); // uplink queue counters
+typedef void (*lora_delivery_cb_t)(uint32_t, lora_delivery_state_t); // (id)
+void lora_on_delivery(lora_delivery_cb_t); // report uplink outcomes
+void lora_delivery_stats(lora_delivery_stats_t *); // outcomes and latency
+void lora_link_stats(lora_link_stats_t *); // link quality, SF/power choice
+bool lora_batch_add(uint8_t, int32_t, bool); // batch a reading (chan, value,
+                                         // priority: send now)
+bool lora_on_downlink(                   // route downlinks (port, opcode or
+  uint8_t, int16_t, lora_downlink_handler_t, // LORA_ANY_OPCODE, handler,
+  uint8_t, void *);                      // min arg bytes, handler context)
+void lora_shutdown();                    // save the session, shut down LMIC
+void lora_save_session(bool);            // persist session (true: to NVS too)
+void lora_forget_session();              // next boot joins afresh
+uint16_t lora_log_flush();               // format buffered log records
+uint32_t lora_idle_ms(uint32_t);         // millis (up to max) LMIC can sleep
 
 #endif
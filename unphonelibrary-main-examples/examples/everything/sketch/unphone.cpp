@@ -20,9 +20,29 @@ char *getMAC(char *buf);                              // read MAC into buffer
 const char *unPhone::getMAC() { return MAC_ADDRESS; } // return MAC buffer
 
 // the LCD, touch screen and UI controller //////////////////////////////////
+// backlight brightness is PWM (LEDC) when BACKLIGHT is a native GPIO; on
+// spins 7 and 9 it's a TCA9555 expander pin, which can only be on or off, so
+// there any level above 0 is full brightness
+static const uint8_t BACKLIGHT_LEDC_CHANNEL = 7;
+static const uint32_t BACKLIGHT_PWM_HZ = 5000;
+static uint8_t backlightPercent = 100; // the level backlight(true) restores
 void unPhone::backlight(bool on) {     // turn the backlight on or off
-  if(on) IOExpander::digitalWrite(BACKLIGHT, HIGH);
-  else   IOExpander::digitalWrite(BACKLIGHT, LOW);
+  uint8_t percent = on ? backlightPercent : 0;
+  if(BACKLIGHT & 0x40) {
+    IOExpander::digitalWrite(BACKLIGHT, percent > 0 ? HIGH : LOW);
+    return;
+  }
+  static bool attached = false;
+  if(!attached) {
+    ledcSetup(BACKLIGHT_LEDC_CHANNEL, BACKLIGHT_PWM_HZ, 8);
+    ledcAttachPin(BACKLIGHT, BACKLIGHT_LEDC_CHANNEL);
+    attached = true;
+  }
+  ledcWrite(BACKLIGHT_LEDC_CHANNEL, percent * 255 / 100);
+}
+void unPhone::brightness(uint8_t percent) { // set the level (shown now,
+  backlightPercent = min(percent, (uint8_t) 100); // or when we wake)
+  if(!isIdle()) backlight(true);
 }
 void unPhone::expanderPower(bool on) { // expander board power on or off
   if(on) IOExpander::digitalWrite(EXPANDER_POWER, HIGH);
@@ -33,34 +53,193 @@ void unPhone::redraw() { // redraw the UI
 }
 void unPhone::provisioned() {   // set the UI's provisioned flag and redraw
   UIController::provisioned = true; // tell UICon done provision
+  spiLock();                    // (we're not called from the UI task)
   redraw();                     // perhaps we're on wifi now, redraw
+  spiUnlock();
 }
 void unPhone::uiLoop() { // service the UI from within the main loop
   ((UIController *) uiCont)->run();
 }
+void unPhone::uiMode(uint8_t mode) { // done by the UI task on its next turn
+  ((UIController *) uiCont)->requestMode((ui_modes_t) mode);
+}
 
 // FreeRTOS tasks
+// the radio and UI share SPI so are serviced on the core away from WiFi/LwIP
+// (and above the Arduino loop()); housekeeping goes on the protocol core
+#ifdef CONFIG_FREERTOS_UNICORE
+static const BaseType_t PROTO_CORE = 0, APP_CORE = 0;
+#else
+static const BaseType_t PROTO_CORE = 0, APP_CORE = 1;
+#endif
+unPhone::task_config_t unPhone::tasks[NUM_TASKS] = {
+  // name                 stack prio core
+  { "power switch task",  4096,    1, PROTO_CORE, NULL }, // TASK_POWER_SWITCH
+  { "unphone loop task",  8192,    2, APP_CORE,   NULL }, // TASK_UI
+  { "lora task",          6144,    3, APP_CORE,   NULL }, // TASK_LORA
+  { "wifi connect task",  4096,    1, PROTO_CORE, NULL }, // TASK_WIFI
+  { "lora log task",      4096,    1, PROTO_CORE, NULL }, // TASK_LOG
+  { "ota task",           8192,    1, PROTO_CORE, NULL }, // TASK_OTA (TLS)
+};
+bool unPhone::startTask(task_id_t id, TaskFunction_t fn, void *param) {
+  task_config_t *t = &tasks[id];
+  BaseType_t ok = xTaskCreatePinnedToCore(
+    fn, t->name, t->stackSize, param, t->priority, &t->handle, t->core
+  );
+  if(ok != pdPASS) E("failed to create %s\n", t->name)
+  return ok == pdPASS;
+}
+void unPhone::printTaskStacks() { // how close has each task come to overflow?
+  Serial.println("------------------------------------------");
+  Serial.println("task                  core prio  stack  min free");
+  for(int i = 0; i < NUM_TASKS; i++) {
+    task_config_t *t = &tasks[i];
+    if(t->handle == NULL) continue; // not started
+    Serial.printf("%-20s  %4d %4u %6u %9u\n", t->name, (int) t->core,
+      (unsigned) t->priority, (unsigned) t->stackSize,
+      (unsigned) uxTaskGetStackHighWaterMark(t->handle));
+  }
+  Serial.println("------------------------------------------");
+}
+
 void powerSwitchTask(void *);   // power switch check task
 void powerSwitchTask(void *param) { // check power switch every 10th of sec
   while(true) { unPhone::me().checkPowerSwitch(); delay(100); }
 }
-void unLoopTask(void *);        // UI and TTN LoRa task
-void unLoopTask(void *param) {  // service UI events & lora transactions
-  // touchscrn/LCD/LoRa module all use SPI & must all be serviced in one task
-  unPhone::me().loraSetup();    // init the RFM95W
-  uint32_t loopIter = 0;        // iteration slicing
+static const uint32_t UI_TURN_MS = 5; // UI block per turn (touch polling)
+void unLoopTask(void *);        // UI task
+void unLoopTask(void *param) {  // service UI events
+  // touchscrn/LCD/LoRa module all use SPI, so the UI holds the bus lock
+  // while it runs; the (higher priority) LoRa task gets it between turns,
+  // and at the spiCheckpoint()s in long redraws. we're above loop() on the
+  // same core, so block after every turn to let it (and IDLE) run
   while(true) {
     if(unPhone::me().factoryTestMode()) { delay(100); continue; }
+    unPhone::me().batterySample();                      // VBAT (if due)
+    unPhone::me().hwCommandsRun();                      // from other tasks
+    if(unPhone::me().idleCheck()) continue;             // dimmed & parked
+    unPhone::me().spiLock();
     ((UIController *) unPhone::me().uiCont)->run();     // the UI
+    unPhone::me().spiUnlock();
+    vTaskDelay(max(UI_TURN_MS / portTICK_PERIOD_MS, (uint32_t) 1));
+  }
+}
+// the LoRa task sleeps until LMIC's next job or the batch falls due (see
+// lora_idle_ms), or it's notified (by lora_enqueue, or the radio's DIO lines)
+static const uint32_t LORA_MAX_BLOCK_MS = 600000; // (a backstop)
+void loraTask(void *);          // TTN LoRa task
+void loraTask(void *param) {    // service lora transactions
+  unPhone::me().spiLock();
+  unPhone::me().loraSetup();    // init the RFM95W
+  unPhone::me().spiUnlock();
+  while(true) {
+    unPhone::me().spiLock();
     unPhone::me().loraLoop();                           // LMIC
-    if(loopIter++ % 25000 == 0) delay(100);             // IDLE task
+    uint32_t idleMs = lora_idle_ms(LORA_MAX_BLOCK_MS);  // next job due
+    unPhone::me().spiUnlock();
+    ulTaskNotifyTake(                                   // (or notified)
+      pdTRUE, max(idleMs / portTICK_PERIOD_MS, (uint32_t) 1)
+    );
+  }
+}
+static const uint32_t LORA_LOG_POLL_MS = 100; // log formatting latency
+void loraLogTask(void *);       // LoRa log formatter task
+void loraLogTask(void *param) { // Serial (or SD) output, off the radio's path
+  while(true) {
+    lora_log_flush();                                   // (16 at most)
+    vTaskDelay(LORA_LOG_POLL_MS / portTICK_PERIOD_MS);
   }
 }
 
+// hardware commands from other tasks, applied by the UI task
+static QueueHandle_t hwCommands = NULL;
+bool unPhone::hwCommand(const hw_cmd_t &cmd) {
+  if(hwCommands == NULL || xQueueSend(hwCommands, &cmd, 0) != pdTRUE) {
+    E("hardware command queue full, command %d dropped\n", cmd.type)
+    return false;
+  }
+  return true;
+}
+void unPhone::hwCommandsRun() {
+#if UNPHONE_SPIN >= 9
+  const uint8_t LIT = LOW;              // (the LEDs are active low from 9)
+#else
+  const uint8_t LIT = HIGH;
+#endif
+  hw_cmd_t cmd;
+  while(hwCommands != NULL && xQueueReceive(hwCommands, &cmd, 0) == pdTRUE) {
+    switch(cmd.type) {
+      case HW_RGB:
+        rgb(cmd.rgb.red ? LIT : !LIT, cmd.rgb.green ? LIT : !LIT,
+          cmd.rgb.blue ? LIT : !LIT);
+        break;
+      case HW_BRIGHTNESS:
+        brightness(cmd.percent);
+        break;
+    }
+  }
+}
+
+// SPI bus arbitration
+static SemaphoreHandle_t spiMutex = NULL;
+static const uint32_t SPI_HOLD_MS = 20; // longest hold before a checkpoint
+static uint32_t spiTakenAt = 0;         // (millis) by the current holder
+static void spiTake() {
+  xSemaphoreTake(spiMutex, portMAX_DELAY);
+  spiTakenAt = millis();
+}
+void unPhone::spiLock() { spiTake(); }
+void unPhone::spiUnlock() { xSemaphoreGive(spiMutex); }
+void unPhone::spiYield() { // waiters of higher priority run on the give
+  xSemaphoreGive(spiMutex);
+  spiTake();
+}
+static bool spiHeld() { // does the current task hold the SPI lock?
+  return spiMutex != NULL &&
+    xSemaphoreGetMutexHolder(spiMutex) == xTaskGetCurrentTaskHandle();
+}
+void unPhone::spiCheckpoint() { // (the LoRa task's wait: SPI_HOLD_MS or so)
+  if(spiHeld() && millis() - spiTakenAt >= SPI_HOLD_MS) spiYield();
+}
+void unPhone::spiWait(uint32_t ms) {
+  bool held = spiHeld();
+  if(held) xSemaphoreGive(spiMutex);
+  vTaskDelay(ms / portTICK_PERIOD_MS);
+  if(held) spiTake();
+}
+void unPhone::fillScreen(uint16_t colour) { // a full fill is 300k of pixels
+  const int16_t BAND = 40;                  // rows per chunk
+  int16_t w = tftp->width(), h = tftp->height();
+  for(int16_t y = 0; y < h; y += BAND) {
+    tftp->fillRect(0, y, w, min(BAND, (int16_t) (h - y)), colour);
+    spiCheckpoint();
+  }
+}
+
+// per-task CPU utilisation; needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+// and CONFIG_FREERTOS_USE_STATS_FORMATTING_FUNCTIONS in the sdkconfig
+void unPhone::printTaskStats() {
+#if configGENERATE_RUN_TIME_STATS == 1 && configUSE_STATS_FORMATTING_FUNCTIONS > 0
+  size_t bufLen = uxTaskGetNumberOfTasks() * 50; // ~40 chars per task line
+  char *buf = (char *) malloc(bufLen);
+  if(buf == NULL) { E("no memory for task stats\n") return; }
+  vTaskGetRunTimeStats(buf);
+  Serial.println("------------------------------------------");
+  Serial.println("task            abs time        % time");
+  Serial.print(buf);
+  Serial.println("------------------------------------------");
+  free(buf);
+#else
+  D("task stats unavailable: FreeRTOS run time stats not configured\n")
+#endif
+}
+
 // initialise unPhone hardware
 void unPhone::begin() {
   Serial.begin(115200);                 // init the serial line
   D("UNPHONE_SPIN: %d\n", UNPHONE_SPIN)
+  spiMutex = xSemaphoreCreateMutex();   // SPI bus arbitration
+  hwCommands = xQueueCreate(HW_CMD_QUEUE_LEN, sizeof(hw_cmd_t));
   ::getMAC(MAC_ADDRESS);                // store the MAC address
   beginStore(); // init small persistent store (does nothing if enabled false)
 
@@ -72,13 +251,13 @@ void unPhone::begin() {
 
   // start power switch checking
   checkPowerSwitch();
-  xTaskCreate(powerSwitchTask, "power switch task", 4096, NULL, 1, NULL);
+  startTask(TASK_POWER_SWITCH, powerSwitchTask);
 
   // instantiate the display...
   tftp = new Adafruit_HX8357(LCD_CS, LCD_DC, LCD_RESET);
-  IOExpander::digitalWrite(BACKLIGHT, LOW);
+  backlight(false);
   tftp->begin(HX8357D);
-  IOExpander::digitalWrite(BACKLIGHT, HIGH);
+  backlight(true);
   tftp->setTextWrap(false);
 
   // ...and the touch screen
@@ -141,7 +320,11 @@ void unPhone::begin() {
     E("WARNING: ui.begin failed!\n")
 
   // start servicing UI events and LoRa transactions
-  xTaskCreate(unLoopTask, "unphone loop task", 8192, NULL, 1, NULL);
+  startTask(TASK_UI, unLoopTask);
+  startTask(TASK_LORA, loraTask);
+#if LORA_LOG_LEVEL > LORA_LOG_OFF
+  startTask(TASK_LOG, loraLogTask);
+#endif
 } // begin()
 
 uint8_t unPhone::getVersionNumber() { return UNPHONE_SPIN; }
@@ -264,6 +447,13 @@ void unPhone::checkPowerSwitch() {
     // turn off expander power, LEDs, etc.
     turnPeripheralsOff();
 
+    // keep the LoRaWAN session so we needn't rejoin when switched back on
+    // (LMIC's state is guarded by the SPI lock, which we may already hold)
+    bool held = spiHeld();
+    if(!held) spiLock();
+    lora_save_session(true);
+    if(!held) spiUnlock();
+
     if(!usbPowerConnected()) { // and usb unplugged we go into shipping mode
       store("switch is off, power is OFF: going to shipping mode");
       setShipping(true); // tell BM to stop supplying power until USB connects
@@ -279,7 +469,7 @@ void unPhone::checkPowerSwitch() {
 // helper to turn off everything we can think of prior to power down or deep sleep
 void unPhone::turnPeripheralsOff() {
   expanderPower(false);
-  IOExpander::digitalWrite(BACKLIGHT, LOW);
+  backlight(false);
   ir(false);            // TODO invert if logic changes!
   unPhone:rgb(1, 1, 1); // TODO invert if logic changes!
 }
@@ -354,6 +544,20 @@ void unPhone::loraSend(const char *fmt, ...) {  // send (sprintf style)
   lora_send(fmt, arglist);
   va_end(arglist);
 }
+uint32_t unPhone::loraSendBytes( // queue binary data, highest priority first
+  uint8_t port, const uint8_t *data, uint8_t len, bool confirmed,
+  uint8_t priority
+) { return lora_enqueue(port, data, len, confirmed, priority); }
+void unPhone::loraOnDelivery(lora_delivery_cb_t cb) { // see lora-delivery.h
+  lora_on_delivery(cb);
+}
+bool unPhone::loraBatchAdd( // scaled integer readings; see lora-batch.h
+  uint8_t channel, int32_t value, bool priority
+) { return lora_batch_add(channel, value, priority); }
+bool unPhone::loraOnDownlink( // handlers run in the LoRa task (keep 'em short)
+  uint8_t port, int16_t opcode, lora_downlink_handler_t handler,
+  uint8_t minArgs, void *ctx
+) { return lora_on_downlink(port, opcode, handler, minArgs, ctx); }
 
 // save short sequences of strings using the Preferences API /////////////////
 // we use a ring buffer with STORE_SIZE elements stored in NVS;
@@ -95,10 +95,59 @@ public:
   void wakeOnPowerSwitch();    // wakeup interrupt on power switch
   void printWakeupReason();    // what woke us up?
 
+  // idle governor (see idle.cpp): after idleTimeout() millis without touch,
+  // button or accelerometer activity dim the screen, park the UI and light
+  // sleep between LMIC jobs; a timeout of 0 disables the governor
+  static const uint32_t IDLE_TIMEOUT_MS = 60000; // default timeout
+  void idleTimeout(uint32_t ms); // set the idle timeout
+  uint32_t idleTimeout();        // get the idle timeout
+  void activity();             // note user activity (resets the idle timer)
+  bool idleCheck();            // UI task: true if idle (and UI is parked)
+  bool isIdle();               // dimmed and parked?
+
   void *uiCont;                // the UI controller
   void redraw();               // redraw the UI
   void provisioned();          // call when provisioning is complete
   void uiLoop();               // allow the UI to run
+  void uiMode(uint8_t mode);   // switch screens (a ui_modes_t), any task
+
+  // hardware commands: other tasks (e.g. httpd's AsyncTCP callbacks) queue
+  // typed commands rather than driving I²C themselves; the UI task, which
+  // owns the display and LEDs, applies them each turn
+  typedef enum { HW_RGB, HW_BRIGHTNESS } hw_cmd_type_t;
+  typedef struct {
+    hw_cmd_type_t type;
+    union {
+      struct { bool red, green, blue; } rgb; // HW_RGB: which LEDs are lit
+      uint8_t percent;                       // HW_BRIGHTNESS: 0-100
+    };
+  } hw_cmd_t;
+  static const uint8_t HW_CMD_QUEUE_LEN = 8;
+  bool hwCommand(const hw_cmd_t &); // queue (any task); false if full
+  void hwCommandsRun();        // UI task: apply queued commands
+
+  // FreeRTOS task plan (see unphone.cpp): each task's core, priority and
+  // stack size live in one table, so they can be tuned together
+  enum task_id_t {
+    TASK_POWER_SWITCH = 0,     // power switch checks
+    TASK_UI,                   // UI events (LCD, touch, SD)
+    TASK_LORA,                 // LMIC job servicing
+    TASK_WIFI,                 // wifi connection management
+    TASK_LOG,                  // formats LoRa log records (lora-log.h)
+    TASK_OTA,                  // firmware update checks and downloads
+    NUM_TASKS
+  };
+  typedef struct {
+    const char *name;          // task name
+    uint32_t stackSize;        // stack depth (bytes on the ESP32)
+    UBaseType_t priority;      // Arduino loop() is 1, WiFi is ~23
+    BaseType_t core;           // core to pin to (WiFi/LwIP live on 0)
+    TaskHandle_t handle;       // set by startTask
+  } task_config_t;
+  static task_config_t tasks[NUM_TASKS];
+  bool startTask(task_id_t, TaskFunction_t, void *param = NULL);
+  void printTaskStats();       // per-task CPU use (if FreeRTOS collects it)
+  void printTaskStacks();      // stack high water marks of our tasks
 
   void recoverI2C();           // deal with i2c hangs
   bool factoryTestMode();      // read factory test mode
@@ -116,11 +165,26 @@ public:
 #endif
   void getAccelEvent(sensors_event_t *); // spin-agnostic accelerometer
   void backlight(bool);        // turn the backlight on or off
+  void brightness(uint8_t);    // backlight level, 0-100% (see unphone.cpp)
   void expanderPower(bool);    // turn expander board power on or off
 
   // SD card filesystem
   SdFat *sdp;
 
+  // the SPI bus is shared by the LCD, touch screen, SD card and LoRa radio:
+  // tasks hold the bus lock around each batch of transactions; the LoRa
+  // task holds it while running LMIC jobs, so it also guards LMIC's state.
+  // it's a mutex, so a holder waited on by the LoRa task inherits its
+  // priority (other tasks can't stretch the hold), but LMIC still waits
+  // until the holder lets go: long redraws call spiCheckpoint, which yields
+  // once the bus has been held SPI_HOLD_MS
+  void spiLock();              // take the bus (blocks)
+  void spiUnlock();            // release the bus
+  void spiYield();             // let a waiting task (e.g. LMIC) have a go
+  void spiCheckpoint();        // spiYield if we've held the bus SPI_HOLD_MS
+  void spiWait(uint32_t ms);   // delay, releasing the bus if we hold it
+  void fillScreen(uint16_t);   // fill in bands, yielding the bus between
+
   // calibration data for converting raw touch data to screen coordinates
   static const uint16_t TS_MINX =  300;
   static const uint16_t TS_MAXX = 3800;
@@ -134,7 +198,22 @@ public:
   void loraSetup();              // init the LoRa board
   void loraLoop();               // service lora transactions
   void loraSend(const char *, ...); // send (TTN) LoRaWAN message
-  static const uint8_t LORA_PAYLOAD_LEN = 101; // max payload bytes (+ '\0')
+  uint32_t loraSendBytes(        // queue a binary uplink (its id, 0 if
+    uint8_t port, const uint8_t *data, uint8_t len, // dropped)
+    bool confirmed = false, uint8_t priority = 0
+  );
+  void loraOnDelivery(lora_delivery_cb_t cb); // uplink outcomes, by id
+  static const uint8_t LORA_PAYLOAD_LEN = LORA_MSG_MAX + 1; // (+ '\0')
+  static const uint8_t LORA_LPP_PORT = ::LORA_LPP_PORT;     // fPorts (see
+  static const uint8_t LORA_BATCH_PORT = ::LORA_BATCH_PORT; // ttn-lora.h)
+  static const uint8_t LORA_CMD_PORT = ::LORA_CMD_PORT;
+  bool loraBatchAdd(             // batch a small reading into a shared frame
+    uint8_t channel, int32_t value, bool priority = false
+  );
+  bool loraOnDownlink(           // handle downlinks (see lora-downlink.h)
+    uint8_t port, int16_t opcode, lora_downlink_handler_t handler,
+    uint8_t minArgs = 0, void *ctx = NULL
+  );
 #if UNPHONE_SPIN == 7
   static const uint8_t LMIC_DIO0 = 39;
   static const uint8_t LMIC_DIO1 = 26;
@@ -151,6 +230,21 @@ public:
   static const byte BM_VERSION  = 0x0a; // vender / part / revision status reg
   float batteryVoltage(); // get the battery voltage
   void setShipping(bool value); // tells BM chip to shut down
+
+  // battery telemetry: a low-rate sampler feeding a ring of recent history
+  // (see battery.cpp); batterySample is called from the task that owns SPI
+  typedef struct {
+    uint32_t millis;      // when the sample was taken
+    uint16_t millivolts;  // battery voltage (via the touch controller's ADC)
+    bool usb;             // USB power connected?
+    byte bmStatus;        // BM_STATUS register
+  } batterySample_t;
+  static const uint8_t  BATT_RING_SIZE = 64;      // samples of history kept
+  static const uint32_t BATT_SAMPLE_MS = 30000;   // sample period (millis)
+  void batterySample();           // take a sample if one is due
+  float batteryVoltageSmoothed(); // smoothed voltage (0.0 if no samples yet)
+  int32_t batterySecsToEmpty();   // time-to-empty estimate, or -1 if unknown
+  uint8_t batteryHistory(batterySample_t *, uint8_t); // copy, oldest first
   void setRegister(byte address, byte reg, byte value); //
   byte getRegister(byte address, byte reg);             // I²C...
   void write8(byte address, byte reg, byte value);      // ...helpers
@@ -206,18 +300,12 @@ class IOExpander {
     static void writeRegisterWord(uint8_t reg, uint16_t value);
 };
 
-// macros for debug (and error) calls to printf
-#ifdef UNPHONE_PRODUCTION_BUILD
-# define D(args...) (void)0;
-#else
-# define D(args...) printf(args);
-#endif
-#define  E(args...) printf("ERROR: " args);
+#include "debug.h"                // D() and E(), debug and error printf
 static const char *TAG = "MAIN";        // ESP logger debug tag
 
-// delay/yield/timing macros
-#define WAIT_A_SEC   vTaskDelay(    1000/portTICK_PERIOD_MS); // 1 second
-#define WAIT_SECS(n) vTaskDelay((n*1000)/portTICK_PERIOD_MS); // n seconds
-#define WAIT_MS(n)   vTaskDelay(       n/portTICK_PERIOD_MS); // n millis
+// delay/yield/timing macros (these release the SPI bus while waiting)
+#define WAIT_A_SEC   unPhone::me().spiWait(    1000); // 1 second
+#define WAIT_SECS(n) unPhone::me().spiWait((n*1000)); // n seconds
+#define WAIT_MS(n)   unPhone::me().spiWait(       n); // n millis
 
 #endif
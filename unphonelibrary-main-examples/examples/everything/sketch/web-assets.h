@@ -0,0 +1,39 @@
+// web-assets.h
+// GENERATED by web-assets.py from web/: edit those files, not this one
+
+#ifndef WEB_ASSETS_H
+#define WEB_ASSETS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+  const char *path;               // URL
+  const char *type;               // Content-Type
+  const char *etag;               // strong ETag (of the original)
+  const uint8_t *gz;              // gzipped content
+  size_t len;
+} web_asset_t;
+
+// style.css: 290 bytes, 194 gzipped
+static constexpr uint8_t asset_style_css[] = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x7d, 0xcf, 0x4b, 0x0a, 0x83, 0x30,
+  0x10, 0x80, 0xe1, 0xbd, 0xa7, 0x18, 0x90, 0xe2, 0xc6, 0x88, 0x85, 0x76, 0x13, 0xf7, 0xb9, 0x40,
+  0x4f, 0x90, 0xe8, 0x28, 0xa1, 0x79, 0x31, 0x89, 0x6d, 0x6d, 0xe9, 0xdd, 0x6b, 0x0a, 0x42, 0x71,
+  0xd1, 0x4d, 0x66, 0x31, 0x1f, 0xff, 0x10, 0xe5, 0x87, 0xa5, 0x86, 0x50, 0x83, 0x91, 0x0a, 0x4d,
+  0x0d, 0xda, 0x85, 0x39, 0xc1, 0x0b, 0x46, 0xef, 0x12, 0x87, 0x23, 0xa1, 0x85, 0x4a, 0x68, 0x92,
+  0x70, 0x91, 0x2e, 0x56, 0x35, 0xc4, 0x75, 0xb0, 0x88, 0xa4, 0xc7, 0xae, 0x00, 0x50, 0xb2, 0xbf,
+  0x4e, 0xe4, 0x67, 0x37, 0xf0, 0x52, 0x08, 0xd1, 0x41, 0xef, 0x8d, 0x27, 0x0e, 0x65, 0xdb, 0xb6,
+  0xdd, 0xb7, 0xc1, 0xa2, 0x7e, 0xe2, 0x1a, 0x3a, 0xb7, 0x87, 0x0e, 0xde, 0xc5, 0x96, 0xb7, 0x92,
+  0x26, 0xed, 0x38, 0x34, 0xa7, 0xf5, 0x42, 0x5e, 0x8c, 0x9e, 0x6c, 0x93, 0x1f, 0x86, 0x0f, 0x69,
+  0x83, 0xc1, 0x15, 0x0d, 0x3a, 0x06, 0x23, 0x17, 0x0e, 0x49, 0x2a, 0x83, 0x59, 0x0d, 0xfa, 0xf6,
+  0x1f, 0x31, 0xf2, 0xf7, 0x0d, 0xc6, 0x59, 0x59, 0x9d, 0x58, 0xf6, 0xbf, 0xae, 0x47, 0x97, 0x90,
+  0x32, 0xda, 0x7d, 0x79, 0x57, 0xea, 0xd1, 0x98, 0xac, 0x3e, 0x6d, 0x66, 0x32, 0x88, 0x22, 0x01,
+  0x00, 0x00,
+};
+
+static constexpr web_asset_t webAssets[] = {
+  { "/style.css", "text/css", "\"d24bb035847258f5\"", asset_style_css, sizeof(asset_style_css) },
+};
+
+#endif
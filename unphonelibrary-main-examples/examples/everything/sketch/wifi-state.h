@@ -0,0 +1,36 @@
+// wifi-state.h
+// the sketch's WiFi connection manager (wifi.cpp): a task driven by
+// WiFi.onEvent callbacks that moves through an explicit set of states,
+// rather than polling the connection. listeners hear about each change (on
+// the WiFi task, so they must be quick), and anyone can read the latest
+
+#ifndef WIFI_STATE_H
+#define WIFI_STATE_H
+
+#include <stdint.h>
+
+typedef enum {
+  WIFI_IDLE = 0,            // not started
+  WIFI_SCANNING,            // looking for one of our APs
+  WIFI_ASSOCIATING,         // joining an AP (and waiting for an address)
+  WIFI_CONNECTED,           // on the network
+  WIFI_BACKOFF,             // nothing joined; waiting retryMs to scan again
+} wifi_state_t;
+
+typedef struct {
+  uint32_t seq;             // bumped on every change
+  wifi_state_t state;
+  uint32_t retryMs;         // (WIFI_BACKOFF)
+} wifi_event_t;
+typedef void (*wifi_listener_t)(const wifi_event_t *);
+
+#ifndef WIFI_LISTENERS_MAX
+#  define WIFI_LISTENERS_MAX 4
+#endif
+
+void wifiAddAP(const char *ssid, const char *key); // an AP we may join
+void wifiBegin();                                  // start connecting
+bool wifiListen(wifi_listener_t);                  // false if no room
+wifi_event_t wifiStatus();                         // latest event
+
+#endif
@@ -0,0 +1,282 @@
+// wifi.cpp
+// WiFi connection management (see wifi-state.h). the access points we know
+// are private.h's _MULTI_SSIDn, added by wifiSetup. the WiFi task sleeps
+// until WiFi.onEvent tells it something happened (or a state times out), and
+// then moves on:
+//
+//   (start, or connection lost) -> ASSOCIATING with the last AP we were on
+//   ASSOCIATING -> CONNECTED, or SCANNING if that was the last AP, or BACKOFF
+//   SCANNING -> ASSOCIATING with the strongest AP of ours found, or BACKOFF
+//   BACKOFF -> SCANNING, after a wait that doubles with each failure
+//
+// the SSID, BSSID and channel of the last AP we joined (and our DHCP lease
+// on it) are kept in NVS, so the next connection, after boot or wake, can go
+// straight to that AP without a scan of every channel
+
+#include <WiFi.h>
+#include <Preferences.h>
+#include "unphone.h"
+#include "wifi-state.h"
+
+#ifndef WIFI_FAST_TIMEOUT_MS
+#  define WIFI_FAST_TIMEOUT_MS 3000 // give up on the cached AP, scan instead
+#endif
+#ifndef WIFI_FAST_STATIC_IP      // 1: reuse the last DHCP lease as a static
+#  define WIFI_FAST_STATIC_IP 0  // address too (saves the DHCP round trips,
+#endif                           // but only safe if leases are reserved)
+static const uint32_t WIFI_JOIN_TIMEOUT_MS = 10000;  // auth and DHCP
+static const uint32_t WIFI_SCAN_TIMEOUT_MS = 15000;  // (a scan is ~2 s)
+static const uint32_t WIFI_BACKOFF_MIN_MS = 1000;
+static const uint32_t WIFI_BACKOFF_MAX_MS = 30000;
+
+// what the event callback tells the task (as notification bits)
+static const uint32_t EV_GOT_IP = 1 << 0, EV_LOST = 1 << 1;
+static const uint32_t EV_SCAN_DONE = 1 << 2;
+
+static const uint8_t MAX_APS = 8;
+static struct { const char *ssid, *key; } knownAPs[MAX_APS];
+static uint8_t numAPs = 0;
+
+static wifi_event_t wifiLatest = { 0, WIFI_IDLE, 0 };
+static portMUX_TYPE wifiMux = portMUX_INITIALIZER_UNLOCKED;
+static wifi_listener_t listeners[WIFI_LISTENERS_MAX];
+static uint8_t numListeners = 0;
+
+typedef struct {
+  uint32_t magic;
+  char ssid[33];
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip, gateway, subnet, dns;  // (the lease)
+} wifi_fast_t;
+static const uint32_t WIFI_FAST_MAGIC = 0x57464131; // "WFA1"
+static const char *wifiPrefsName = "wifi-fast";
+static bool leaseInUse = false;       // WiFi.config'd with the last lease
+
+// an AP we may join (the strings must outlive us, e.g. literals)
+void wifiAddAP(const char *ssid, const char *key) {
+  if(numAPs < MAX_APS)
+    knownAPs[numAPs++] = { ssid, key };
+}
+
+// subscribe to state changes (before wifiBegin)
+bool wifiListen(wifi_listener_t l) {
+  if(numListeners == WIFI_LISTENERS_MAX) return false;
+  listeners[numListeners++] = l;
+  return true;
+}
+
+wifi_event_t wifiStatus() {
+  portENTER_CRITICAL(&wifiMux);
+  wifi_event_t e = wifiLatest;
+  portEXIT_CRITICAL(&wifiMux);
+  return e;
+}
+
+// move to a new state and tell the listeners
+static void enter(wifi_state_t state, uint32_t retryMs = 0) {
+  portENTER_CRITICAL(&wifiMux);
+  wifiLatest = { wifiLatest.seq + 1, state, retryMs };
+  wifi_event_t e = wifiLatest;
+  portEXIT_CRITICAL(&wifiMux);
+  for(uint8_t i = 0; i < numListeners; i++)
+    listeners[i](&e);
+}
+
+static const char *keyFor(const char *ssid) {
+  for(uint8_t i = 0; i < numAPs; i++)
+    if(strcmp(knownAPs[i].ssid, ssid) == 0) return knownAPs[i].key;
+  return NULL;
+}
+
+static bool readFast(wifi_fast_t *f) {
+  Preferences prefs;
+  prefs.begin(wifiPrefsName, true);
+  size_t got = prefs.getBytes("ap", f, sizeof(*f));
+  prefs.end();
+  return got == sizeof(*f) && f->magic == WIFI_FAST_MAGIC;
+}
+
+// back to DHCP if we'd borrowed the last lease
+static void useDHCP() {
+  if(!leaseInUse) return;
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  leaseInUse = false;
+}
+
+// start joining the AP we were last on; false if we don't have one
+static bool fastBegin() {
+  wifi_fast_t f;
+  if(!readFast(&f)) return false;
+  const char *key = keyFor(f.ssid);
+  if(key == NULL) return false;       // (no longer one of ours)
+
+  if(WIFI_FAST_STATIC_IP && f.ip != 0) {
+    WiFi.config(
+      IPAddress(f.ip), IPAddress(f.gateway), IPAddress(f.subnet),
+      IPAddress(f.dns)
+    );
+    leaseInUse = true;
+  }
+  D("wifi: rejoining %s on channel %u\n", f.ssid, f.channel)
+  WiFi.begin(f.ssid, key, f.channel, f.bssid);
+  return true;
+}
+
+// start joining the strongest of our APs that the scan found; false if none
+static bool scanBegin() {
+  int16_t found = WiFi.scanComplete();
+  int16_t best = -1;
+  for(int16_t i = 0; i < found; i++)
+    if(
+      keyFor(WiFi.SSID(i).c_str()) != NULL &&
+      (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best))
+    )
+      best = i;
+  if(best >= 0) {
+    String ssid = WiFi.SSID(best);
+    useDHCP();
+    D("wifi: joining %s on channel %d (%d dBm)\n",
+      ssid.c_str(), WiFi.channel(best), WiFi.RSSI(best))
+    WiFi.begin(
+      ssid.c_str(), keyFor(ssid.c_str()), WiFi.channel(best), WiFi.BSSID(best)
+    );
+  } else {
+    D("wifi: none of our APs in range (%d found)\n", found)
+  }
+  WiFi.scanDelete();
+  return best >= 0;
+}
+
+// note the AP we're connected to (and our lease), for fastBegin
+static void wifiRemember() {
+  wifi_fast_t f, old;
+  memset(&f, 0, sizeof(f));
+  f.magic = WIFI_FAST_MAGIC;
+  strncpy(f.ssid, WiFi.SSID().c_str(), sizeof(f.ssid) - 1);
+  uint8_t *bssid = WiFi.BSSID();
+  if(bssid == NULL) return;
+  memcpy(f.bssid, bssid, sizeof(f.bssid));
+  f.channel = WiFi.channel();
+  f.ip = WiFi.localIP();
+  f.gateway = WiFi.gatewayIP();
+  f.subnet = WiFi.subnetMask();
+  f.dns = WiFi.dnsIP();
+
+  if(readFast(&old) && memcmp(&old, &f, sizeof(f)) == 0)
+    return;                           // (spare the flash)
+  Preferences prefs;
+  prefs.begin(wifiPrefsName, false);
+  prefs.putBytes("ap", &f, sizeof(f));
+  prefs.end();
+}
+
+// (on the Arduino event task) wake the WiFi task
+static void onWiFiEvent(arduino_event_id_t event) {
+  uint32_t bits;
+  switch(event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:       bits = EV_GOT_IP;    break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED: bits = EV_LOST;      break;
+    case ARDUINO_EVENT_WIFI_SCAN_DONE:        bits = EV_SCAN_DONE; break;
+    default:                                  return;
+  }
+  TaskHandle_t task = unPhone::tasks[unPhone::TASK_WIFI].handle;
+  if(task != NULL)
+    xTaskNotify(task, bits, eSetBits);
+}
+
+// the WiFi task's state (it's the only one that touches these)
+static uint32_t backoffMs = WIFI_BACKOFF_MIN_MS;
+static uint32_t deadline = 0;         // when the current state times out
+static bool fast = false;             // associating with the last AP
+
+// wait before scanning again, a little longer each time
+static void backoff() {
+  deadline = millis() + backoffMs;
+  enter(WIFI_BACKOFF, backoffMs);
+  backoffMs = min(backoffMs * 2, WIFI_BACKOFF_MAX_MS);
+}
+
+// look for an AP: the last one we were on (if tryLast), else scan
+static void search(bool tryLast) {
+  fast = tryLast && fastBegin();
+  if(fast) {
+    deadline = millis() + WIFI_FAST_TIMEOUT_MS;
+    enter(WIFI_ASSOCIATING);
+  } else if(WiFi.scanNetworks(true) != WIFI_SCAN_FAILED) {
+    deadline = millis() + WIFI_SCAN_TIMEOUT_MS;
+    enter(WIFI_SCANNING);
+  } else {
+    backoff();
+  }
+}
+
+static void wifiTask(void *param) {
+  uint32_t lostAt = millis();         // (for the log)
+  search(true);
+  while(true) {
+    wifi_state_t state = wifiStatus().state;
+    int32_t waitMs = (int32_t) (deadline - millis());
+    uint32_t events = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &events,
+      state == WIFI_CONNECTED ? portMAX_DELAY :
+      max(waitMs, (int32_t) 0) / portTICK_PERIOD_MS
+    );
+    bool timedOut = state != WIFI_CONNECTED &&
+      (int32_t) (deadline - millis()) <= 0;
+
+    switch(state) {
+      case WIFI_ASSOCIATING:
+        if(events & EV_GOT_IP) {
+          D("wifi: connected to %s %lu ms after we started looking\n",
+            WiFi.SSID().c_str(), millis() - lostAt)
+          wifiRemember();
+          backoffMs = WIFI_BACKOFF_MIN_MS;
+          enter(WIFI_CONNECTED);
+        } else if((events & EV_LOST) || timedOut) {
+          WiFi.disconnect();
+          if(fast) {                  // (the last AP's moved or gone)
+            D("wifi: last AP not there, scanning\n")
+            useDHCP();
+            search(false);
+          } else {
+            backoff();
+          }
+        }
+        break;
+
+      case WIFI_SCANNING:
+        if((events & EV_SCAN_DONE) && scanBegin()) {
+          fast = false;
+          deadline = millis() + WIFI_JOIN_TIMEOUT_MS;
+          enter(WIFI_ASSOCIATING);
+        } else if((events & EV_SCAN_DONE) || timedOut) {
+          backoff();
+        }
+        break;
+
+      case WIFI_CONNECTED:
+        if(events & EV_LOST) {
+          D("wifi: connection lost\n")
+          lostAt = millis();
+          search(true);
+        }
+        break;
+
+      case WIFI_BACKOFF:
+        if(timedOut)
+          search(false);
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+// start connecting (once the APs are added)
+void wifiBegin() {
+  WiFi.setAutoReconnect(false);       // (the task decides what to join)
+  WiFi.onEvent(onWiFiEvent);
+  unPhone::me().startTask(unPhone::TASK_WIFI, wifiTask);
+}
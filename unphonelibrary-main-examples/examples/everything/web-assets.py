@@ -0,0 +1,72 @@
+# web-assets.py
+# gzip the static files in web/ into sketch/web-assets.h, a table of
+# constexpr byte arrays (in flash) that httpd.cpp serves with
+# Content-Encoding: gzip and an ETag. runs before each PlatformIO build
+# (extra_scripts in platformio.ini), or by hand: python3 web-assets.py
+
+import gzip, hashlib, os
+
+TYPES = {
+    ".css": "text/css", ".js": "application/javascript",
+    ".html": "text/html", ".svg": "image/svg+xml", ".ico": "image/x-icon",
+}
+
+def generate(root):
+    webDir = os.path.join(root, "web")
+    out = os.path.join(root, "sketch", "web-assets.h")
+    names = sorted(
+        n for n in os.listdir(webDir) if os.path.splitext(n)[1] in TYPES
+    )
+
+    lines = [
+        "// web-assets.h",
+        "// GENERATED by web-assets.py from web/: edit those files, not this one",
+        "",
+        "#ifndef WEB_ASSETS_H",
+        "#define WEB_ASSETS_H",
+        "",
+        "#include <stdint.h>",
+        "#include <stddef.h>",
+        "",
+        "typedef struct {",
+        "  const char *path;               // URL",
+        "  const char *type;               // Content-Type",
+        "  const char *etag;               // strong ETag (of the original)",
+        "  const uint8_t *gz;              // gzipped content",
+        "  size_t len;",
+        "} web_asset_t;",
+        "",
+    ]
+    table = []
+    for n in names:
+        data = open(os.path.join(webDir, n), "rb").read()
+        gz = gzip.compress(data, 9, mtime=0) # (mtime 0: reproducible output)
+        ident = "asset_" + "".join(c if c.isalnum() else "_" for c in n)
+        etag = hashlib.sha256(data).hexdigest()[:16]
+        lines.append("// %s: %d bytes, %d gzipped" % (n, len(data), len(gz)))
+        lines.append("static constexpr uint8_t %s[] = {" % ident)
+        for i in range(0, len(gz), 16):
+            lines.append("  " + ", ".join("0x%02x" % b for b in gz[i:i + 16]) + ",")
+        lines.append("};")
+        table.append('  { "/%s", "%s", "\\"%s\\"", %s, sizeof(%s) },' % (
+            n, TYPES[os.path.splitext(n)[1]], etag, ident, ident
+        ))
+    lines += [
+        "",
+        "static constexpr web_asset_t webAssets[] = {",
+    ] + table + [
+        "};",
+        "",
+        "#endif",
+        "",
+    ]
+    text = "\n".join(lines)
+    if not os.path.exists(out) or open(out).read() != text: # (don't rebuild)
+        open(out, "w").write(text)
+        print("web-assets.py: wrote %s (%d assets)" % (out, len(names)))
+
+try:                                      # as a PlatformIO extra script
+    Import("env")
+    generate(env.subst("$PROJECT_DIR"))
+except NameError:                         # by hand
+    generate(os.path.dirname(os.path.abspath(__file__)))
@@ -0,0 +1,100 @@
+# web-load.py
+# a load generator for the sketch's web server (httpd.cpp): n concurrent
+# clients hammer a set of routes for a while, then we report requests/sec and
+# latency percentiles per route as seen by the clients, and the device's own
+# per-route handler timings and heap deltas (from /api/routes; the heap
+# figure is approximate, as other tasks allocate while handlers run), e.g.:
+#
+#   python3 web-load.py 192.168.1.42 --clients 8 --seconds 30
+#   python3 web-load.py sketch.local --paths / /get?message=hi /style.css
+
+import argparse, http.client, json, threading, time
+from collections import defaultdict
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[round(p / 100 * (len(sorted_values) - 1))]
+
+def client(host, port, paths, deadline, results, errors, lock):
+    conn = http.client.HTTPConnection(host, port, timeout=10)
+    i = 0
+    while time.monotonic() < deadline:
+        path = paths[i % len(paths)]
+        i += 1
+        method, body, headers = "GET", None, {}
+        if path == "/post":
+            method, body = "POST", "message=load"
+            headers = {"Content-Type": "application/x-www-form-urlencoded"}
+        start = time.monotonic()
+        try:
+            conn.request(method, path, body, headers)
+            response = conn.getresponse()
+            response.read()
+            ok = response.status < 400
+        except (OSError, http.client.HTTPException):
+            ok = False
+            conn.close()
+            conn = http.client.HTTPConnection(host, port, timeout=10)
+        took = time.monotonic() - start
+        with lock:
+            if ok:
+                results[path].append(took)
+            else:
+                errors[path] += 1
+    conn.close()
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--seconds", type=float, default=20)
+    parser.add_argument("--paths", nargs="+", default=["/", "/get", "/post"])
+    args = parser.parse_args()
+
+    results, errors = defaultdict(list), defaultdict(int)
+    lock = threading.Lock()
+    deadline = time.monotonic() + args.seconds
+    threads = [
+        threading.Thread(target=client, args=(
+            args.host, args.port, args.paths[i:] + args.paths[:i], deadline,
+            results, errors, lock
+        ))
+        for i in range(args.clients)
+    ]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    print("%d clients, %.0f s" % (args.clients, args.seconds))
+    print("%-24s %8s %8s %9s %9s %7s" %
+        ("path", "req/s", "errors", "p50 ms", "p99 ms", "max ms"))
+    for path in args.paths:
+        times = sorted(results[path])
+        print("%-24s %8.1f %8d %9.1f %9.1f %7.1f" % (
+            path, len(times) / args.seconds, errors[path],
+            percentile(times, 50) * 1000, percentile(times, 99) * 1000,
+            (times[-1] if times else 0) * 1000,
+        ))
+
+    # what the device saw (handler time only; chunked pages stream later)
+    try:
+        conn = http.client.HTTPConnection(args.host, args.port, timeout=10)
+        conn.request("GET", "/api/routes")
+        routes = json.loads(conn.getresponse().read())
+    except (OSError, ValueError, http.client.HTTPException) as e:
+        print("\nno /api/routes: %s" % e)
+        return
+    print("\non the device:")
+    print("%-24s %6s %8s %9s %9s %9s" %
+        ("path", "method", "count", "mean us", "p99 us", "~heap B"))
+    for r in routes:
+        print("%-24s %6s %8d %9d %9d %9d" % (
+            r["path"], r["method"], r["count"], r["meanUs"], r["p99Us"],
+            r["approxHeapDelta"],
+        ))
+
+if __name__ == "__main__":
+    main()